@@ -18,4 +18,10 @@ fn main() {
             .unwrap();
         child.wait().unwrap();
     }
+
+    let mut child = Command::new("make")
+        .args(["-C", "loadgen"])
+        .spawn()
+        .unwrap();
+    child.wait().unwrap();
 }
@@ -0,0 +1,851 @@
+#define _GNU_SOURCE /* for accept4 */
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "server.h"
+
+#define MAX_EVENTS 512
+
+/*
+ * With BUSY_POLL=<us>, a worker busy polls while events come in at
+ * BUSY_POLL_RATE per ms or more, measured over windows of BUSY_POLL_WINDOW
+ * ms, and goes back to blocking in epoll_wait below half of it. Spinning
+ * saves the sleep and wakeup of each wait under load, but burns the CPU
+ * while idle, hence the switch.
+ */
+#define BUSY_POLL_WINDOW 10
+#define BUSY_POLL_RATE 20
+
+/* since Linux 6.9, see ioctl_eventpoll(2) */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+  uint32_t busy_poll_usecs;
+  uint16_t busy_poll_budget;
+  uint8_t prefer_busy_poll;
+  uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+/*
+ * With BATCH_FLUSH=1, the responses to the requests read from the events of
+ * one epoll_wait are sent in a second pass after all of them, see
+ * flush_batch, so that the requests of a connection read in more than one
+ * recv go out with one writev. A connection holds up to BATCH_MAX
+ * responses and stops reading short of it until they are sent.
+ */
+#define BATCH_MAX (4 * MAX_PIPELINED)
+
+typedef struct epoll_connection_s epoll_connection_t;
+
+typedef struct {
+  int epoll_fd;
+  int listener;
+  int shared_listener;
+  connection_pool_t pool;
+  response_t response;
+  /* a run left from a short writev and at most a run per request */
+  struct iovec iov[BATCH_MAX + 1];
+  int iov_responses[BATCH_MAX + 1];
+  epoll_connection_t *flush; /* the connections for flush_batch */
+  server_stats_t *stats;
+  file_cache_t *files; /* only with DOCUMENT_ROOT */
+  connection_timers_t timers;
+  int quitting; /* after SIGQUIT, see server_quit */
+  int busy_polling;
+  int epoll_params;      /* EPIOCSPARAMS is supported */
+  uint64_t window_start; /* in ms, of the events counted for busy polling */
+  unsigned window_events;
+} epoll_worker_t;
+
+/*
+ * Without DOCUMENT_ROOT, the responses to the requests framed from a read
+ * are sent with one writev. A large body may not fit in the socket buffer,
+ * so the rest is continued on EPOLLOUT, and the connection is not read until
+ * it is sent.
+ */
+struct epoll_connection_s {
+  connection_t core;
+  unsigned closing : 1;  /* after the responses being sent */
+  unsigned flushing : 1; /* in the flush list of the worker */
+  unsigned unread : 1;   /* stopped reading at BATCH_MAX */
+  struct iovec out;      /* the rest of a run of responses */
+  int queued;            /* responses to take after it */
+  int pending;           /* requests whose responses are not sent yet */
+  uint64_t start_ns;     /* of the oldest pending request */
+  epoll_connection_t *next_flush;
+};
+
+/*
+ * With DOCUMENT_ROOT, requests are answered one at a time from files, and a
+ * response which does not fit in the socket buffer is continued on
+ * EPOLLOUT.
+ */
+typedef struct {
+  connection_t core;
+  unsigned sending : 1;
+  unsigned closing : 1; /* after the response being sent */
+  int header_len;
+  int header_sent;
+  char header[RESPONSE_BUF_SIZE];
+  cached_file_t *file; /* the body, NULL for an error response */
+  off_t offset;        /* of the body sent */
+  uint64_t start_ns;
+} file_connection_t;
+
+static const char *document_root;
+static int busy_poll; /* in us, 0 to always block */
+static int batch_flush;
+
+static void close_connection(epoll_worker_t *wk, connection_t *c) {
+  file_connection_t *fc;
+
+  if (wk->files != NULL) {
+    fc = (file_connection_t *)c;
+    if (fc->sending && fc->file != NULL) {
+      file_cache_put(fc->file);
+    }
+  }
+  connection_timer_del(&wk->timers, c);
+  close(c->fd);
+  wk->stats->syscalls++;
+  free_connection(&wk->pool, c);
+}
+
+/*
+ * Re-add the socket periodically so that other workers will get a chance to
+ * accept connections. See ngx_reorder_accept_events.
+ */
+static void reorder_accept_events(epoll_worker_t *wk) {
+  struct epoll_event ev;
+
+  ev.events = 0;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_DEL, wk->listener, &ev) == -1) {
+    perror("epoll_ctl: del server_fd");
+    exit(EXIT_FAILURE);
+  }
+
+  wk->stats->syscalls += 2;
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, wk->listener, &ev) == -1) {
+    perror("epoll_ctl: add server_fd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void handle_accept(epoll_worker_t *wk, unsigned *accepts) {
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len = sizeof(client_addr);
+  struct epoll_event ev;
+  connection_t *c;
+  int client_fd;
+
+  client_fd = accept4(wk->listener, (struct sockaddr *)&client_addr,
+                      &client_addr_len, SOCK_NONBLOCK);
+  wk->stats->syscalls++;
+  if (client_fd == -1) {
+    if (errno == EAGAIN) {
+      wk->stats->eagains++;
+    } else {
+      perror("accept");
+    }
+    return;
+  }
+  wk->stats->accepts++;
+
+  if (wk->shared_listener && (*accepts)++ % 16 == 0) {
+    reorder_accept_events(wk);
+  }
+
+  c = get_connection(&wk->pool, client_fd);
+  if (c == NULL) {
+    close(client_fd);
+    return;
+  }
+  if (wk->files != NULL) {
+    ((file_connection_t *)c)->sending = 0;
+    ((file_connection_t *)c)->closing = 0;
+  } else {
+    /* with BATCH_FLUSH it is inherited from the listener */
+    c->tcp_nodelay = batch_flush;
+    ((epoll_connection_t *)c)->closing = 0;
+    ((epoll_connection_t *)c)->flushing = 0;
+    ((epoll_connection_t *)c)->unread = 0;
+    ((epoll_connection_t *)c)->out.iov_len = 0;
+    ((epoll_connection_t *)c)->queued = 0;
+    ((epoll_connection_t *)c)->pending = 0;
+  }
+  /* registered once for both, as ngx_epoll_add_connection does */
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  wk->stats->syscalls++;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+    perror("epoll_ctl: client_fd");
+    close_connection(wk, c);
+    return;
+  }
+  connection_timer(&wk->timers, c, TIMER_HEADER);
+}
+
+/* Closes a connection whose timer expired. */
+static void expire_connection(wheel_timer_t *t, void *arg) {
+  epoll_worker_t *wk = arg;
+
+  wk->stats->timeouts++;
+  close_connection(wk, connection_of_timer(t));
+}
+
+/*
+ * Stops accepting on SIGQUIT, so that the connections in the queue of the
+ * listener are left to the other workers or the new binary. See
+ * ngx_close_listening_sockets.
+ */
+static void stop_accepting(epoll_worker_t *wk) {
+  struct epoll_event ev;
+
+  wk->quitting = 1;
+  ev.events = 0;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_DEL, wk->listener, &ev) == -1) {
+    perror("epoll_ctl: del server_fd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * A connection waits for its next request only with the keepalive timer,
+ * which is closed while quitting, like ngx_close_idle_connections. Others
+ * are closed once their response is sent and they turn idle.
+ */
+static void close_idle_connection(connection_t *c, void *arg) {
+  if (c->timer_kind == TIMER_KEEPALIVE) {
+    close_connection(arg, c);
+  }
+}
+
+/*
+ * Sends the rest of the run being sent and then the queued responses with
+ * one writev. Returns 0 when everything is sent, 1 when the socket buffer is
+ * full, or -1 on an error.
+ *
+ * The Date of a run left over may be patched if it waits for more than a
+ * second, which at worst changes the Date it sends.
+ */
+static int send_responses(epoll_worker_t *wk, epoll_connection_t *ec) {
+  struct iovec *iov = wk->iov;
+  int *responses = wk->iov_responses;
+  ssize_t sent;
+  int n, i, k;
+
+  while (ec->out.iov_len > 0 || ec->queued > 0) {
+    n = 0;
+    if (ec->out.iov_len > 0) {
+      iov[n] = ec->out;
+      responses[n++] = 0;
+    }
+    if (ec->queued > 0 && response_update(&wk->response) == -1) {
+      return -1;
+    }
+    for (k = 0; k < ec->queued; k += responses[n++]) {
+      responses[n] = response_next(&wk->response, ec->queued - k, &iov[n]);
+    }
+    ec->queued = 0;
+
+    sent = writev(ec->core.fd, iov, n);
+    wk->stats->syscalls++;
+    if (sent == -1) {
+      if (errno != EAGAIN) {
+        perror("writev");
+        return -1;
+      }
+      sent = 0;
+    }
+    wk->stats->bytes_out += sent;
+
+    for (i = 0; i < n && (size_t)sent >= iov[i].iov_len; i++) {
+      sent -= iov[i].iov_len;
+    }
+    if (i < n) {
+      ec->out.iov_base = (char *)iov[i].iov_base + sent;
+      ec->out.iov_len = iov[i].iov_len - sent;
+      /* the runs not started are taken again when the socket is writable */
+      for (k = i + 1; k < n; k++) {
+        ec->queued += responses[k];
+      }
+      response_unget(&wk->response, ec->queued);
+      return 1;
+    }
+    ec->out.iov_len = 0;
+  }
+  return 0;
+}
+
+/*
+ * Continues the responses of the connection. Returns 0 when they are sent,
+ * 1 when the socket buffer is full, or -1 when the connection is closed.
+ */
+static int flush_responses(epoll_worker_t *wk, epoll_connection_t *ec) {
+  server_stats_t *st = wk->stats;
+  int rc;
+
+  rc = send_responses(wk, ec);
+  if (rc == 1) {
+    connection_timer(&wk->timers, &ec->core, TIMER_SEND);
+    return 1;
+  }
+  if (rc == 0) {
+    st->requests += ec->pending;
+    stats_record(&st->service_time_ns, stats_now_ns() - ec->start_ns,
+                 ec->pending);
+    ec->pending = 0;
+  }
+  st->syscalls += !ec->core.tcp_nodelay && rc == 0 && !ec->closing;
+  if (rc == -1 || ec->closing || set_tcp_nodelay(&ec->core) == -1) {
+    close_connection(wk, &ec->core);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Closes a connection, or with BATCH_FLUSH one in the flush list once its
+ * responses are sent, since the list still points to it.
+ */
+static void end_connection(epoll_worker_t *wk, epoll_connection_t *ec) {
+  if (ec->flushing) {
+    ec->closing = 1;
+    ec->unread = 0;
+    return;
+  }
+  close_connection(wk, &ec->core);
+}
+
+/* Both EPOLLIN and EPOLLOUT come here. */
+static void handle_event(epoll_worker_t *wk, epoll_connection_t *ec) {
+  connection_t *c = &ec->core;
+  server_stats_t *st = wk->stats;
+  int n, size, nreq, closing;
+
+  if (ec->pending > 0 && flush_responses(wk, ec) != 0) {
+    return;
+  }
+
+  /* read until EAGAIN, the edge is not reported again for old data */
+  for (;;) {
+    size = BUF_SIZE - c->last;
+    n = recv(c->fd, c->buf + c->last, size, 0);
+    st->syscalls++;
+    if (n <= 0) {
+      if (n < 0) {
+        if (errno == EAGAIN) {
+          st->eagains++;
+          connection_timer_read(&wk->timers, c);
+          return;
+        }
+        perror("read error");
+      }
+      end_connection(wk, ec);
+      return;
+    }
+    if (ec->pending == 0) {
+      ec->start_ns = stats_now_ns();
+    }
+    st->bytes_in += n;
+    c->last += n;
+
+    nreq = frame_requests(c, &closing);
+    if (nreq == -1) {
+      fprintf(stderr, "too large request header\n");
+      end_connection(wk, ec);
+      return;
+    }
+    if (nreq > 0) {
+      ec->queued += nreq;
+      ec->pending += nreq;
+      ec->closing = closing;
+      if (!batch_flush) {
+        if (flush_responses(wk, ec) != 0) {
+          return;
+        }
+      } else {
+        if (!ec->flushing) {
+          ec->flushing = 1;
+          ec->next_flush = wk->flush;
+          wk->flush = ec;
+        }
+        if (closing || ec->pending + MAX_PIPELINED > BATCH_MAX) {
+          /* the rest is read once the responses are sent */
+          ec->unread = !closing;
+          return;
+        }
+      }
+    }
+
+    if (n < size) {
+      /* the socket is drained, see ngx_unix_recv */
+      connection_timer_read(&wk->timers, c);
+      return;
+    }
+  }
+}
+
+/*
+ * The second pass of BATCH_FLUSH over the connections with responses from
+ * this batch of events. A connection which stopped reading at BATCH_MAX
+ * reads on once they are sent, and may queue itself again.
+ */
+static void flush_batch(epoll_worker_t *wk) {
+  epoll_connection_t *ec;
+  int unread;
+
+  while ((ec = wk->flush) != NULL) {
+    wk->flush = ec->next_flush;
+    ec->flushing = 0;
+    unread = ec->unread;
+    ec->unread = 0;
+    if (flush_responses(wk, ec) == 0 && unread) {
+      handle_event(wk, ec);
+    }
+  }
+}
+
+/* Returns the status of the request line in buf[0, n). */
+static int start_file_response(epoll_worker_t *wk, file_connection_t *fc,
+                               size_t n) {
+  const char *buf = fc->core.buf, *path, *end;
+  size_t len;
+  int status;
+
+  fc->start_ns = stats_now_ns();
+  fc->file = NULL;
+  fc->offset = 0;
+  fc->header_sent = 0;
+  fc->sending = 1;
+  if (response_update(&wk->response) == -1) {
+    return -1;
+  }
+
+  /* "GET /path?query HTTP/1.1", the query is ignored */
+  end = memchr(buf, '\n', n);
+  path = memchr(buf, ' ', end - buf);
+  if (path == NULL || path[1] != '/') {
+    status = 400;
+  } else {
+    path++;
+    for (len = 0; path + len < end; len++) {
+      if (path[len] == ' ' || path[len] == '?' || path[len] == '\r') {
+        break;
+      }
+    }
+    fc->file = file_cache_get(wk->files, path, len, wk->response.now);
+    if (fc->file != NULL) {
+      status = 200;
+    } else if (errno == EACCES) {
+      status = 403;
+    } else if (errno == ENOENT || errno == ENOTDIR || errno == EISDIR ||
+               errno == ENAMETOOLONG) {
+      status = 404;
+    } else {
+      status = 500;
+    }
+  }
+
+  fc->header_len =
+      response_header(&wk->response, fc->header, sizeof(fc->header), status,
+                      fc->file != NULL ? fc->file->size : 0);
+  return status;
+}
+
+/*
+ * Sends the rest of the response. Returns 0 when it is sent, 1 when the
+ * socket buffer is full, or -1 on an error.
+ */
+static int send_file_response(epoll_worker_t *wk, file_connection_t *fc) {
+  server_stats_t *st = wk->stats;
+  cached_file_t *file = fc->file;
+  int fd = fc->core.fd;
+  ssize_t n;
+
+  while (fc->header_sent < fc->header_len) {
+    /* the header goes out with the start of the body */
+    n = send(fd, fc->header + fc->header_sent,
+             fc->header_len - fc->header_sent,
+             file != NULL && file->size > 0 ? MSG_MORE : 0);
+    st->syscalls++;
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return 1;
+      }
+      perror("send");
+      return -1;
+    }
+    fc->header_sent += n;
+    st->bytes_out += n;
+  }
+
+  while (file != NULL && fc->offset < file->size) {
+    n = sendfile(fd, file->fd, &fc->offset, file->size - fc->offset);
+    st->syscalls++;
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return 1;
+      }
+      perror("sendfile");
+      return -1;
+    }
+    if (n == 0) {
+      fprintf(stderr, "file was truncated\n");
+      return -1;
+    }
+    st->bytes_out += n;
+  }
+
+  if (file != NULL) {
+    file_cache_put(file);
+    fc->file = NULL;
+  }
+  fc->sending = 0;
+  st->requests++;
+  stats_record(&st->service_time_ns, stats_now_ns() - fc->start_ns, 1);
+  return 0;
+}
+
+/*
+ * Both EPOLLIN and EPOLLOUT come here. The response being sent is
+ * continued first, and only then the next request is framed, so a slow
+ * reader leaves the rest of its requests in the socket.
+ */
+static void handle_file_event(epoll_worker_t *wk, file_connection_t *fc) {
+  connection_t *c = &fc->core;
+  server_stats_t *st = wk->stats;
+  size_t n;
+  int rc;
+
+  for (;;) {
+    if (fc->sending) {
+      rc = send_file_response(wk, fc);
+      if (rc == 1) {
+        connection_timer(&wk->timers, c, TIMER_SEND);
+        return;
+      }
+      if (rc == -1 || fc->closing) {
+        close_connection(wk, c);
+        return;
+      }
+    }
+
+    n = http_scan_header(c->buf, c->last, &c->header);
+    if (n > 0) {
+      if (start_file_response(wk, fc, n) == -1) {
+        close_connection(wk, c);
+        return;
+      }
+      if (c->header.connection_close) {
+        /* the requests after it are discarded */
+        fc->closing = 1;
+        c->last = 0;
+      } else {
+        memmove(c->buf, c->buf + n, c->last - n);
+        c->last -= n;
+        st->syscalls += !c->tcp_nodelay;
+        if (set_tcp_nodelay(c) == -1) {
+          close_connection(wk, c);
+          return;
+        }
+      }
+      http_header_init(&c->header);
+      continue;
+    }
+    if (c->last == BUF_SIZE) {
+      fprintf(stderr, "too large request header\n");
+      close_connection(wk, c);
+      return;
+    }
+
+    n = recv(c->fd, c->buf + c->last, BUF_SIZE - c->last, 0);
+    st->syscalls++;
+    if ((ssize_t)n <= 0) {
+      if ((ssize_t)n < 0) {
+        if (errno == EAGAIN) {
+          st->eagains++;
+          connection_timer_read(&wk->timers, c);
+          return;
+        }
+        perror("read error");
+      }
+      close_connection(wk, c);
+      return;
+    }
+    st->bytes_in += n;
+    c->last += n;
+  }
+}
+
+/*
+ * Turns the busy polling of the NAPI contexts of the sockets in epoll_wait
+ * on or off. Where EPIOCSPARAMS is not supported, the worker only spins on
+ * epoll_wait in spin_wait.
+ */
+static void set_busy_polling(epoll_worker_t *wk, int on) {
+  struct epoll_params params;
+
+  wk->busy_polling = on;
+  if (!wk->epoll_params) {
+    return;
+  }
+  memset(&params, 0, sizeof(params));
+  params.busy_poll_usecs = on ? busy_poll : 0;
+  params.prefer_busy_poll = on;
+  if (ioctl(wk->epoll_fd, EPIOCSPARAMS, &params) == -1) {
+    perror("ioctl EPIOCSPARAMS failed");
+    wk->epoll_params = 0;
+  }
+}
+
+/* Switches between spinning and blocking by the event rate of a window. */
+static void adapt_busy_polling(epoll_worker_t *wk, int nfds) {
+  uint64_t elapsed = wk->timers.now - wk->window_start;
+  unsigned rate;
+
+  wk->window_events += nfds;
+  if (elapsed < BUSY_POLL_WINDOW) {
+    return;
+  }
+  rate = wk->window_events / elapsed;
+  if (!wk->busy_polling && rate >= BUSY_POLL_RATE) {
+    set_busy_polling(wk, 1);
+  } else if (wk->busy_polling && rate < BUSY_POLL_RATE / 2) {
+    set_busy_polling(wk, 0);
+  }
+  wk->window_start = wk->timers.now;
+  wk->window_events = 0;
+}
+
+/*
+ * Polls without blocking for up to busy_poll us, each of which also polls
+ * the NAPI contexts once with EPIOCSPARAMS. Returns as epoll_wait, with 0
+ * when nothing came.
+ */
+static int spin_wait(epoll_worker_t *wk, struct epoll_event *events) {
+  uint64_t end = stats_now_ns() + (uint64_t)busy_poll * 1000;
+  int nfds;
+
+  do {
+    nfds =
+        epoll_pwait(wk->epoll_fd, events, MAX_EVENTS, 0, &server_wait_mask);
+    wk->stats->syscalls++;
+    if (nfds != 0) {
+      return nfds;
+    }
+    wk->stats->spins++;
+  } while (stats_now_ns() < end);
+  return 0;
+}
+
+static void *epoll_worker(void *arg) {
+  server_worker_t *w = arg;
+  struct epoll_event ev, events[MAX_EVENTS];
+  epoll_worker_t wk;
+  unsigned accepts = 0;
+  uint64_t next;
+  int nfds, timeout, i;
+
+  wk.listener = w->listener;
+  wk.shared_listener = !w->conf->reuseport;
+  wk.stats = w->stats;
+  wk.files = NULL;
+  if (document_root != NULL) {
+    wk.files = malloc(sizeof(file_cache_t));
+    if (wk.files == NULL || file_cache_init(wk.files, document_root) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  connection_pool_init(&wk.pool, WORKER_CONNECTIONS,
+                       wk.files != NULL ? sizeof(file_connection_t)
+                                        : sizeof(epoll_connection_t),
+                       1);
+  if (response_init(&wk.response, w->conf) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  connection_timers_init(&wk.timers, w->conf);
+  wk.quitting = 0;
+  wk.flush = NULL;
+
+  wk.epoll_fd = epoll_create1(0);
+  if (wk.epoll_fd == -1) {
+    perror("epoll_create1 failed");
+    exit(EXIT_FAILURE);
+  }
+  wk.busy_polling = 0;
+  wk.epoll_params = busy_poll > 0;
+  wk.window_start = wk.timers.now;
+  wk.window_events = 0;
+
+  /* the listener is the only event without a connection */
+  ev.events = wk.shared_listener ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(wk.epoll_fd, EPOLL_CTL_ADD, wk.listener, &ev) == -1) {
+    perror("epoll_ctl: add server_fd");
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    if (server_quit) {
+      if (!wk.quitting) {
+        stop_accepting(&wk);
+      }
+      connection_pool_each(&wk.pool, close_idle_connection, &wk);
+      if (wk.pool.free_n == wk.pool.n) {
+        break;
+      }
+    }
+
+    /* the timers need no syscall of their own, epoll_wait waits for them */
+    next = timer_wheel_next(&wk.timers.wheel);
+    timeout = -1;
+    if (next != UINT64_MAX) {
+      timeout = next > wk.timers.now ? (int)(next - wk.timers.now) : 0;
+    }
+
+    nfds = wk.busy_polling ? spin_wait(&wk, events) : 0;
+    if (nfds == 0) {
+      nfds = epoll_pwait(wk.epoll_fd, events, MAX_EVENTS, timeout,
+                         &server_wait_mask);
+      wk.stats->syscalls++;
+    }
+    if (nfds == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    wk.stats->polls++;
+    wk.stats->events += nfds;
+    connection_timers_update(&wk.timers);
+    if (busy_poll > 0) {
+      adapt_busy_polling(&wk, nfds);
+    }
+
+    for (i = 0; i < nfds; i++) {
+      if (events[i].data.ptr == NULL) {
+        handle_accept(&wk, &accepts);
+      } else if (wk.files != NULL) {
+        handle_file_event(&wk, events[i].data.ptr);
+      } else {
+        handle_event(&wk, events[i].data.ptr);
+      }
+    }
+
+    flush_batch(&wk);
+
+    /*
+     * After the events, since an expired connection is freed and an event
+     * of this batch, or the flush list, may still point to it.
+     */
+    timer_wheel_expire(&wk.timers.wheel, wk.timers.now, expire_connection,
+                       &wk);
+  }
+  return NULL;
+}
+
+/*
+ * Reads BATCH_FLUSH, with which the listeners get TCP_NODELAY for the
+ * accepted sockets to inherit, instead of a setsockopt per connection.
+ */
+static void init_batch_flush(server_conf_t *conf) {
+  int i, on;
+
+  batch_flush = get_flag_from_env("BATCH_FLUSH");
+  printf("batch_flush=%d\n", batch_flush);
+  if (!batch_flush) {
+    return;
+  }
+  if (document_root != NULL) {
+    fprintf(stderr, "BATCH_FLUSH is ignored with DOCUMENT_ROOT\n");
+    batch_flush = 0;
+    return;
+  }
+  on = 1;
+  for (i = 0; i < conf->listener_n; i++) {
+    if (setsockopt(conf->listeners[i], IPPROTO_TCP, TCP_NODELAY, &on,
+                   sizeof(int)) == -1) {
+      perror("setsockopt TCP_NODELAY: listener");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+static void read_document_root(void) {
+  document_root = getenv("DOCUMENT_ROOT");
+  if (document_root != NULL) {
+    printf("document_root=%s\n", document_root);
+  }
+}
+
+/*
+ * Reads BUSY_POLL, and lets the sockets busy poll their NAPI context on a
+ * read which finds nothing. The accepted sockets inherit the options of the
+ * listeners. Raising SO_BUSY_POLL above net.core.busy_read needs
+ * CAP_NET_ADMIN, without which only the epoll side is used.
+ */
+static void init_busy_poll(server_conf_t *conf) {
+  char *val = getenv("BUSY_POLL");
+  int i, on;
+
+  busy_poll = val != NULL ? atoi(val) : 0;
+  printf("busy_poll=%d\n", busy_poll);
+  if (busy_poll <= 0) {
+    busy_poll = 0;
+    return;
+  }
+  on = 1;
+  for (i = 0; i < conf->listener_n; i++) {
+    if (setsockopt(conf->listeners[i], SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(int)) == -1) {
+      perror("setsockopt SO_BUSY_POLL failed");
+      return;
+    }
+    if (setsockopt(conf->listeners[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &on,
+                   sizeof(int)) == -1) {
+      perror("setsockopt SO_PREFER_BUSY_POLL failed");
+      return;
+    }
+  }
+}
+
+int epoll_threads_run(server_conf_t *conf) {
+  int rc;
+
+  read_document_root();
+  server_open_listeners(conf, 1);
+  init_busy_poll(conf);
+  init_batch_flush(conf);
+  rc = server_run_threads(conf, epoll_worker);
+  server_close_listeners(conf);
+  return rc;
+}
+
+int epoll_prefork_run(server_conf_t *conf) {
+  int rc;
+
+  read_document_root();
+  server_open_listeners(conf, 1);
+  init_busy_poll(conf);
+  init_batch_flush(conf);
+  rc = server_run_processes(conf, epoll_worker);
+  server_close_listeners(conf);
+  return rc;
+}
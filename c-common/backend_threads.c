@@ -0,0 +1,542 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "queue.h"
+#include "server.h"
+
+#define THREADS_STACK_SIZE (64 * 1024)
+#define POLL_EVENTS 64
+/* the pause of an acceptor out of fds, like accept_mutex_delay of nginx */
+#define ACCEPT_DELAY_MS 100
+
+static const char *modes[] = {"accept", "queue", "spawn"};
+
+static int acceptors;
+static fd_queue_t queue;
+/* the listener and the idle connections of the queue mode */
+static int poll_fd;
+/* the connections of the queue mode by fd, with their partial requests */
+static connection_t **connections;
+static size_t stack_size;
+
+/*
+ * The responses of the connection threads which exited, reused by the next
+ * ones, so that each connection does not build its own.
+ */
+typedef struct cached_response_s cached_response_t;
+
+struct cached_response_s {
+  response_t response;
+  cached_response_t *next;
+};
+
+/* also serializes the stats of the connection threads and their acceptor */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_response_t *free_responses;
+
+typedef struct {
+  server_worker_t *worker;
+  int fd;
+} connection_thread_t;
+
+/*
+ * Returns whether an accept failed for a lack of fds or memory, after which
+ * the acceptor pauses for ACCEPT_DELAY_MS so that some connections close
+ * meanwhile.
+ */
+static int out_of_fds(void) {
+  if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS &&
+      errno != ENOMEM) {
+    return 0;
+  }
+  perror("Client accept failed");
+  return 1;
+}
+
+static int accept_connection(server_worker_t *w) {
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_size;
+  int client_fd;
+
+  while (1) {
+    client_addr_size = sizeof(client_addr);
+    client_fd = accept(w->listener, (struct sockaddr *)&client_addr,
+                       &client_addr_size);
+    if (client_fd >= 0) {
+      return client_fd;
+    }
+    if (errno == EINTR || errno == ECONNABORTED) {
+      continue;
+    }
+    if (out_of_fds()) {
+      usleep(ACCEPT_DELAY_MS * 1000);
+      continue;
+    }
+    perror("Client accept failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Sets the SO_RCVTIMEO or SO_SNDTIMEO option of fd to ms, none for 0. */
+static int set_socket_timeout(int fd, int option, long ms,
+                              server_stats_t *st) {
+  struct timeval tv;
+
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = ms % 1000 * 1000;
+  st->syscalls++;
+  if (setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv)) == -1) {
+    perror("setsockopt timeout");
+    return -1;
+  }
+  return 0;
+}
+
+/* Bounds the blocking writev calls on fd by the send timeout. */
+static void set_send_timeout(int fd, const long *timeouts, server_stats_t *st) {
+  if (timeouts[TIMER_SEND] > 0) {
+    set_socket_timeout(fd, SO_SNDTIMEO, timeouts[TIMER_SEND], st);
+  }
+}
+
+/*
+ * Bounds the blocking reads of c by the header timeout from accept and
+ * within a request, and by the keepalive timeout between requests. The
+ * kind set is kept in timer_kind, so the option only changes with it.
+ * Unlike the timers of the event backends, the header timeout bounds each
+ * read rather than the whole header.
+ */
+static int set_read_timeout(connection_t *c, const long *timeouts,
+                            server_stats_t *st) {
+  int kind = c->last > 0 || c->timer_kind == TIMER_NONE ? TIMER_HEADER
+                                                         : TIMER_KEEPALIVE;
+
+  if (kind == c->timer_kind) {
+    return 0;
+  }
+  c->timer_kind = kind;
+  return set_socket_timeout(c->fd, SO_RCVTIMEO, timeouts[kind], st);
+}
+
+/*
+ * Serves a connection with blocking read and writev until it is closed, and
+ * returns 0. With yield set, the reads do not block, and it returns 1
+ * instead once the bytes read so far are answered, so that the connection
+ * is polled until the next ones. A partial request is kept in c. A read or
+ * writev which times out closes the connection.
+ */
+static int serve_connection(connection_t *c, response_t *response,
+                            const long *timeouts, server_stats_t *st,
+                            int yield) {
+  struct iovec iov[MAX_PIPELINED];
+  int read_len, nreq, closing, i, n;
+  ssize_t sent, len;
+  uint64_t start;
+
+  while (1) {
+    if (!yield && set_read_timeout(c, timeouts, st) == -1) {
+      break;
+    }
+    read_len = recv(c->fd, c->buf + c->last, BUF_SIZE - c->last,
+                    yield ? MSG_DONTWAIT : 0);
+    st->syscalls++;
+    if (read_len == -1 && errno == EAGAIN) {
+      if (yield) {
+        st->eagains++;
+        return 1;
+      }
+      st->timeouts++;
+      break;
+    }
+    if (read_len <= 0) {
+      if (read_len < 0) {
+        perror("read error");
+      }
+      break;
+    }
+    start = stats_now_ns();
+    st->bytes_in += read_len;
+    c->last += read_len;
+
+    nreq = frame_requests(c, &closing);
+    if (nreq == -1) {
+      fprintf(stderr, "too large request header\n");
+      break;
+    }
+    if (nreq == 0) {
+      /* the request continues in the next read */
+      continue;
+    }
+
+    if (response_update(response) == -1) {
+      break;
+    }
+    /* one writev answers every request framed from this read */
+    for (i = 0, n = 0, len = 0; i < nreq; n++) {
+      i += response_next(response, nreq - i, &iov[n]);
+      len += iov[n].iov_len;
+    }
+    sent = writev(c->fd, iov, n);
+    st->syscalls++;
+    if (sent == -1 && errno != EAGAIN) {
+      perror("writev");
+      break;
+    }
+    if (sent < len) {
+      /* SO_SNDTIMEO expired with the responses partly sent */
+      st->timeouts++;
+      break;
+    }
+    st->requests += nreq;
+    st->bytes_out += sent;
+    stats_record(&st->service_time_ns, stats_now_ns() - start, nreq);
+    st->syscalls += !closing && !c->tcp_nodelay;
+    if (closing || set_tcp_nodelay(c) == -1) {
+      break;
+    }
+    if (yield && c->last == 0) {
+      return 1;
+    }
+  }
+  close(c->fd);
+  st->syscalls++;
+  return 0;
+}
+
+/* Serves one connection at a time with blocking accept, read and writev. */
+static void *threads_worker(void *arg) {
+  server_worker_t *w = arg;
+  response_t response;
+  char buf[BUF_SIZE];
+  connection_t c;
+
+  if (response_init(&response, w->conf) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  c.buf = buf;
+  while (1) {
+    init_connection(&c, accept_connection(w));
+    w->stats->accepts++;
+    w->stats->syscalls++;
+    set_send_timeout(c.fd, w->conf->timeouts, w->stats);
+    serve_connection(&c, &response, w->conf->timeouts, w->stats, 0);
+  }
+  return NULL;
+}
+
+/* Has the acceptors queue the connection once a request arrives on it. */
+static void poll_connection(connection_t *c, int op, server_stats_t *st) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.fd = c->fd;
+  st->syscalls++;
+  if (epoll_ctl(poll_fd, op, c->fd, &ev) == -1) {
+    perror("epoll_ctl");
+    close(c->fd);
+    st->syscalls++;
+    free(c);
+  }
+}
+
+/*
+ * Accepts the pending connections on the nonblocking listener. Returns -1
+ * when out of fds, and 0 otherwise.
+ */
+static int accept_connections(server_worker_t *w) {
+  int fd, tcp_nodelay = 1;
+  connection_t *c;
+
+  while (1) {
+    fd = accept(w->listener, NULL, NULL);
+    w->stats->syscalls++;
+    if (fd == -1) {
+      if (errno == EAGAIN) {
+        /* another acceptor took it */
+        w->stats->eagains++;
+        return 0;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (out_of_fds()) {
+        return -1;
+      }
+      perror("Client accept failed");
+      exit(EXIT_FAILURE);
+    }
+    w->stats->accepts++;
+    c = malloc(sizeof(connection_t) + BUF_SIZE);
+    if (c == NULL) {
+      fprintf(stderr, "cannot allocate a connection\n");
+      close(fd);
+      w->stats->syscalls++;
+      continue;
+    }
+    c->buf = (char *)(c + 1);
+    init_connection(c, fd);
+    /*
+     * Set once here rather than after the first response, since each
+     * response may be served by another worker.
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay, sizeof(int));
+    w->stats->syscalls++;
+    c->tcp_nodelay = 1;
+    /* the reads do not block, but a writev to a stalled client does */
+    set_send_timeout(fd, w->conf->timeouts, w->stats);
+    connections[fd] = c;
+    poll_connection(c, EPOLL_CTL_ADD, w->stats);
+  }
+}
+
+/* Polls the listener for accepts with EPOLLIN, or stops with 0. */
+static void poll_listener(server_worker_t *w, uint32_t events) {
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.fd = w->listener;
+  w->stats->syscalls++;
+  if (epoll_ctl(poll_fd, EPOLL_CTL_MOD, w->listener, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * The first acceptors workers accept and poll the idle connections, and
+ * queue the ones a request arrived on. The others pop a connection, answer
+ * the requests read from it and hand it back to the acceptors with a
+ * partial request if any, so that neither an idle keepalive connection nor
+ * a slow client holds a worker. An acceptor out of fds stops polling the
+ * listener for ACCEPT_DELAY_MS, and keeps polling the idle connections.
+ */
+static void *queue_worker(void *arg) {
+  server_worker_t *w = arg;
+  struct epoll_event events[POLL_EVENTS];
+  response_t response;
+  connection_t *c;
+  uint64_t now, resume = 0; /* in ms, when to poll the listener again */
+  int i, n, fd, timeout;
+
+  if (w->index < acceptors) {
+    while (1) {
+      timeout = -1;
+      if (resume > 0) {
+        now = stats_now_ns() / 1000000;
+        if (now >= resume) {
+          poll_listener(w, EPOLLIN);
+          resume = 0;
+        } else {
+          timeout = resume - now;
+        }
+      }
+      n = epoll_wait(poll_fd, events, POLL_EVENTS, timeout);
+      w->stats->polls++;
+      w->stats->syscalls++;
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        perror("epoll_wait");
+        exit(EXIT_FAILURE);
+      }
+      w->stats->events += n;
+      for (i = 0; i < n; i++) {
+        fd = events[i].data.fd;
+        if (fd == w->listener) {
+          if (accept_connections(w) == -1 && resume == 0) {
+            poll_listener(w, 0);
+            resume = stats_now_ns() / 1000000 + ACCEPT_DELAY_MS;
+          }
+        } else {
+          fd_queue_push(&queue, fd);
+        }
+      }
+    }
+  }
+
+  if (response_init(&response, w->conf) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  while (1) {
+    c = connections[fd_queue_pop(&queue)];
+    if (serve_connection(c, &response, w->conf->timeouts, w->stats, 1)) {
+      poll_connection(c, EPOLL_CTL_MOD, w->stats);
+    } else {
+      free(c);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Serves a connection in a thread of its own. Its stats are added to the
+ * ones of the acceptor once it is closed, so they lag behind while it is
+ * kept alive.
+ */
+static void *connection_thread(void *arg) {
+  connection_thread_t *ct = arg;
+  cached_response_t *cached;
+  server_stats_t st;
+  char buf[BUF_SIZE];
+  connection_t c;
+
+  pthread_mutex_lock(&lock);
+  cached = free_responses;
+  if (cached != NULL) {
+    free_responses = cached->next;
+  }
+  pthread_mutex_unlock(&lock);
+  if (cached == NULL) {
+    cached = malloc(sizeof(cached_response_t));
+    if (cached == NULL) {
+      fprintf(stderr, "cannot allocate a response\n");
+      exit(EXIT_FAILURE);
+    }
+    if (response_init(&cached->response, ct->worker->conf) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memset(&st, 0, sizeof(st));
+  st.accepts = 1;
+  c.buf = buf;
+  init_connection(&c, ct->fd);
+  set_send_timeout(c.fd, ct->worker->conf->timeouts, &st);
+  serve_connection(&c, &cached->response, ct->worker->conf->timeouts, &st,
+                   0);
+
+  pthread_mutex_lock(&lock);
+  stats_add(ct->worker->stats, &st);
+  cached->next = free_responses;
+  free_responses = cached;
+  pthread_mutex_unlock(&lock);
+  free(ct);
+  return NULL;
+}
+
+static void *spawn_worker(void *arg) {
+  server_worker_t *w = arg;
+  connection_thread_t *ct;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int rc;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_attr_setstacksize(&attr, stack_size);
+  if (rc != 0) {
+    fprintf(stderr, "invalid STACK_SIZE: %s\n", strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    ct = malloc(sizeof(connection_thread_t));
+    if (ct == NULL) {
+      fprintf(stderr, "cannot allocate a connection thread\n");
+      exit(EXIT_FAILURE);
+    }
+    ct->worker = w;
+    ct->fd = accept_connection(w);
+    /* the connection threads add their stats to the same ones */
+    pthread_mutex_lock(&lock);
+    w->stats->syscalls++;
+    pthread_mutex_unlock(&lock);
+    rc = pthread_create(&thread, &attr, connection_thread, ct);
+    if (rc != 0) {
+      fprintf(stderr, "cannot create a connection thread: %s\n",
+              strerror(rc));
+      close(ct->fd);
+      free(ct);
+    }
+  }
+  return NULL;
+}
+
+int threads_mode_from_env(void) {
+  char *val = getenv("THREADS_MODE");
+  int i;
+
+  if (val == NULL) {
+    return THREADS_ACCEPT;
+  }
+  for (i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++) {
+    if (strcmp(val, modes[i]) == 0) {
+      return i;
+    }
+  }
+  fprintf(stderr, "invalid THREADS_MODE: %s\n", val);
+  exit(EXIT_FAILURE);
+}
+
+int threads_run(server_conf_t *conf, int mode) {
+  void *(*worker)(void *);
+  struct epoll_event ev;
+  struct rlimit rl;
+  char *val;
+  int rc;
+
+  printf("threads_mode=%s\n", modes[mode]);
+  if (mode == THREADS_ACCEPT) {
+    worker = threads_worker;
+  } else {
+    val = getenv("ACCEPTORS");
+    acceptors = val != NULL && atoi(val) > 0 ? atoi(val) : 1;
+    printf("acceptors=%d\n", acceptors);
+    /* the acceptors share a listener */
+    conf->reuseport = 0;
+    conf->reuseport_cbpf = 0;
+    if (mode == THREADS_QUEUE) {
+      if (fd_queue_init(&queue, SERVER_BACKLOG) == -1) {
+        exit(EXIT_FAILURE);
+      }
+      /* an fd is below the limit raised by server_conf_init */
+      if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit failed");
+        exit(EXIT_FAILURE);
+      }
+      connections = calloc(rl.rlim_cur, sizeof(connection_t *));
+      if (connections == NULL) {
+        fprintf(stderr, "cannot allocate connections\n");
+        exit(EXIT_FAILURE);
+      }
+      conf->workers += acceptors;
+      worker = queue_worker;
+    } else {
+      stack_size = get_size_from_env("STACK_SIZE", THREADS_STACK_SIZE);
+      printf("stack_size=%zu\n", stack_size);
+      conf->workers = acceptors;
+      worker = spawn_worker;
+    }
+  }
+
+  /* the acceptors of the queue mode poll the listener */
+  server_open_listeners(conf, mode == THREADS_QUEUE);
+  if (mode == THREADS_QUEUE) {
+    poll_fd = epoll_create1(0);
+    if (poll_fd == -1) {
+      perror("epoll_create1");
+      exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = conf->listeners[0];
+    if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, conf->listeners[0], &ev) == -1) {
+      perror("epoll_ctl");
+      exit(EXIT_FAILURE);
+    }
+  }
+  rc = server_run_threads(conf, worker);
+  server_close_listeners(conf);
+  return rc;
+}
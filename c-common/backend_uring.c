@@ -0,0 +1,1042 @@
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#include "server.h"
+
+#define BUF_RING_ENTRIES 512
+#define BUF_GROUP_ID 0
+#define RING_ENTRIES 2048
+/* of the listener in the file table, the connections take the slots above */
+#define LISTENER_SLOT 0
+/* IORING_MAX_FIXED_FILES */
+#define FIXED_FILES_MAX (1U << 20)
+
+/*
+ * With multishot recv a READ and a WRITE of the same connection can be in
+ * flight at once, so the operation is kept in the low bits of the
+ * user_data instead of in the connection. A send also keeps the response
+ * buffer it reads in the bit above, since a zero copy send notifies that
+ * the buffer is released only after the next send may have started.
+ */
+enum {
+  ACCEPT,
+  READ,
+  WRITE,
+  CLOSE,
+  SHUTDOWN,
+  WRITE_ZC,
+  TIMEOUT,  /* of the timer wheel, without a connection */
+  HAND_OFF, /* of the acceptor, see hand_off */
+};
+
+#define OP_MASK 7
+#define OP_BUF_SHIFT 3
+#define DATA_MASK 15
+
+typedef struct uring_connection_s uring_connection_t;
+
+struct uring_connection_s {
+  /*
+   * In multishot mode recv picks a ring buffer and core.buf is only
+   * allocated while a request is split across ring buffers.
+   */
+  connection_t core;
+  uint8_t closing;
+  uint8_t recv_armed; /* a multishot recv is active */
+  uint8_t shutdown_submitted;
+  uint8_t close_submitted;
+  uint8_t writing;    /* responses are being sent */
+  uint16_t pending;   /* operations submitted and not completed yet */
+  uint32_t queued;    /* responses waiting for the send in flight */
+  uint32_t send_n;    /* responses in the send in flight */
+  uint64_t queued_ns; /* when the oldest queued request was read */
+  uint64_t send_ns;   /* when the oldest request in the send was read */
+  char *send_buf;     /* the responses being sent */
+  uint32_t send_len;  /* of the responses */
+  uint32_t send_off;  /* sent so far, a send may be short */
+  uint8_t send_idx;   /* of the response buffer */
+} __attribute__((aligned(DATA_MASK + 1)));
+
+typedef struct {
+  struct io_uring_buf_ring *br;
+  char *bufs;
+} buf_ring;
+
+typedef struct {
+  struct io_uring ring;
+  int listener;
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+  uring_connection_t accept_conn;
+  connection_pool_t pool;
+  response_t response;
+  buf_ring *br;
+  server_stats_t *stats;
+  int inflight[2]; /* sends which may still read each response buffer */
+  connection_timers_t timers;
+  struct __kernel_timespec timeout_ts;
+  int timeout_armed;
+  uint64_t timeout_at; /* in ms */
+  int index;
+  int next_worker; /* where the acceptor looks for the least loaded first */
+} uring_worker_t;
+
+static int multishot;
+/* responses of this size or more are sent with SEND_ZC, -1 disables it */
+static long zc_threshold;
+/*
+ * The setup flags of the rings: IORING_SETUP_SQPOLL, where a kernel thread
+ * polls the SQ so that a submission needs no syscall while it is awake, or
+ * IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, where the
+ * completions are only run in io_uring_submit_and_wait instead of
+ * interrupting the worker.
+ */
+static unsigned setup_flags;
+static unsigned sqpoll_idle; /* in ms before the SQ thread sleeps */
+static int sqpoll_cpu;       /* of the SQ thread of the first ring, or -1 */
+/*
+ * In FIXED_FILES mode the listener and the connections are direct
+ * descriptors in the file table of the ring, which an operation uses
+ * without looking up and referencing the file. The connections are
+ * accepted straight into the table and are never in the fd table.
+ */
+static int fixed_files;
+static unsigned fixed_file_n; /* slots in the file table */
+/*
+ * In ATTACH_WQ mode the rings share the io-wq workers of wq_ring, and with
+ * SQPOLL its SQ thread, instead of each having its own. wq_ring is set up
+ * by uring_run only for them and is never submitted to.
+ */
+static int attach_wq;
+static struct io_uring wq_ring;
+/*
+ * In MSG_RING mode worker 0 is the acceptor: it only accepts, and hands
+ * each connection to the ring of the least loaded worker with
+ * IORING_OP_MSG_RING, so that the kernel does not pick the worker which
+ * wakes up. The others never accept.
+ */
+static int msg_ring;
+static int ring_n;
+static int *ring_fds; /* of the workers, set before rings_ready */
+static int *loads;    /* connections handed to each worker and not freed */
+static pthread_barrier_t rings_ready;
+
+static uring_connection_t *get_uring_connection(uring_worker_t *wk, int fd) {
+  uring_connection_t *c;
+
+  c = (uring_connection_t *)get_connection(&wk->pool, fd);
+  if (c == NULL) {
+    return NULL;
+  }
+  c->closing = 0;
+  c->recv_armed = 0;
+  c->shutdown_submitted = 0;
+  c->close_submitted = 0;
+  c->writing = 0;
+  c->pending = 0;
+  c->queued = 0;
+  if (fixed_files) {
+    /* a direct descriptor has no fd, it inherits TCP_NODELAY instead */
+    c->core.tcp_nodelay = 1;
+  }
+  return c;
+}
+
+static void free_uring_connection(uring_worker_t *wk, uring_connection_t *c) {
+  if (msg_ring) {
+    __atomic_fetch_sub(&loads[wk->index], 1, __ATOMIC_RELAXED);
+  }
+  if (multishot && c->core.buf != NULL) {
+    free(c->core.buf);
+    c->core.buf = NULL;
+  }
+  free_connection(&wk->pool, &c->core);
+}
+
+static void set_data(struct io_uring_sqe *sqe, uring_connection_t *c, int op) {
+  io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | op);
+  if (op != ACCEPT) {
+    c->pending++;
+  }
+}
+
+/* Marks the fd of sqe as a slot in the file table in FIXED_FILES mode. */
+static void set_fixed_file(struct io_uring_sqe *sqe) {
+  if (fixed_files) {
+    sqe->flags |= IOSQE_FIXED_FILE;
+  }
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring, const char *op) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  if (sqe == NULL) {
+    /*
+     * More connections than SQ entries may need an operation in one batch
+     * of CQEs, so the SQ is flushed to make room. With SQPOLL the entries
+     * are only free once the SQ thread has consumed them.
+     */
+    io_uring_submit(ring);
+    io_uring_sqring_wait(ring);
+    sqe = io_uring_get_sqe(ring);
+  }
+  if (sqe == NULL) {
+    fprintf(stderr, "cannot get sqe in %s\n", op);
+    exit(1);
+  }
+  return sqe;
+}
+
+static void prep_accept(uring_worker_t *wk) {
+  struct io_uring_sqe *sqe = get_sqe(&wk->ring, "prep_accept");
+
+  wk->client_addr_len = sizeof(wk->client_addr);
+  if (fixed_files && multishot) {
+    io_uring_prep_multishot_accept_direct(sqe, LISTENER_SLOT,
+                                          (struct sockaddr *)&wk->client_addr,
+                                          &wk->client_addr_len, 0);
+  } else if (fixed_files) {
+    io_uring_prep_accept_direct(sqe, LISTENER_SLOT,
+                                (struct sockaddr *)&wk->client_addr,
+                                &wk->client_addr_len, 0,
+                                IORING_FILE_INDEX_ALLOC);
+  } else if (multishot) {
+    io_uring_prep_multishot_accept(sqe, wk->listener,
+                                   (struct sockaddr *)&wk->client_addr,
+                                   &wk->client_addr_len, 0);
+  } else {
+    io_uring_prep_accept(sqe, wk->listener,
+                         (struct sockaddr *)&wk->client_addr,
+                         &wk->client_addr_len, 0);
+  }
+
+  set_fixed_file(sqe);
+  set_data(sqe, &wk->accept_conn, ACCEPT);
+}
+
+static void prep_recv(struct io_uring *ring, uring_connection_t *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring, "prep_recv");
+  if (multishot) {
+    /* one recv stays armed and picks a buffer from the shared ring */
+    io_uring_prep_recv_multishot(sqe, c->core.fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP_ID;
+    c->recv_armed = 1;
+  } else {
+    io_uring_prep_recv(sqe, c->core.fd, c->core.buf + c->core.last,
+                       BUF_SIZE - c->core.last, 0);
+  }
+
+  set_fixed_file(sqe);
+  set_data(sqe, c, READ);
+}
+
+/*
+ * Sends the rest of c->send_buf. A zero copy send reads the registered
+ * response buffer until its notification, which is worth it only for
+ * large responses.
+ */
+static void prep_send(uring_worker_t *wk, uring_connection_t *c) {
+  struct io_uring_sqe *sqe = get_sqe(&wk->ring, "prep_send");
+  char *buf = c->send_buf + c->send_off;
+  size_t len = c->send_len - c->send_off;
+  int op;
+
+  if (zc_threshold >= 0 && len >= (size_t)zc_threshold) {
+    io_uring_prep_send_zc_fixed(sqe, c->core.fd, buf, len, MSG_WAITALL, 0,
+                                c->send_idx);
+    op = WRITE_ZC;
+  } else {
+    io_uring_prep_send(sqe, c->core.fd, buf, len, MSG_WAITALL);
+    op = WRITE;
+  }
+  set_fixed_file(sqe);
+  wk->inflight[c->send_idx]++;
+  set_data(sqe, c, op | c->send_idx << OP_BUF_SHIFT);
+  connection_timer(&wk->timers, &c->core, TIMER_SEND);
+}
+
+static void prep_close(struct io_uring *ring, uring_connection_t *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring, "prep_close");
+
+  if (fixed_files) {
+    io_uring_prep_close_direct(sqe, c->core.fd);
+  } else {
+    io_uring_prep_close(sqe, c->core.fd);
+  }
+  c->close_submitted = 1;
+  set_data(sqe, c, CLOSE);
+}
+
+static void prep_shutdown(struct io_uring *ring, uring_connection_t *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring, "prep_shutdown");
+
+  io_uring_prep_shutdown(sqe, c->core.fd, SHUT_RDWR);
+  set_fixed_file(sqe);
+  c->shutdown_submitted = 1;
+  set_data(sqe, c, SHUTDOWN);
+}
+
+/*
+ * Closes a connection once nothing is in flight for it any more. An armed
+ * multishot recv holds a reference to the socket, so it is terminated with
+ * a shutdown first.
+ */
+static void finalize_connection(uring_worker_t *wk, uring_connection_t *c) {
+  struct io_uring *ring = &wk->ring;
+
+  connection_timer_del(&wk->timers, &c->core);
+  c->closing = 1;
+  if (c->recv_armed) {
+    if (!c->shutdown_submitted) {
+      prep_shutdown(ring, c);
+    }
+    return;
+  }
+  if (c->pending == 0 && !c->close_submitted) {
+    prep_close(ring, c);
+  }
+}
+
+static buf_ring *setup_buf_ring(struct io_uring *ring) {
+  buf_ring *r;
+  int ret, i;
+
+  r = malloc(sizeof(buf_ring));
+  if (r == NULL) {
+    fprintf(stderr, "cannot alloc buf_ring\n");
+    return NULL;
+  }
+  r->bufs = malloc((size_t)BUF_RING_ENTRIES * BUF_SIZE);
+  if (r->bufs == NULL) {
+    fprintf(stderr, "cannot alloc ring buffers\n");
+    return NULL;
+  }
+  r->br = io_uring_setup_buf_ring(ring, BUF_RING_ENTRIES, BUF_GROUP_ID, 0,
+                                  &ret);
+  if (r->br == NULL) {
+    fprintf(stderr, "setup buf ring error: %s\n", strerror(-ret));
+    return NULL;
+  }
+  for (i = 0; i < BUF_RING_ENTRIES; i++) {
+    io_uring_buf_ring_add(r->br, r->bufs + (size_t)i * BUF_SIZE, BUF_SIZE, i,
+                          io_uring_buf_ring_mask(BUF_RING_ENTRIES), i);
+  }
+  io_uring_buf_ring_advance(r->br, BUF_RING_ENTRIES);
+  return r;
+}
+
+static void recycle_buffer(buf_ring *r, int bid) {
+  io_uring_buf_ring_add(r->br, r->bufs + (size_t)bid * BUF_SIZE, BUF_SIZE, bid,
+                        io_uring_buf_ring_mask(BUF_RING_ENTRIES), 0);
+  io_uring_buf_ring_advance(r->br, 1);
+}
+
+/*
+ * Frames the requests in a ring buffer of n bytes. Complete requests are
+ * framed in place, and only a request split across ring buffers is copied
+ * to the connection buffer, which is released again once it is drained.
+ */
+static int frame_ring_buffer(connection_t *c, char *data, int n,
+                             int *closing) {
+  int len, nreq, total;
+
+  total = 0;
+  if (c->last == 0) {
+    total = frame_buffer(data, &n, &c->header, closing);
+    if (total > -1 && n > 0) {
+      if (c->buf == NULL) {
+        c->buf = malloc(BUF_SIZE);
+        if (c->buf == NULL) {
+          fprintf(stderr, "cannot alloc connection buffer\n");
+          return -1;
+        }
+      }
+      memcpy(c->buf, data, n);
+      c->last = n;
+    }
+  } else {
+    while (n > 0) {
+      len = n < BUF_SIZE - c->last ? n : BUF_SIZE - c->last;
+      memcpy(c->buf + c->last, data, len);
+      c->last += len;
+      data += len;
+      n -= len;
+      nreq = frame_requests(c, closing);
+      if (nreq == -1) {
+        return -1;
+      }
+      total += nreq;
+      if (*closing) {
+        break;
+      }
+    }
+  }
+
+  if (c->last == 0 && c->buf != NULL) {
+    free(c->buf);
+    c->buf = NULL;
+  }
+  return total;
+}
+
+/*
+ * Sends the responses to nreq more requests with one send of back to back
+ * copies, as many as have the same status. While a send is in flight they
+ * are only counted, so that two sends never interleave.
+ */
+static int send_responses(uring_worker_t *wk, uring_connection_t *c,
+                          int nreq, uint64_t read_ns) {
+  response_t *r = &wk->response;
+  struct iovec iov;
+  uint32_t n;
+
+  if (c->queued == 0) {
+    c->queued_ns = read_ns;
+  }
+  c->queued += nreq;
+  if (c->writing || c->queued == 0) {
+    return 0;
+  }
+  /* the Date stays behind while a send still reads the idle buffer */
+  if (wk->inflight[r->cur ^ 1] == 0 && response_update(r) == -1) {
+    return -1;
+  }
+  n = response_next(r, c->queued < MAX_PIPELINED ? c->queued : MAX_PIPELINED,
+                    &iov);
+  c->queued -= n;
+  c->send_n = n;
+  c->send_ns = c->queued_ns;
+  c->send_buf = iov.iov_base;
+  c->send_len = iov.iov_len;
+  c->send_off = 0;
+  c->send_idx = r->cur;
+  c->writing = 1;
+  prep_send(wk, c);
+  return 0;
+}
+
+static void handle_accept(uring_worker_t *wk, struct io_uring_cqe *cqe) {
+  uring_connection_t *c;
+  int none = -1;
+
+  if (cqe->res < 0) {
+    if (cqe->res == -EAGAIN) {
+      wk->stats->eagains++;
+    } else {
+      fprintf(stderr, "accept error: %s\n", strerror(-cqe->res));
+    }
+  } else {
+    wk->stats->accepts++;
+    c = get_uring_connection(wk, cqe->res);
+    if (c == NULL && fixed_files) {
+      /* emptying the slot closes the direct descriptor */
+      io_uring_register_files_update(&wk->ring, cqe->res, &none, 1);
+    } else if (c == NULL) {
+      close(cqe->res);
+    }
+    if (c == NULL && msg_ring) {
+      __atomic_fetch_sub(&loads[wk->index], 1, __ATOMIC_RELAXED);
+    } else if (c != NULL) {
+      prep_recv(&wk->ring, c);
+      connection_timer(&wk->timers, &c->core, TIMER_HEADER);
+    }
+  }
+  /* a connection handed off by the acceptor is not an armed accept */
+  if (!msg_ring && !(cqe->flags & IORING_CQE_F_MORE)) {
+    prep_accept(wk);
+  }
+}
+
+static void handle_read(uring_worker_t *wk, uring_connection_t *c,
+                        struct io_uring_cqe *cqe) {
+  struct io_uring *ring = &wk->ring;
+  int more = cqe->flags & IORING_CQE_F_MORE;
+  int bytes_read = cqe->res;
+  int bid = 0, closing, nreq;
+  char *buf = NULL;
+  uint64_t start;
+
+  if (multishot) {
+    if (!more) {
+      c->recv_armed = 0;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      buf = wk->br->bufs + (size_t)bid * BUF_SIZE;
+    } else if (bytes_read == -ENOBUFS && !c->closing) {
+      /* all ring buffers are in flight, wait for data again */
+      prep_recv(ring, c);
+      return;
+    }
+  }
+  if (bytes_read <= 0) {
+    if (bytes_read < 0) {
+      fprintf(stderr, "recv error: %s\n", strerror(-cqe->res));
+    }
+    finalize_connection(wk, c);
+    return;
+  }
+  start = stats_now_ns();
+  wk->stats->bytes_in += bytes_read;
+  if (c->closing) {
+    /* the rest of a connection which is being closed */
+    if (multishot) {
+      recycle_buffer(wk->br, bid);
+    } else {
+      finalize_connection(wk, c);
+    }
+    return;
+  }
+
+  if (multishot) {
+    nreq = frame_ring_buffer(&c->core, buf, bytes_read, &closing);
+    recycle_buffer(wk->br, bid);
+  } else {
+    c->core.last += bytes_read;
+    nreq = frame_requests(&c->core, &closing);
+  }
+  if (nreq == -1) {
+    fprintf(stderr, "too large request header\n");
+    finalize_connection(wk, c);
+    return;
+  }
+  c->closing = closing;
+  if (nreq > 0 && !c->closing && set_tcp_nodelay(&c->core) == -1) {
+    finalize_connection(wk, c);
+    return;
+  }
+  if (send_responses(wk, c, nreq, start) == -1) {
+    finalize_connection(wk, c);
+    return;
+  }
+  if (multishot) {
+    if (!more && !c->closing) {
+      prep_recv(ring, c);
+    }
+  } else if (!c->writing) {
+    /* the request is incomplete, read the rest of it */
+    prep_recv(ring, c);
+  }
+  if (!c->writing && !c->closing) {
+    connection_timer_read(&wk->timers, &c->core);
+  }
+}
+
+static void handle_write(uring_worker_t *wk, uring_connection_t *c,
+                         struct io_uring_cqe *cqe, int idx) {
+  server_stats_t *st = wk->stats;
+
+  if (cqe->flags & IORING_CQE_F_NOTIF) {
+    /* a zero copy send released the buffer, the close may wait for it */
+    wk->inflight[idx]--;
+    if (c->closing) {
+      finalize_connection(wk, c);
+    }
+    return;
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    /* a copying send, or a zero copy one which failed before sending */
+    wk->inflight[idx]--;
+  }
+
+  c->writing = 0;
+  if (cqe->res < 0) {
+    fprintf(stderr, "send error: %s\n", strerror(-cqe->res));
+    c->closing = 1;
+    c->queued = 0;
+  } else if (c->send_off + cqe->res < c->send_len) {
+    st->bytes_out += cqe->res;
+    c->send_off += cqe->res;
+    c->writing = 1;
+    prep_send(wk, c);
+    return;
+  } else {
+    st->requests += c->send_n;
+    st->bytes_out += cqe->res;
+    stats_record(&st->service_time_ns, stats_now_ns() - c->send_ns,
+                 c->send_n);
+  }
+  if (c->queued > 0) {
+    /* requests which arrived while the send was in flight */
+    if (send_responses(wk, c, 0, 0) == -1) {
+      finalize_connection(wk, c);
+    }
+  } else if (c->closing) {
+    finalize_connection(wk, c);
+  } else if (!multishot) {
+    prep_recv(&wk->ring, c);
+  }
+  if (!c->writing && !c->closing) {
+    connection_timer_read(&wk->timers, &c->core);
+  }
+}
+
+/*
+ * Shuts down a connection whose timer expired, which ends the recv or send
+ * in flight, and then it is closed as usual.
+ */
+static void expire_connection(wheel_timer_t *t, void *arg) {
+  uring_worker_t *wk = arg;
+  uring_connection_t *c = (uring_connection_t *)connection_of_timer(t);
+
+  wk->stats->timeouts++;
+  c->closing = 1;
+  if (!c->shutdown_submitted) {
+    prep_shutdown(&wk->ring, c);
+  }
+}
+
+/*
+ * Keeps one IORING_OP_TIMEOUT armed for the next expiry of the timer wheel,
+ * so that io_uring_submit_and_wait returns for it and no request needs a
+ * timer of its own. It is moved with a timeout update when an earlier
+ * expiry comes up.
+ */
+static void arm_timeout(uring_worker_t *wk) {
+  uint64_t next = timer_wheel_next(&wk->timers.wheel);
+  struct io_uring_sqe *sqe;
+
+  if (next == UINT64_MAX || (wk->timeout_armed && next >= wk->timeout_at)) {
+    return;
+  }
+  /* the ms are on CLOCK_MONOTONIC, the clock of absolute timeouts */
+  wk->timeout_ts.tv_sec = next / 1000;
+  wk->timeout_ts.tv_nsec = next % 1000 * 1000000;
+  sqe = get_sqe(&wk->ring, "arm_timeout");
+  if (wk->timeout_armed) {
+    io_uring_prep_timeout_update(sqe, &wk->timeout_ts, TIMEOUT,
+                                 IORING_TIMEOUT_ABS);
+  } else {
+    io_uring_prep_timeout(sqe, &wk->timeout_ts, 0, IORING_TIMEOUT_ABS);
+  }
+  io_uring_sqe_set_data64(sqe, TIMEOUT);
+  wk->timeout_armed = 1;
+  wk->timeout_at = next;
+}
+
+/*
+ * Sets up the ring of the worker with setup_flags, and in FIXED_FILES mode
+ * a sparse file table with the listener in LISTENER_SLOT, from which
+ * direct accepts allocate the slots above.
+ */
+static void setup_ring(uring_worker_t *wk, int index) {
+  struct io_uring_params p;
+  int tcp_nodelay = 1;
+  int ret;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = setup_flags;
+  if (attach_wq) {
+    /* the SQ thread of wq_ring keeps its idle time and CPU */
+    p.flags |= IORING_SETUP_ATTACH_WQ;
+    p.wq_fd = wq_ring.ring_fd;
+  } else if (setup_flags & IORING_SETUP_SQPOLL) {
+    p.sq_thread_idle = sqpoll_idle;
+    if (sqpoll_cpu >= 0) {
+      p.flags |= IORING_SETUP_SQ_AFF;
+      p.sq_thread_cpu = sqpoll_cpu + index;
+    }
+  }
+  ret = io_uring_queue_init_params(RING_ENTRIES, &wk->ring, &p);
+  if (ret < 0) {
+    fprintf(stderr, "init ring error: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+  if (!fixed_files) {
+    return;
+  }
+
+  ret = io_uring_register_files_sparse(&wk->ring, fixed_file_n);
+  if (ret < 0) {
+    fprintf(stderr, "register files error: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+  ret = io_uring_register_files_update(&wk->ring, LISTENER_SLOT,
+                                       &wk->listener, 1);
+  if (ret < 0) {
+    fprintf(stderr, "register listener error: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+  ret = io_uring_register_file_alloc_range(&wk->ring, LISTENER_SLOT + 1,
+                                           fixed_file_n - LISTENER_SLOT - 1);
+  if (ret < 0) {
+    fprintf(stderr, "register file alloc range error: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+  /* the accepted sockets inherit it on Linux */
+  if (setsockopt(wk->listener, IPPROTO_TCP, TCP_NODELAY, &tcp_nodelay,
+                 sizeof(tcp_nodelay)) == -1) {
+    perror("setsockopt TCP_NODELAY: listener");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Picks the worker with the fewest connections. The acceptor counts a
+ * connection when it hands it off, and the worker when it frees it, so a
+ * burst of accepts is spread before any of them reach a worker. A tie goes
+ * to the next worker after the last one picked.
+ */
+static int least_loaded(uring_worker_t *wk) {
+  int i, j, load, min, best;
+
+  min = INT_MAX;
+  best = 1;
+  for (i = 0; i < ring_n - 1; i++) {
+    j = 1 + (wk->next_worker + i) % (ring_n - 1);
+    load = __atomic_load_n(&loads[j], __ATOMIC_RELAXED);
+    if (load < min) {
+      min = load;
+      best = j;
+    }
+  }
+  wk->next_worker = best;
+  return best;
+}
+
+/*
+ * Posts an accepted connection to the ring of a worker, as the CQE of an
+ * ACCEPT with the fd, or with the slot it is moved to in FIXED_FILES mode.
+ * The fd and the worker are kept in the user_data for the completion.
+ */
+static void hand_off(uring_worker_t *wk, int fd) {
+  struct io_uring_sqe *sqe = get_sqe(&wk->ring, "hand_off");
+  int i = least_loaded(wk);
+
+  __atomic_fetch_add(&loads[i], 1, __ATOMIC_RELAXED);
+  if (fixed_files) {
+    io_uring_prep_msg_ring_fd_alloc(sqe, ring_fds[i], fd, ACCEPT, 0);
+  } else {
+    io_uring_prep_msg_ring(sqe, ring_fds[i], fd, ACCEPT, 0);
+    /* nothing is left to do here once the fd is sent */
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+  }
+  io_uring_sqe_set_data64(sqe, (uint64_t)fd << 32 |
+                                   (uint64_t)i << OP_BUF_SHIFT | HAND_OFF);
+}
+
+static void handle_hand_off(uring_worker_t *wk, struct io_uring_cqe *cqe,
+                            uint64_t data) {
+  int fd = data >> 32, i = (uint32_t)data >> OP_BUF_SHIFT;
+  struct io_uring_sqe *sqe;
+
+  if (cqe->res < 0) {
+    fprintf(stderr, "msg ring error: %s\n", strerror(-cqe->res));
+    __atomic_fetch_sub(&loads[i], 1, __ATOMIC_RELAXED);
+    if (!fixed_files) {
+      close(fd);
+    }
+  }
+  if (fixed_files) {
+    /* the worker has its own slot for the socket now, or it failed */
+    sqe = get_sqe(&wk->ring, "handle_hand_off");
+    io_uring_prep_close_direct(sqe, fd);
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    io_uring_sqe_set_data64(sqe, CLOSE);
+  }
+}
+
+static void uring_acceptor(uring_worker_t *wk) {
+  struct io_uring_cqe *cqe;
+  unsigned head, count;
+  uint64_t data;
+
+  prep_accept(wk);
+  while (1) {
+    io_uring_submit_and_wait(&wk->ring, 1);
+
+    count = 0;
+    io_uring_for_each_cqe(&wk->ring, head, cqe) {
+      ++count;
+      data = io_uring_cqe_get_data64(cqe);
+      switch (data & OP_MASK) {
+      case ACCEPT:
+        if (cqe->res == -EAGAIN) {
+          wk->stats->eagains++;
+        } else if (cqe->res < 0) {
+          fprintf(stderr, "accept error: %s\n", strerror(-cqe->res));
+        } else {
+          hand_off(wk, cqe->res);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+          prep_accept(wk);
+        }
+        break;
+      case HAND_OFF:
+        handle_hand_off(wk, cqe, data);
+        break;
+      case CLOSE:
+        fprintf(stderr, "close error: %s\n", strerror(-cqe->res));
+        break;
+      }
+    }
+    io_uring_cq_advance(&wk->ring, count);
+    wk->stats->polls++;
+    wk->stats->syscalls++;
+    wk->stats->events += count;
+  }
+}
+
+static void *uring_worker(void *arg) {
+  server_worker_t *w = arg;
+  struct io_uring_cqe *cqe;
+  uring_connection_t *c;
+  uring_worker_t *wk;
+  unsigned head, count;
+  struct iovec iov[2];
+  uint64_t data;
+  int ret, op, i;
+
+  wk = malloc(sizeof(uring_worker_t));
+  if (wk == NULL) {
+    fprintf(stderr, "cannot alloc worker\n");
+    exit(EXIT_FAILURE);
+  }
+  wk->listener = w->listener;
+  wk->stats = w->stats;
+  wk->index = w->index;
+  wk->next_worker = 0;
+
+  setup_ring(wk, w->index);
+  if (msg_ring) {
+    ring_fds[w->index] = wk->ring.ring_fd;
+    /* the acceptor sends to the rings of all the others */
+    pthread_barrier_wait(&rings_ready);
+    if (w->index == 0) {
+      uring_acceptor(wk);
+    }
+  }
+
+  wk->br = NULL;
+  if (multishot) {
+    wk->br = setup_buf_ring(&wk->ring);
+    if (wk->br == NULL) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  connection_pool_init(&wk->pool, WORKER_CONNECTIONS,
+                       sizeof(uring_connection_t), !multishot);
+  if (response_init(&wk->response, w->conf) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  wk->inflight[0] = 0;
+  wk->inflight[1] = 0;
+  connection_timers_init(&wk->timers, w->conf);
+  wk->timeout_armed = 0;
+  if (zc_threshold >= 0) {
+    for (i = 0; i < 2; i++) {
+      iov[i].iov_base = wk->response.buf[i];
+      iov[i].iov_len = wk->response.size;
+    }
+    ret = io_uring_register_buffers(&wk->ring, iov, 2);
+    if (ret < 0) {
+      fprintf(stderr, "register buffers error: %s\n", strerror(-ret));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!msg_ring) {
+    prep_accept(wk);
+  }
+  while (1) {
+    io_uring_submit_and_wait(&wk->ring, 1);
+    connection_timers_update(&wk->timers);
+
+    count = 0;
+    io_uring_for_each_cqe(&wk->ring, head, cqe) {
+      ++count;
+      data = io_uring_cqe_get_data64(cqe);
+      c = (uring_connection_t *)(uintptr_t)(data & ~(uint64_t)DATA_MASK);
+      op = data & OP_MASK;
+
+      if (op != ACCEPT && op != TIMEOUT &&
+          !(cqe->flags & IORING_CQE_F_MORE)) {
+        c->pending--;
+      }
+
+      switch (op) {
+      case ACCEPT:
+        handle_accept(wk, cqe);
+        break;
+      case READ:
+        handle_read(wk, c, cqe);
+        break;
+      case WRITE:
+      case WRITE_ZC:
+        handle_write(wk, c, cqe, data >> OP_BUF_SHIFT & 1);
+        break;
+      case SHUTDOWN:
+        finalize_connection(wk, c);
+        break;
+      case CLOSE:
+        free_uring_connection(wk, c);
+        break;
+      case TIMEOUT:
+        /* the CQE of a timeout update has no -ETIME */
+        if (cqe->res == -ETIME) {
+          wk->timeout_armed = 0;
+        }
+        break;
+      }
+    }
+    io_uring_cq_advance(&wk->ring, count);
+    wk->stats->polls++;
+    wk->stats->syscalls++;
+    wk->stats->events += count;
+
+    timer_wheel_expire(&wk->timers.wheel, wk->timers.now, expire_connection,
+                       wk);
+    arm_timeout(wk);
+  }
+
+  return NULL;
+}
+
+static int send_zc_supported(void) {
+  struct io_uring_probe *probe;
+  int supported;
+
+  probe = io_uring_get_probe();
+  if (probe == NULL) {
+    return 0;
+  }
+  supported = io_uring_opcode_supported(probe, IORING_OP_SEND_ZC);
+  io_uring_free_probe(probe);
+  return supported;
+}
+
+/*
+ * Reads SQPOLL, SQPOLL_IDLE, SQPOLL_CPU and DEFER_TASKRUN into the setup
+ * flags of the rings. DEFER_TASKRUN needs the completions to be reaped by
+ * the submitter, which the SQ thread is not, so the two exclude each other.
+ */
+static void setup_flags_from_env(void) {
+  char *val;
+
+  setup_flags = 0;
+  sqpoll_cpu = -1;
+  if (get_flag_from_env("SQPOLL")) {
+    setup_flags |= IORING_SETUP_SQPOLL;
+    /* 0 leaves the default of the kernel, 1 second */
+    sqpoll_idle = get_msec_from_env("SQPOLL_IDLE", 0);
+    val = getenv("SQPOLL_CPU");
+    if (val != NULL) {
+      sqpoll_cpu = atoi(val);
+    }
+  }
+  if (get_flag_from_env("DEFER_TASKRUN")) {
+    if (setup_flags & IORING_SETUP_SQPOLL) {
+      fprintf(stderr, "DEFER_TASKRUN cannot be used with SQPOLL\n");
+      exit(EXIT_FAILURE);
+    }
+    setup_flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+  }
+}
+
+/* Sizes the file tables of FIXED_FILES by the limit of open files. */
+static void fixed_files_from_env(void) {
+  struct rlimit rl;
+
+  fixed_files = get_flag_from_env("FIXED_FILES");
+  if (!fixed_files) {
+    return;
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    perror("getrlimit failed");
+    exit(EXIT_FAILURE);
+  }
+  /* the kernel refuses a table beyond the limit */
+  fixed_file_n = rl.rlim_cur < FIXED_FILES_MAX ? rl.rlim_cur : FIXED_FILES_MAX;
+}
+
+/* The owner of the io-wq, and of the SQ thread with SQPOLL, in ATTACH_WQ. */
+static void setup_wq_ring(void) {
+  struct io_uring_params p;
+  int ret;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = setup_flags & IORING_SETUP_SQPOLL;
+  if (p.flags) {
+    p.sq_thread_idle = sqpoll_idle;
+    if (sqpoll_cpu >= 0) {
+      p.flags |= IORING_SETUP_SQ_AFF;
+      p.sq_thread_cpu = sqpoll_cpu;
+    }
+  }
+  ret = io_uring_queue_init_params(1, &wq_ring, &p);
+  if (ret < 0) {
+    fprintf(stderr, "init wq ring error: %s\n", strerror(-ret));
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Adds the acceptor of MSG_RING to the workers. It is the only one which
+ * accepts, so there is one listener instead of one per worker.
+ */
+static void msg_ring_init(server_conf_t *conf) {
+  int rc;
+
+  conf->reuseport = 0;
+  conf->reuseport_cbpf = 0;
+  conf->workers++;
+  ring_n = conf->workers;
+  ring_fds = malloc(sizeof(int) * ring_n);
+  loads = calloc(ring_n, sizeof(int));
+  if (ring_fds == NULL || loads == NULL) {
+    fprintf(stderr, "cannot alloc rings\n");
+    exit(EXIT_FAILURE);
+  }
+  rc = pthread_barrier_init(&rings_ready, NULL, ring_n);
+  if (rc != 0) {
+    fprintf(stderr, "pthread_barrier_init failed: %s\n", strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+}
+
+int uring_run(server_conf_t *conf) {
+  int rc;
+
+  multishot = get_flag_from_env("MULTISHOT");
+  setup_flags_from_env();
+  fixed_files_from_env();
+  attach_wq = get_flag_from_env("ATTACH_WQ");
+  msg_ring = get_flag_from_env("MSG_RING");
+  if (attach_wq) {
+    setup_wq_ring();
+  }
+  if (msg_ring) {
+    msg_ring_init(conf);
+  }
+  zc_threshold = get_size_from_env("SEND_ZC_THRESHOLD", -1);
+  if (zc_threshold >= 0 && !send_zc_supported()) {
+    fprintf(stderr, "SEND_ZC is not supported, sending with copies\n");
+    zc_threshold = -1;
+  }
+  printf("multishot=%d\n", multishot);
+  printf("send_zc_threshold=%ld\n", zc_threshold);
+  printf("sqpoll=%d\n", (setup_flags & IORING_SETUP_SQPOLL) != 0);
+  printf("defer_taskrun=%d\n", (setup_flags & IORING_SETUP_DEFER_TASKRUN) != 0);
+  printf("fixed_files=%u\n", fixed_files ? fixed_file_n : 0);
+  printf("attach_wq=%d\n", attach_wq);
+  printf("msg_ring=%d\n", msg_ring);
+
+  server_open_listeners(conf, 0);
+  rc = server_run_threads(conf, uring_worker);
+  server_close_listeners(conf);
+  return rc;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE /* for O_PATH and syscall */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+#define INDEX_FILE "index.html"
+
+int file_cache_init(file_cache_t *cache, const char *root) {
+  cache->root_fd = open(root, O_PATH | O_DIRECTORY);
+  if (cache->root_fd == -1) {
+    perror("cannot open document root");
+    return -1;
+  }
+  memset(cache->slots, 0, sizeof(cache->slots));
+  return 0;
+}
+
+/* FNV-1a */
+static unsigned hash_path(const char *path, size_t len) {
+  unsigned h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)path[i]) * 16777619u;
+  }
+  return h & (FILE_CACHE_SIZE - 1);
+}
+
+/*
+ * A ".." segment, or an empty one, which would make the path absolute once
+ * its leading slash is stripped.
+ */
+static int is_unsafe_path(const char *path, size_t len) {
+  size_t i;
+
+  for (i = 0; i + 1 < len; i++) {
+    if (path[i] != '/') {
+      continue;
+    }
+    if (path[i + 1] == '/') {
+      return 1;
+    }
+    if (path[i + 1] == '.' && i + 2 < len && path[i + 2] == '.' &&
+        (i + 3 == len || path[i + 3] == '/')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static cached_file_t *open_file(file_cache_t *cache, const char *path,
+                                size_t len, time_t now) {
+  char name[FILE_PATH_MAX + sizeof(INDEX_FILE)];
+  struct open_how how;
+  cached_file_t *file;
+  struct stat st;
+  int fd;
+
+  /* the path is relative to the root, "/" is its index file */
+  memcpy(name, path + 1, len - 1);
+  if (path[len - 1] == '/') {
+    memcpy(name + len - 1, INDEX_FILE, sizeof(INDEX_FILE));
+  } else {
+    name[len - 1] = '\0';
+  }
+
+  /* a symlink may not lead out of the root either */
+  memset(&how, 0, sizeof(how));
+  how.flags = O_RDONLY | O_NONBLOCK;
+  how.resolve = RESOLVE_BENEATH;
+  fd = syscall(SYS_openat2, cache->root_fd, name, &how, sizeof(how));
+  if (fd == -1) {
+    if (errno == EXDEV) {
+      errno = EACCES;
+    }
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  if (!S_ISREG(st.st_mode)) {
+    close(fd);
+    errno = S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+    return NULL;
+  }
+
+  file = malloc(sizeof(cached_file_t));
+  if (file == NULL) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  file->fd = fd;
+  file->size = st.st_size;
+  file->valid_until = now + FILE_CACHE_VALID;
+  file->refs = 0;
+  file->cached = 0;
+  file->path_len = len;
+  memcpy(file->path, path, len);
+  return file;
+}
+
+cached_file_t *file_cache_get(file_cache_t *cache, const char *path,
+                              size_t len, time_t now) {
+  cached_file_t *file, **slot;
+
+  if (len == 0 || len >= FILE_PATH_MAX || path[0] != '/') {
+    errno = ENOENT;
+    return NULL;
+  }
+  if (is_unsafe_path(path, len)) {
+    errno = EACCES;
+    return NULL;
+  }
+
+  slot = &cache->slots[hash_path(path, len)];
+  file = *slot;
+  if (file != NULL && file->path_len == len &&
+      memcmp(file->path, path, len) == 0 && now < file->valid_until) {
+    file->refs++;
+    return file;
+  }
+
+  file = open_file(cache, path, len, now);
+  if (file == NULL) {
+    return NULL;
+  }
+  /* a replaced file which is still being sent is closed after its last use */
+  if (*slot != NULL) {
+    if ((*slot)->refs == 0) {
+      close((*slot)->fd);
+      free(*slot);
+    } else {
+      (*slot)->cached = 0;
+    }
+  }
+  *slot = file;
+  file->cached = 1;
+  file->refs++;
+  return file;
+}
+
+void file_cache_put(cached_file_t *file) {
+  if (--file->refs == 0 && !file->cached) {
+    close(file->fd);
+    free(file);
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#define FILE_CACHE_SIZE 1024 /* slots, a power of two */
+#define FILE_CACHE_VALID 60  /* seconds before a file is opened again */
+#define FILE_PATH_MAX 256
+
+/*
+ * A per-worker cache of open files under the document root, so that a file
+ * is opened and stat'ed once instead of on every request. See
+ * open_file_cache in nginx.
+ */
+
+typedef struct {
+  int fd;
+  off_t size;
+  time_t valid_until;
+  int refs;            /* responses still sending the file */
+  unsigned cached : 1; /* in a slot, otherwise closed after the last use */
+  size_t path_len;
+  char path[FILE_PATH_MAX];
+} cached_file_t;
+
+typedef struct {
+  int root_fd;
+  cached_file_t *slots[FILE_CACHE_SIZE];
+} file_cache_t;
+
+/* Opens the document root, or returns -1. */
+int file_cache_init(file_cache_t *cache, const char *root);
+
+/*
+ * Returns the file of the request path with a reference taken, or NULL with
+ * errno set. A path with a ".." or an empty segment, or which leads out of
+ * the root through a symlink, fails with EACCES, and one which is not a
+ * regular file with EISDIR or ENOENT.
+ */
+cached_file_t *file_cache_get(file_cache_t *cache, const char *path,
+                              size_t len, time_t now);
+void file_cache_put(cached_file_t *file);
+
+#endif /* FILE_CACHE_H */
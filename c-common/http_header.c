@@ -0,0 +1,299 @@
+#include <string.h>
+#include <strings.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_HEADER_SIMD 1
+#endif
+
+#include "http_header.h"
+
+#define CONNECTION_NAME "connection:"
+#define CONTENT_LENGTH_NAME "content-length:"
+#define NAME_LEN(name) (sizeof(name) - 1)
+
+enum {
+  HEADER_OTHER,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_LENGTH,
+};
+
+typedef size_t (*scan_header_pt)(const char *buf, size_t len,
+                                 http_header_t *h);
+
+void http_header_init(http_header_t *h) {
+  h->scanned = 0;
+  h->connection_close = 0;
+  h->content_length = -1;
+}
+
+static int match_name_scalar(const char *p, const char *last) {
+  if (last - p > (long)NAME_LEN(CONNECTION_NAME) &&
+      strncasecmp(p, CONNECTION_NAME, NAME_LEN(CONNECTION_NAME)) == 0) {
+    return HEADER_CONNECTION;
+  }
+  if (last - p > (long)NAME_LEN(CONTENT_LENGTH_NAME) &&
+      strncasecmp(p, CONTENT_LENGTH_NAME, NAME_LEN(CONTENT_LENGTH_NAME)) == 0) {
+    return HEADER_CONTENT_LENGTH;
+  }
+  return HEADER_OTHER;
+}
+
+#ifdef HTTP_HEADER_SIMD
+/*
+ * Compares the first 16 bytes of a line with both names at once. Only the
+ * letters are folded to lower case, so no other byte can match a letter.
+ * A matching name ends with ':' and so never crosses the end of the line.
+ */
+static inline __attribute__((always_inline)) int
+match_name_simd(const char *p, const char *end) {
+  __m128i v, eq;
+  unsigned m;
+
+  if (end - p < 16) {
+    return -1;
+  }
+  if ((p[0] | 0x20) != 'c') {
+    return HEADER_OTHER;
+  }
+
+  v = _mm_loadu_si128((const __m128i *)p);
+
+  eq = _mm_cmpeq_epi8(
+      _mm_or_si128(v, _mm_setr_epi8(0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+                                    0x20, 0x20, 0x20, 0, 0, 0, 0, 0, 0)),
+      _mm_setr_epi8('c', 'o', 'n', 'n', 'e', 'c', 't', 'i', 'o', 'n', ':', 0,
+                    0, 0, 0, 0));
+  m = (unsigned)_mm_movemask_epi8(eq);
+  if ((m & 0x7ff) == 0x7ff) {
+    return HEADER_CONNECTION;
+  }
+
+  eq = _mm_cmpeq_epi8(
+      _mm_or_si128(v, _mm_setr_epi8(0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+                                    0, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0,
+                                    0)),
+      _mm_setr_epi8('c', 'o', 'n', 't', 'e', 'n', 't', '-', 'l', 'e', 'n',
+                    'g', 't', 'h', ':', 0));
+  m = (unsigned)_mm_movemask_epi8(eq);
+  if ((m & 0x7fff) == 0x7fff) {
+    return HEADER_CONTENT_LENGTH;
+  }
+  return HEADER_OTHER;
+}
+#endif
+
+static int is_ows(char c) { return c == ' ' || c == '\t'; }
+
+/* Looks for the "close" token in a comma separated Connection value. */
+static int has_close_token(const char *p, const char *last) {
+  const char *token, *token_end;
+
+  while (p < last) {
+    while (p < last && (is_ows(*p) || *p == ',')) {
+      p++;
+    }
+    token = p;
+    while (p < last && *p != ',') {
+      p++;
+    }
+    token_end = p;
+    while (token_end > token && is_ows(token_end[-1])) {
+      token_end--;
+    }
+    if (token_end - token == 5 && strncasecmp(token, "close", 5) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static long parse_content_length(const char *p, const char *last) {
+  long n;
+
+  while (p < last && is_ows(*p)) {
+    p++;
+  }
+  while (last > p && is_ows(last[-1])) {
+    last--;
+  }
+  if (p == last) {
+    return -1;
+  }
+  for (n = 0; p < last; p++) {
+    if (*p < '0' || *p > '9' || n > (__LONG_MAX__ - 9) / 10) {
+      return -1;
+    }
+    n = n * 10 + (*p - '0');
+  }
+  return n;
+}
+
+/*
+ * Handles the line buf[start, nl) where buf[nl] is '\n'. Returns 1 at the
+ * empty line which ends the header block. The request line is skipped.
+ */
+static inline __attribute__((always_inline)) int
+scan_line(const char *buf, size_t len, size_t start, size_t nl,
+          http_header_t *h, int simd) {
+  const char *p, *last;
+  int name;
+
+  p = buf + start;
+  last = buf + nl;
+  if (last > p && last[-1] == '\r') {
+    last--;
+  }
+  if (start == 0) {
+    return 0;
+  }
+  if (p == last) {
+    return 1;
+  }
+
+  name = -1;
+#ifdef HTTP_HEADER_SIMD
+  if (simd) {
+    name = match_name_simd(p, buf + len);
+  }
+#endif
+  if (name == -1) {
+    name = match_name_scalar(p, last);
+  }
+
+  switch (name) {
+  case HEADER_CONNECTION:
+    if (has_close_token(p + NAME_LEN(CONNECTION_NAME), last)) {
+      h->connection_close = 1;
+    }
+    break;
+  case HEADER_CONTENT_LENGTH:
+    h->content_length =
+        parse_content_length(p + NAME_LEN(CONTENT_LENGTH_NAME), last);
+    break;
+  }
+  return 0;
+}
+
+static size_t scan_header_scalar(const char *buf, size_t len,
+                                 http_header_t *h) {
+  const char *nl;
+  size_t start;
+
+  start = h->scanned;
+  while ((nl = memchr(buf + start, '\n', len - start)) != NULL) {
+    if (scan_line(buf, len, start, nl - buf, h, 0)) {
+      return nl - buf + 1;
+    }
+    start = nl - buf + 1;
+  }
+  h->scanned = start;
+  return 0;
+}
+
+#ifdef HTTP_HEADER_SIMD
+/*
+ * The vector versions find every '\n' of a block with one compare and walk
+ * the bits of the mask, so the lines are split and matched in one pass.
+ */
+__attribute__((target("sse4.2"))) static size_t
+scan_header_sse42(const char *buf, size_t len, http_header_t *h) {
+  const __m128i lf = _mm_set1_epi8('\n');
+  size_t i, start, nl;
+  unsigned m;
+
+  start = h->scanned;
+  for (i = start; i + 16 <= len; i += 16) {
+    m = (unsigned)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), lf));
+    while (m) {
+      nl = i + __builtin_ctz(m);
+      m &= m - 1;
+      if (scan_line(buf, len, start, nl, h, 1)) {
+        return nl + 1;
+      }
+      start = nl + 1;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] == '\n') {
+      if (scan_line(buf, len, start, i, h, 1)) {
+        return i + 1;
+      }
+      start = i + 1;
+    }
+  }
+  h->scanned = start;
+  return 0;
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_header_avx2(const char *buf, size_t len, http_header_t *h) {
+  const __m256i lf = _mm256_set1_epi8('\n');
+  size_t i, start, nl;
+  unsigned m;
+
+  start = h->scanned;
+  for (i = start; i + 32 <= len; i += 32) {
+    m = (unsigned)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), lf));
+    while (m) {
+      nl = i + __builtin_ctz(m);
+      m &= m - 1;
+      if (scan_line(buf, len, start, nl, h, 1)) {
+        return nl + 1;
+      }
+      start = nl + 1;
+    }
+  }
+  for (; i < len; i++) {
+    if (buf[i] == '\n') {
+      if (scan_line(buf, len, start, i, h, 1)) {
+        return i + 1;
+      }
+      start = i + 1;
+    }
+  }
+  h->scanned = start;
+  return 0;
+}
+#endif
+
+static scan_header_pt scan_header = scan_header_scalar;
+static const char *scan_header_name = "scalar";
+
+size_t http_scan_header(const char *buf, size_t len, http_header_t *h) {
+  return scan_header(buf, len, h);
+}
+
+const char *http_scan_header_impl(void) { return scan_header_name; }
+
+int http_scan_header_use(const char *name) {
+  if (strcmp(name, "scalar") == 0) {
+    scan_header = scan_header_scalar;
+    scan_header_name = "scalar";
+    return 0;
+  }
+#ifdef HTTP_HEADER_SIMD
+  if (strcmp(name, "sse4.2") == 0 && __builtin_cpu_supports("sse4.2")) {
+    scan_header = scan_header_sse42;
+    scan_header_name = "sse4.2";
+    return 0;
+  }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    scan_header = scan_header_avx2;
+    scan_header_name = "avx2";
+    return 0;
+  }
+#endif
+  return -1;
+}
+
+__attribute__((constructor)) static void select_scan_header(void) {
+#ifdef HTTP_HEADER_SIMD
+  __builtin_cpu_init();
+  if (http_scan_header_use("avx2") == -1) {
+    http_scan_header_use("sse4.2");
+  }
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+#include <stddef.h>
+
+/*
+ * State of scanning one request header block. It is kept between calls, so
+ * a header block split across reads is scanned again only from the line
+ * which was incomplete.
+ */
+typedef struct {
+  size_t scanned; /* start of the first line not scanned yet */
+  int connection_close;
+  long content_length; /* -1 if there is no valid Content-Length */
+} http_header_t;
+
+void http_header_init(http_header_t *h);
+
+/*
+ * Scans buf[0, len) for the end of a request header block in one pass,
+ * noting the "close" token of Connection and the value of Content-Length
+ * on the way. Returns the offset just after the empty line, or 0 if the
+ * header block is not complete yet.
+ */
+size_t http_scan_header(const char *buf, size_t len, http_header_t *h);
+
+/*
+ * The implementation is picked with cpuid at startup: "avx2", "sse4.2" or
+ * "scalar". http_scan_header_use forces one and returns -1 if the CPU does
+ * not support it.
+ */
+const char *http_scan_header_impl(void);
+int http_scan_header_use(const char *name);
+
+#endif /* HTTP_HEADER_H */
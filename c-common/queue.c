@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "queue.h"
+
+int fd_queue_init(fd_queue_t *q, size_t size) {
+  size_t n, i;
+
+  n = 1;
+  while (n < size) {
+    n <<= 1;
+  }
+  q->cells = malloc(sizeof(fd_queue_cell_t) * n);
+  if (q->cells == NULL) {
+    fprintf(stderr, "cannot allocate the fd queue\n");
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    q->cells[i].seq = i;
+  }
+  q->mask = n - 1;
+  q->head = 0;
+  q->tail = 0;
+  if (sem_init(&q->free_cells, 0, n) == -1 || sem_init(&q->fds, 0, 0) == -1) {
+    perror("sem_init failed");
+    return -1;
+  }
+  return 0;
+}
+
+static void wait_sem(sem_t *sem) {
+  while (sem_wait(sem) == -1) {
+    if (errno != EINTR) {
+      perror("sem_wait failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void fd_queue_push(fd_queue_t *q, int fd) {
+  fd_queue_cell_t *cell;
+  size_t pos;
+  long dif;
+
+  /* a free cell is reserved, so the loop only waits for a slow consumer */
+  wait_sem(&q->free_cells);
+  pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &q->cells[pos & q->mask];
+    /* the difference, since the positions wrap around */
+    dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+      /* pos is reloaded by the failed compare and swap */
+    } else if (dif < 0) {
+      /* the consumer of the last round has not released the cell yet */
+      sched_yield();
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+  cell->fd = fd;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&q->fds);
+}
+
+int fd_queue_pop(fd_queue_t *q) {
+  fd_queue_cell_t *cell;
+  size_t pos;
+  long dif;
+  int fd;
+
+  wait_sem(&q->fds);
+  pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &q->cells[pos & q->mask];
+    dif = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (dif < 0) {
+      /* a producer took the cell, but has not filled it yet */
+      sched_yield();
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+  fd = cell->fd;
+  __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  sem_post(&q->free_cells);
+  return fd;
+}
@@ -0,0 +1,38 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <semaphore.h>
+#include <stddef.h>
+
+/*
+ * A bounded multi-producer multi-consumer queue of fds, the array queue of
+ * Dmitry Vyukov. Each cell has a sequence number which tells the position
+ * it may be pushed or popped at next, so producers and consumers only race
+ * on the position counters with a compare and swap, and never take a lock.
+ * Two semaphores count the free cells and the queued fds, so that a push to
+ * a full queue or a pop from an empty one sleeps, and only then enters the
+ * kernel.
+ */
+
+typedef struct {
+  size_t seq;
+  int fd;
+} fd_queue_cell_t;
+
+typedef struct {
+  fd_queue_cell_t *cells;
+  size_t mask;
+  size_t head __attribute__((aligned(64))); /* the position of the next push */
+  size_t tail __attribute__((aligned(64))); /* the position of the next pop */
+  sem_t free_cells __attribute__((aligned(64)));
+  sem_t fds;
+} fd_queue_t;
+
+/* The size is rounded up to a power of two. Returns -1 on an error. */
+int fd_queue_init(fd_queue_t *q, size_t size);
+/* Blocks while the queue is full. */
+void fd_queue_push(fd_queue_t *q, int fd);
+/* Blocks while the queue is empty. */
+int fd_queue_pop(fd_queue_t *q);
+
+#endif /* QUEUE_H */
@@ -0,0 +1,1295 @@
+#define _GNU_SOURCE /* for pthread_setaffinity_np */
+#include <errno.h>
+#include <limits.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "server.h"
+
+static long get_logical_cpu_cores() { return sysconf(_SC_NPROCESSORS_ONLN); }
+
+static long get_num_cpus_from_env() {
+  char *val = getenv("NUM_CPUS");
+  if (val == NULL) {
+    return -1;
+  }
+  return atoi(val);
+}
+
+int get_flag_from_env(const char *name) {
+  char *val = getenv(name);
+  if (val == NULL) {
+    return 0;
+  }
+  return atoi(val) != 0;
+}
+
+long get_size_from_env(const char *name, long default_value) {
+  char *val = getenv(name), *end;
+  long size;
+
+  if (val == NULL || *val == '\0') {
+    return default_value;
+  }
+  size = strtol(val, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size <<= 10;
+    break;
+  case 'm':
+  case 'M':
+    size <<= 20;
+    break;
+  case 'g':
+  case 'G':
+    size <<= 30;
+    break;
+  }
+  return size;
+}
+
+long get_msec_from_env(const char *name, long default_value) {
+  char *val = getenv(name), *end;
+  long msec;
+
+  if (val == NULL || *val == '\0') {
+    return default_value;
+  }
+  msec = strtol(val, &end, 10);
+  if (strcmp(end, "ms") == 0) {
+    return msec;
+  }
+  if (*end == 'm') {
+    return msec * 60 * 1000;
+  }
+  return msec * 1000;
+}
+
+static const char *status_reason(int status);
+
+static int gcd(int a, int b) {
+  int t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/*
+ * Parses STATUS_MIX, a comma separated list of status:weight like
+ * "200:90,404:10", where a missing weight is 1. The weights are reduced by
+ * their greatest common divisor so that the schedule stays short.
+ */
+static void read_status_mix(server_conf_t *conf) {
+  char *val = getenv("STATUS_MIX"), *p, *end;
+  int i, d, total;
+
+  conf->status_n = 1;
+  conf->statuses[0] = 200;
+  conf->weights[0] = 1;
+  if (val == NULL || *val == '\0') {
+    return;
+  }
+
+  conf->status_n = 0;
+  for (p = val; *p != '\0'; p = end) {
+    if (conf->status_n == RESPONSE_STATUS_MAX) {
+      fprintf(stderr, "too many statuses in STATUS_MIX\n");
+      exit(EXIT_FAILURE);
+    }
+    i = conf->status_n++;
+    conf->statuses[i] = strtol(p, &end, 10);
+    conf->weights[i] = 1;
+    if (*end == ':') {
+      conf->weights[i] = strtol(end + 1, &end, 10);
+    }
+    if (status_reason(conf->statuses[i]) == NULL || conf->weights[i] <= 0 ||
+        (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "invalid STATUS_MIX: %s\n", val);
+      exit(EXIT_FAILURE);
+    }
+    if (*end == ',') {
+      end++;
+    }
+  }
+
+  d = 0;
+  for (i = 0; i < conf->status_n; i++) {
+    d = gcd(conf->weights[i], d);
+  }
+  total = 0;
+  for (i = 0; i < conf->status_n; i++) {
+    conf->weights[i] /= d;
+    total += conf->weights[i];
+  }
+  if (total > RESPONSE_SCHEDULE_MAX) {
+    fprintf(stderr, "STATUS_MIX weights add up to more than %d\n",
+            RESPONSE_SCHEDULE_MAX);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Raises the soft limit of open files to the hard limit, since the
+ * connection pool is no longer the bound on connections. See
+ * worker_rlimit_nofile in nginx.
+ */
+static void raise_nofile_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    perror("getrlimit failed");
+    return;
+  }
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+      perror("setrlimit failed");
+    }
+  }
+}
+
+void server_conf_init(server_conf_t *conf, const char *name,
+                      int default_workers) {
+  int i;
+
+  conf->name = name;
+  conf->workers = get_num_cpus_from_env();
+  if (conf->workers == -1) {
+    conf->workers =
+        default_workers != -1 ? default_workers : get_logical_cpu_cores();
+  }
+  conf->reuseport = get_flag_from_env("REUSEPORT");
+  conf->reuseport_cbpf = conf->reuseport && get_flag_from_env("REUSEPORT_CBPF");
+  conf->listeners = NULL;
+  conf->listener_n = 0;
+  conf->stats = NULL;
+  conf->body_size = get_size_from_env("BODY_SIZE", -1);
+  conf->chunked = get_flag_from_env("CHUNKED");
+  read_status_mix(conf);
+  conf->timeouts[TIMER_NONE] = 0;
+  conf->timeouts[TIMER_HEADER] = get_msec_from_env("HEADER_TIMEOUT", 60000);
+  conf->timeouts[TIMER_KEEPALIVE] =
+      get_msec_from_env("KEEPALIVE_TIMEOUT", 75000);
+  conf->timeouts[TIMER_SEND] = get_msec_from_env("SEND_TIMEOUT", 60000);
+  raise_nofile_limit();
+  printf("workers=%d\n", conf->workers);
+  printf("reuseport=%d\n", conf->reuseport);
+  printf("body_size=%ld\n", conf->body_size);
+  printf("chunked=%d\n", conf->chunked);
+  printf("status_mix=");
+  for (i = 0; i < conf->status_n; i++) {
+    printf("%s%d:%d", i > 0 ? "," : "", conf->statuses[i], conf->weights[i]);
+  }
+  printf("\n");
+  printf("timeouts=header:%ldms,keepalive:%ldms,send:%ldms\n",
+         conf->timeouts[TIMER_HEADER], conf->timeouts[TIMER_KEEPALIVE],
+         conf->timeouts[TIMER_SEND]);
+}
+
+static int open_listening_socket(int reuseport, int nonblocking) {
+  struct sockaddr_in server_addr;
+  int server_fd, reuseaddr, nb;
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_fd == -1) {
+    perror("socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(SERVER_PORT);
+
+  reuseaddr = 1;
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuseaddr,
+                 sizeof(int)) == -1) {
+    perror("setsockopt reuse addr failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  if (reuseport &&
+      setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, (const void *)&reuseaddr,
+                 sizeof(int)) == -1) {
+    perror("setsockopt reuse port failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  nb = 1;
+  if (nonblocking && ioctl(server_fd, FIONBIO, &nb) == -1) {
+    perror("ioctl FIONBIO failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
+      0) {
+    perror("bind failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  if (listen(server_fd, SERVER_BACKLOG) < 0) {
+    perror("listen failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  return server_fd;
+}
+
+/*
+ * Steers each connection to the listener at the index of the CPU which
+ * received the SYN, so it is accepted by the worker pinned to that CPU.
+ * Listeners join the reuseport group in the order of listen(), which is
+ * the worker order. See SO_ATTACH_REUSEPORT_CBPF in socket(7).
+ */
+static void attach_reuseport_cbpf(int server_fd, int group_size) {
+  struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, group_size},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  struct sock_fprog prog = {
+      .len = sizeof(code) / sizeof(code[0]),
+      .filter = code,
+  };
+
+  if (setsockopt(server_fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                 sizeof(prog)) == -1) {
+    perror("setsockopt SO_ATTACH_REUSEPORT_CBPF failed");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * The listeners passed to the new binary of an upgrade, as their fds
+ * separated by commas. See ngx_add_inherited_sockets.
+ */
+#define INHERITED_LISTENERS "INHERITED_LISTENERS"
+
+/*
+ * Takes the listeners inherited from the old binary, up to the number
+ * needed, and returns how many. The ones beyond it are closed, which drops
+ * the connections in their queues if the new binary has fewer workers.
+ */
+static int inherit_listeners(server_conf_t *conf, int nonblocking) {
+  char *val, *p, *end;
+  int n, fd, nb;
+
+  val = getenv(INHERITED_LISTENERS);
+  if (val == NULL) {
+    return 0;
+  }
+  n = 0;
+  for (p = val; *p != '\0'; p = end) {
+    fd = strtol(p, &end, 10);
+    if (end == p || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "invalid %s: %s\n", INHERITED_LISTENERS, val);
+      exit(EXIT_FAILURE);
+    }
+    if (*end == ',') {
+      end++;
+    }
+    if (n == conf->listener_n) {
+      close(fd);
+      continue;
+    }
+    nb = nonblocking;
+    if (ioctl(fd, FIONBIO, &nb) == -1) {
+      perror("ioctl FIONBIO failed");
+      exit(EXIT_FAILURE);
+    }
+    conf->listeners[n++] = fd;
+  }
+  /* not passed on to the workers or a later upgrade */
+  unsetenv(INHERITED_LISTENERS);
+  printf("inherited_listeners=%d\n", n);
+  return n;
+}
+
+void server_open_listeners(server_conf_t *conf, int nonblocking) {
+  int i;
+
+  conf->listener_n = conf->reuseport ? conf->workers : 1;
+  conf->listeners = malloc(sizeof(int) * conf->listener_n);
+  if (conf->listeners == NULL) {
+    fprintf(stderr, "cannot allocate listeners\n");
+    exit(EXIT_FAILURE);
+  }
+  for (i = inherit_listeners(conf, nonblocking); i < conf->listener_n; i++) {
+    conf->listeners[i] = open_listening_socket(conf->reuseport, nonblocking);
+  }
+  if (conf->reuseport_cbpf) {
+    attach_reuseport_cbpf(conf->listeners[0], conf->listener_n);
+  }
+}
+
+void server_close_listeners(server_conf_t *conf) {
+  int i;
+
+  for (i = 0; i < conf->listener_n; i++) {
+    close(conf->listeners[i]);
+  }
+  free(conf->listeners);
+  conf->listeners = NULL;
+  conf->listener_n = 0;
+}
+
+/*
+ * Pins the worker to the n-th CPU the process is allowed to run on, so that
+ * an outer taskset or cpuset is respected.
+ */
+int pin_thread(pthread_t thread, int n) {
+  cpu_set_t allowed, cpuset;
+  int cpu, count;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("sched_getaffinity failed");
+    return -1;
+  }
+  n %= CPU_COUNT(&allowed);
+  for (cpu = 0, count = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed) && count++ == n) {
+      break;
+    }
+  }
+
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  if (pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset) != 0) {
+    perror("pthread_setaffinity_np failed");
+    return -1;
+  }
+  return 0;
+}
+
+static server_worker_t *alloc_workers(server_conf_t *conf) {
+  server_worker_t *workers;
+  int i;
+
+  workers = malloc(sizeof(server_worker_t) * conf->workers);
+  if (workers == NULL) {
+    fprintf(stderr, "cannot allocate workers\n");
+    exit(EXIT_FAILURE);
+  }
+  conf->stats = stats_alloc(conf->workers);
+  for (i = 0; i < conf->workers; i++) {
+    workers[i].conf = conf;
+    workers[i].index = i;
+    workers[i].listener = conf->listeners[conf->reuseport ? i : 0];
+    workers[i].stats = &conf->stats[i];
+  }
+  return workers;
+}
+
+/* Writes the stats to STATS_FILE, or to stderr without it. */
+static void dump_stats(server_conf_t *conf) {
+  const char *path;
+  FILE *fp;
+
+  path = getenv("STATS_FILE");
+  if (path == NULL) {
+    stats_dump(stderr, conf->name, conf->stats, conf->workers);
+    return;
+  }
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("cannot open STATS_FILE");
+    return;
+  }
+  stats_dump(fp, conf->name, conf->stats, conf->workers);
+  fclose(fp);
+}
+
+volatile sig_atomic_t server_quit;
+sigset_t server_wait_mask;
+
+/*
+ * The signals are blocked before the workers start, so that only the main
+ * thread receives them in wait_signals. SIGPIPE is ignored, as by nginx, so
+ * that a send to a connection the client reset fails with EPIPE instead of
+ * killing the process.
+ */
+static void block_signals(sigset_t *set) {
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(set);
+  sigaddset(set, SIGUSR1);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGTERM);
+  if (pthread_sigmask(SIG_BLOCK, set, NULL) != 0) {
+    perror("pthread_sigmask failed");
+    exit(EXIT_FAILURE);
+  }
+  pthread_sigmask(SIG_SETMASK, NULL, &server_wait_mask);
+}
+
+/* SIGUSR1 dumps the stats, and SIGINT or SIGTERM dumps them and returns. */
+static void wait_signals(server_conf_t *conf, sigset_t *set) {
+  int sig;
+
+  for (;;) {
+    if (sigwait(set, &sig) != 0) {
+      perror("sigwait failed");
+      exit(EXIT_FAILURE);
+    }
+    dump_stats(conf);
+    if (sig != SIGUSR1) {
+      return;
+    }
+  }
+}
+
+int server_run_threads(server_conf_t *conf, void *(*worker)(void *)) {
+  server_worker_t *workers;
+  pthread_t *threads;
+  sigset_t set;
+  int rc, i;
+
+  workers = alloc_workers(conf);
+  threads = malloc(sizeof(pthread_t) * conf->workers);
+  if (threads == NULL) {
+    fprintf(stderr, "cannot allocate threads\n");
+    exit(EXIT_FAILURE);
+  }
+
+  block_signals(&set);
+  for (i = 0; i < conf->workers; i++) {
+    rc = pthread_create(&threads[i], NULL, worker, &workers[i]);
+    if (rc != 0) {
+      perror("Create thread failed");
+      exit(EXIT_FAILURE);
+    }
+    if (conf->reuseport && pin_thread(threads[i], i) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* the workers never return, they end with the process */
+  wait_signals(conf, &set);
+  return 0;
+}
+
+/*
+ * The master of the worker processes. Each worker slot keeps its index, and
+ * so its listener, CPU and stats, across respawns.
+ */
+typedef struct {
+  server_conf_t *conf;
+  server_worker_t *workers;
+  void *(*worker)(void *);
+  pid_t *pids;            /* 0 for a worker which is gone */
+  int live;               /* worker processes */
+  int quitting;           /* no more respawns */
+  pid_t new_binary;       /* the master of an upgrade */
+  sigset_t signals;       /* unblocked in the workers */
+  sigset_t original_mask; /* restored for the new binary */
+  const char *pid_file;
+  char exe[PATH_MAX]; /* the binary, which an upgrade replaces at the path */
+} supervisor_t;
+
+static void handle_quit(int sig) {
+  (void)sig;
+  server_quit = 1;
+}
+
+static void spawn_worker(supervisor_t *s, int i) {
+  struct sigaction sa;
+  pid_t pid;
+
+  /* the buffered output would be written again by the worker */
+  fflush(NULL);
+  pid = fork();
+  switch (pid) {
+  case 0:
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_quit;
+    sigaction(SIGQUIT, &sa, NULL);
+    /*
+     * The master dumps the stats of every worker, so a SIGUSR1 which also
+     * reaches the workers, as from pkill, must not kill them.
+     */
+    signal(SIGUSR1, SIG_IGN);
+    pthread_sigmask(SIG_UNBLOCK, &s->signals, NULL);
+    pthread_sigmask(SIG_SETMASK, NULL, &server_wait_mask);
+    sigdelset(&server_wait_mask, SIGQUIT);
+    if (s->conf->reuseport && pin_thread(pthread_self(), i) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    s->worker(&s->workers[i]);
+    exit(EXIT_SUCCESS);
+  case -1:
+    perror("fork worker process failed");
+    s->pids[i] = 0;
+    return;
+  }
+  s->pids[i] = pid;
+  s->live++;
+}
+
+static void signal_workers(supervisor_t *s, int sig) {
+  int i;
+
+  for (i = 0; i < s->conf->workers; i++) {
+    if (s->pids[i] > 0) {
+      kill(s->pids[i], sig);
+    }
+  }
+}
+
+static void write_pid_file(const char *path) {
+  FILE *fp;
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror("cannot open PID_FILE");
+    return;
+  }
+  fprintf(fp, "%d\n", (int)getpid());
+  fclose(fp);
+}
+
+static void old_pid_file(supervisor_t *s, char *buf, size_t size) {
+  snprintf(buf, size, "%s.oldbin", s->pid_file);
+}
+
+/*
+ * Starts the binary at the path of this one again with the listeners, like
+ * the SIGUSR2 of nginx. The listeners are not close-on-exec, so only their
+ * fds are passed. Both generations accept until the old one is sent
+ * SIGQUIT, or the new one is stopped if it misbehaves.
+ */
+static void exec_new_binary(supervisor_t *s) {
+  char fds[256], old[PATH_MAX + 8];
+  char *argv[2];
+  size_t len;
+  int i;
+
+  if (s->new_binary > 0) {
+    fprintf(stderr, "the new binary %d is running already\n",
+            (int)s->new_binary);
+    return;
+  }
+  if (s->exe[0] == '\0') {
+    fprintf(stderr, "cannot upgrade without the path of the binary\n");
+    return;
+  }
+  len = 0;
+  for (i = 0; i < s->conf->listener_n && len < sizeof(fds); i++) {
+    len += snprintf(fds + len, sizeof(fds) - len, "%s%d", i > 0 ? "," : "",
+                    s->conf->listeners[i]);
+  }
+  if (len >= sizeof(fds)) {
+    fprintf(stderr, "too many listeners to pass\n");
+    return;
+  }
+  if (s->pid_file != NULL) {
+    old_pid_file(s, old, sizeof(old));
+    if (rename(s->pid_file, old) == -1) {
+      perror("cannot rename PID_FILE");
+    }
+  }
+
+  fflush(NULL);
+  s->new_binary = fork();
+  switch (s->new_binary) {
+  case 0:
+    pthread_sigmask(SIG_SETMASK, &s->original_mask, NULL);
+    setenv(INHERITED_LISTENERS, fds, 1);
+    argv[0] = s->exe;
+    argv[1] = NULL;
+    execv(s->exe, argv);
+    perror("execv new binary failed");
+    _exit(EXIT_FAILURE);
+  case -1:
+    perror("fork new binary failed");
+    s->new_binary = 0;
+    if (s->pid_file != NULL) {
+      rename(old, s->pid_file);
+    }
+    return;
+  }
+  fprintf(stderr, "started the new binary %d\n", (int)s->new_binary);
+}
+
+/*
+ * Reaps the exited children. A worker killed by a signal, as by a crash,
+ * is respawned unless the master quits. One which exits with an error is
+ * not, as it failed on its setup and would fail again.
+ */
+static void reap_children(supervisor_t *s) {
+  char old[PATH_MAX + 8];
+  int status, i;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (pid == s->new_binary) {
+      /* the upgrade failed or was abandoned, this one stays in charge */
+      fprintf(stderr, "the new binary %d exited\n", (int)pid);
+      s->new_binary = 0;
+      if (s->pid_file != NULL) {
+        old_pid_file(s, old, sizeof(old));
+        if (rename(old, s->pid_file) == -1) {
+          perror("cannot rename PID_FILE back");
+        }
+      }
+      continue;
+    }
+    for (i = 0; i < s->conf->workers; i++) {
+      if (s->pids[i] == pid) {
+        break;
+      }
+    }
+    if (i == s->conf->workers) {
+      continue;
+    }
+    s->pids[i] = 0;
+    s->live--;
+    if (WIFSIGNALED(status)) {
+      fprintf(stderr, "worker process %d exited on signal %d\n", (int)pid,
+              WTERMSIG(status));
+      if (!s->quitting) {
+        spawn_worker(s, i);
+      }
+    } else if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+      fprintf(stderr, "worker process %d exited with code %d\n", (int)pid,
+              WEXITSTATUS(status));
+    }
+  }
+}
+
+int server_run_processes(server_conf_t *conf, void *(*worker)(void *)) {
+  supervisor_t s;
+  char old[PATH_MAX + 8];
+  sigset_t set;
+  ssize_t len;
+  int status, sig, i;
+
+  s.conf = conf;
+  s.worker = worker;
+  s.workers = alloc_workers(conf);
+  s.pids = calloc(conf->workers, sizeof(pid_t));
+  if (s.pids == NULL) {
+    fprintf(stderr, "cannot allocate pids\n");
+    exit(EXIT_FAILURE);
+  }
+  s.live = 0;
+  s.quitting = 0;
+  s.new_binary = 0;
+  s.pid_file = getenv("PID_FILE");
+  /* the link, since the file may be replaced at the path for an upgrade */
+  len = readlink("/proc/self/exe", s.exe, sizeof(s.exe) - 1);
+  s.exe[len > 0 ? len : 0] = '\0';
+
+  pthread_sigmask(SIG_SETMASK, NULL, &s.original_mask);
+  block_signals(&s.signals);
+  set = s.signals;
+  sigaddset(&set, SIGQUIT);
+  sigaddset(&set, SIGUSR2);
+  sigaddset(&set, SIGCHLD);
+  if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0) {
+    perror("pthread_sigmask failed");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < conf->workers; i++) {
+    spawn_worker(&s, i);
+  }
+  if (s.pid_file != NULL) {
+    write_pid_file(s.pid_file);
+  }
+
+  while (s.live > 0) {
+    if (sigwait(&set, &sig) != 0) {
+      perror("sigwait failed");
+      exit(EXIT_FAILURE);
+    }
+    switch (sig) {
+    case SIGCHLD:
+      reap_children(&s);
+      break;
+    case SIGUSR1:
+      /* the stats are in shared memory, so the master dumps them all */
+      dump_stats(conf);
+      break;
+    case SIGUSR2:
+      exec_new_binary(&s);
+      break;
+    case SIGQUIT:
+      s.quitting = 1;
+      signal_workers(&s, SIGQUIT);
+      break;
+    default: /* SIGINT or SIGTERM */
+      s.quitting = 1;
+      signal_workers(&s, SIGTERM);
+      for (i = 0; i < conf->workers; i++) {
+        if (s.pids[i] > 0 && waitpid(s.pids[i], &status, 0) == -1) {
+          perror("wait worker process failed");
+        }
+      }
+      s.live = 0;
+      break;
+    }
+  }
+  dump_stats(conf);
+
+  if (s.pid_file != NULL) {
+    if (s.new_binary > 0) {
+      old_pid_file(&s, old, sizeof(old));
+      unlink(old);
+    } else {
+      unlink(s.pid_file);
+    }
+  }
+  free(s.pids);
+  free(s.workers);
+  return s.quitting ? 0 : -1;
+}
+
+/*
+ * The pool grows in chunks of one huge page, aligned to their size so that
+ * the chunk of a connection is found by masking its address. A chunk starts
+ * with its header and the connections, followed by their buffers on their
+ * own pages, so that the buffers of an idle chunk can be returned with
+ * madvise while the connections stay on the free list.
+ */
+#define CHUNK_SIZE (2 * 1024 * 1024)
+#define CHUNK_HEADER_SIZE 64
+#define PAGE_SIZE 4096
+
+struct connection_chunk_s {
+  connection_chunk_t *next;
+  int used;              /* connections handed out */
+  unsigned released : 1; /* the buffers were returned */
+};
+
+#define connection_chunk(c)                                                    \
+  ((connection_chunk_t *)((uintptr_t)(c) & ~(uintptr_t)(CHUNK_SIZE - 1)))
+
+static void *alloc_chunk(void) {
+  char *p, *aligned;
+  size_t head;
+
+  /* twice the size, then the unaligned ends are unmapped */
+  p = mmap(NULL, CHUNK_SIZE * 2, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    perror("cannot map connections");
+    return NULL;
+  }
+  aligned = (char *)(((uintptr_t)p + CHUNK_SIZE - 1) &
+                     ~(uintptr_t)(CHUNK_SIZE - 1));
+  head = aligned - p;
+  if (head > 0) {
+    munmap(p, head);
+  }
+  munmap(aligned + CHUNK_SIZE, CHUNK_SIZE - head);
+
+  /* best effort, transparent huge pages may be disabled */
+  madvise(aligned, CHUNK_SIZE, MADV_HUGEPAGE);
+  return aligned;
+}
+
+static int grow_pool(connection_pool_t *pool) {
+  connection_chunk_t *chunk;
+  connection_t *c, *next;
+  char *conns, *bufs;
+  int i;
+
+  chunk = alloc_chunk();
+  if (chunk == NULL) {
+    return -1;
+  }
+  chunk->used = 0;
+  chunk->released = 0;
+  chunk->next = pool->chunks;
+  pool->chunks = chunk;
+
+  conns = (char *)chunk + CHUNK_HEADER_SIZE;
+  bufs = (char *)chunk + pool->bufs_offset;
+
+  /* linked in address order, so that the lowest one is used first */
+  i = pool->per_chunk;
+  next = pool->free;
+  do {
+    i--;
+
+    c = (connection_t *)(conns + (size_t)i * pool->size);
+    c->next = next;
+    c->fd = -1;
+    c->buf = pool->with_buffers ? bufs + (size_t)i * BUF_SIZE : NULL;
+
+    next = c;
+  } while (i);
+
+  pool->free = next;
+  pool->free_n += pool->per_chunk;
+  pool->n += pool->per_chunk;
+  return 0;
+}
+
+void connection_pool_init(connection_pool_t *pool, int n, size_t size,
+                          int with_buffers) {
+  size_t slot;
+
+  pool->size = size;
+  pool->with_buffers = with_buffers;
+  pool->chunks = NULL;
+  pool->free = NULL;
+  pool->free_n = 0;
+  pool->n = 0;
+
+  slot = size + (with_buffers ? BUF_SIZE : 0);
+  pool->per_chunk = (CHUNK_SIZE - CHUNK_HEADER_SIZE - PAGE_SIZE) / slot;
+  pool->bufs_offset =
+      (CHUNK_HEADER_SIZE + pool->per_chunk * size + PAGE_SIZE - 1) &
+      ~(size_t)(PAGE_SIZE - 1);
+
+  while (pool->n < n) {
+    if (grow_pool(pool) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+void init_connection(connection_t *c, int fd) {
+  c->fd = fd;
+  c->tcp_nodelay = 0;
+  c->timer_kind = TIMER_NONE;
+  timer_init(&c->timer);
+  c->last = 0;
+  http_header_init(&c->header);
+}
+
+connection_t *get_connection(connection_pool_t *pool, int fd) {
+  connection_t *c;
+
+  if (pool->free == NULL && grow_pool(pool) == -1) {
+    fprintf(stderr, "cannot grow connections beyond %d\n", pool->n);
+    return NULL;
+  }
+  c = pool->free;
+  pool->free = c->next;
+  pool->free_n--;
+  /* the buffer of a released chunk is faulted in again on use */
+  connection_chunk(c)->released = 0;
+  connection_chunk(c)->used++;
+  init_connection(c, fd);
+  return c;
+}
+
+void free_connection(connection_pool_t *pool, connection_t *c) {
+  connection_chunk_t *chunk = connection_chunk(c);
+
+  /* the last freed is used next while it is still in the cache */
+  c->fd = -1;
+  c->next = pool->free;
+  pool->free = c;
+  pool->free_n++;
+
+  /*
+   * Once more than a chunk of connections is idle on top of this one, the
+   * buffers of this chunk are returned to the kernel. The connections stay
+   * linked, so the chunk is not unmapped.
+   */
+  if (--chunk->used == 0 && pool->with_buffers && !chunk->released &&
+      pool->free_n >= 2 * pool->per_chunk) {
+    madvise((char *)chunk + pool->bufs_offset,
+            (size_t)pool->per_chunk * BUF_SIZE & ~(size_t)(PAGE_SIZE - 1),
+            MADV_DONTNEED);
+    chunk->released = 1;
+  }
+}
+
+void connection_pool_each(connection_pool_t *pool,
+                          void (*handler)(connection_t *c, void *arg),
+                          void *arg) {
+  connection_chunk_t *chunk;
+  connection_t *c;
+  int i;
+
+  for (chunk = pool->chunks; chunk != NULL; chunk = chunk->next) {
+    for (i = 0; i < pool->per_chunk; i++) {
+      c = (connection_t *)((char *)chunk + CHUNK_HEADER_SIZE +
+                           (size_t)i * pool->size);
+      if (c->fd != -1) {
+        handler(c, arg);
+      }
+    }
+  }
+}
+
+/* Sets TCP_NODELAY once the connection is known to be kept alive. */
+int set_tcp_nodelay(connection_t *c) {
+  int tcp_nodelay;
+
+  if (c->tcp_nodelay) {
+    return 0;
+  }
+  tcp_nodelay = 1;
+  if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&tcp_nodelay,
+                 sizeof(int)) == -1) {
+    perror("setsockopt TCP_NODELAY: client_fd");
+    return -1;
+  }
+  c->tcp_nodelay = 1;
+  return 0;
+}
+
+void connection_timers_init(connection_timers_t *t, const server_conf_t *conf) {
+  t->timeouts = conf->timeouts;
+  t->now = stats_now_ns() / 1000000;
+  timer_wheel_init(&t->wheel, t->now);
+}
+
+void connection_timers_update(connection_timers_t *t) {
+  t->now = stats_now_ns() / 1000000;
+}
+
+void connection_timer(connection_timers_t *t, connection_t *c, int kind) {
+  long timeout = t->timeouts[kind];
+  uint64_t expires = t->now + timeout;
+
+  if (timer_pending(&c->timer)) {
+    if (kind == c->timer_kind && timeout > 0 &&
+        expires - c->timer.expires < CONNECTION_TIMER_LAZY) {
+      return;
+    }
+    timer_del(&t->wheel, &c->timer);
+  }
+  c->timer_kind = kind;
+  if (timeout > 0) {
+    timer_add(&t->wheel, &c->timer, expires);
+  }
+}
+
+void connection_timer_read(connection_timers_t *t, connection_t *c) {
+  /* TCP_NODELAY is set once a response is sent and the connection kept */
+  if (c->last == 0 && c->tcp_nodelay) {
+    connection_timer(t, c, TIMER_KEEPALIVE);
+  } else if (c->timer_kind != TIMER_HEADER) {
+    connection_timer(t, c, TIMER_HEADER);
+  }
+}
+
+void connection_timer_del(connection_timers_t *t, connection_t *c) {
+  if (timer_pending(&c->timer)) {
+    timer_del(&t->wheel, &c->timer);
+  }
+  c->timer_kind = TIMER_NONE;
+}
+
+/*
+ * Frames the complete requests at the start of buf[0, *last) and drops them
+ * from the buffer, keeping an incomplete one for the next read. The header
+ * scan resumes at the line where the previous call stopped. Returns the
+ * number of requests, or -1 if an incomplete header block fills the buffer.
+ * Requests after one with "Connection: close" are discarded. Request bodies
+ * are not expected since the origins only serve GET.
+ */
+int frame_buffer(char *buf, int *last, http_header_t *header, int *closing) {
+  size_t pos, n;
+  int nreq;
+
+  *closing = 0;
+  pos = 0;
+  nreq = 0;
+  while (!*closing) {
+    n = http_scan_header(buf + pos, *last - pos, header);
+    if (n == 0) {
+      break;
+    }
+    *closing = header->connection_close;
+    http_header_init(header);
+    pos += n;
+    nreq++;
+  }
+
+  if (*closing) {
+    *last = 0;
+    return nreq;
+  }
+  if (pos > 0) {
+    memmove(buf, buf + pos, *last - pos);
+    *last -= pos;
+  }
+  if (*last == BUF_SIZE) {
+    return -1;
+  }
+  return nreq;
+}
+
+int frame_requests(connection_t *c, int *closing) {
+  return frame_buffer(c->buf, &c->last, &c->header, closing);
+}
+
+static time_t get_now() {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec;
+}
+
+static int format_http_date(time_t now, char buffer[HTTP_DATE_BUF_LEN]) {
+  struct tm *tm;
+
+  tm = gmtime(&now);
+  if (tm == NULL) {
+    perror("gmtime failed");
+    return -1;
+  }
+  return (int)strftime(buffer, HTTP_DATE_BUF_LEN, "%a, %d %b %Y %H:%M:%S GMT",
+                       tm);
+}
+
+/*
+ * Writes a body of len bytes repeating RESPONSE_BODY, in chunks of
+ * RESPONSE_CHUNK_SIZE if chunked. Returns the length on the wire, and only
+ * counts it if p is NULL.
+ */
+static size_t write_body(char *p, size_t len, int chunked) {
+  size_t n, k, total, written;
+  char line[32];
+  int line_len;
+
+  total = 0;
+  written = 0;
+  while (len > 0 || chunked) {
+    n = chunked && len > RESPONSE_CHUNK_SIZE ? RESPONSE_CHUNK_SIZE : len;
+    if (chunked) {
+      line_len = snprintf(line, sizeof(line), "%zx\r\n", n);
+      if (p != NULL) {
+        memcpy(p + total, line, line_len);
+      }
+      total += line_len;
+    }
+    if (p != NULL) {
+      for (k = 0; k < n; k++) {
+        p[total + k] =
+            RESPONSE_BODY[(written + k) % (sizeof(RESPONSE_BODY) - 1)];
+      }
+    }
+    total += n;
+    written += n;
+    if (chunked) {
+      /* after the last chunk, which is empty, this ends the trailer */
+      if (p != NULL) {
+        memcpy(p + total, "\r\n", 2);
+      }
+      total += 2;
+      if (n == 0) {
+        break;
+      }
+    }
+    len -= n;
+  }
+  return total;
+}
+
+/*
+ * Writes the response with status into p, or only counts it if p is NULL.
+ * Returns its length and sets the offset of the Date value.
+ */
+static size_t write_response(char *p, const server_conf_t *conf, int status,
+                             size_t body_len, size_t *date_offset) {
+  char header[RESPONSE_BUF_SIZE], length[48];
+  size_t header_len;
+  int n;
+
+  n = snprintf(header, sizeof(header), "HTTP/1.1 %d %s\r\nDate: ", status,
+               status_reason(status));
+  *date_offset = n;
+  if (conf->chunked) {
+    snprintf(length, sizeof(length), "Transfer-Encoding: chunked");
+  } else {
+    snprintf(length, sizeof(length), "Content-Length: %zu", body_len);
+  }
+  header_len = n + snprintf(header + n, sizeof(header) - n,
+                            "%s\r\n"
+                            "Server: %s\r\n"
+                            "Content-Type: text/plain\r\n"
+                            "%s\r\n"
+                            "\r\n",
+                            "Thu, 01 Jan 1970 00:00:00 GMT", conf->name, length);
+  if (p != NULL) {
+    memcpy(p, header, header_len);
+    p += header_len;
+  }
+  return header_len + write_body(p, body_len, conf->chunked);
+}
+
+/*
+ * Spreads the statuses over the schedule by their weights with the smooth
+ * weighted round robin of ngx_http_upstream_get_peer, so that for
+ * "200:9,404:1" a 404 comes after every nine 200s instead of in bursts.
+ */
+static void build_schedule(response_t *r, const server_conf_t *conf) {
+  int current[RESPONSE_STATUS_MAX], total, best, i;
+
+  total = 0;
+  for (i = 0; i < conf->status_n; i++) {
+    current[i] = 0;
+    total += conf->weights[i];
+  }
+  for (r->schedule_n = 0; r->schedule_n < total; r->schedule_n++) {
+    best = 0;
+    for (i = 0; i < conf->status_n; i++) {
+      current[i] += conf->weights[i];
+      if (current[i] > current[best]) {
+        best = i;
+      }
+    }
+    current[best] -= total;
+    r->schedule[r->schedule_n] = best;
+  }
+}
+
+int response_init(response_t *r, const server_conf_t *conf) {
+  response_train_t *t;
+  size_t body_len, train;
+  char *p;
+  int i, j, k;
+
+  body_len = conf->body_size < 0 ? sizeof(RESPONSE_BODY) - 1
+                                  : (size_t)conf->body_size;
+  r->size = 0;
+  for (i = 0; i < conf->status_n; i++) {
+    t = &r->trains[i];
+    t->status = conf->statuses[i];
+    t->offset = r->size;
+    t->len = write_response(NULL, conf, t->status, body_len, &t->date_offset);
+    /* as many copies as fit in RESPONSE_TRAIN_SIZE, but at least one */
+    train = RESPONSE_TRAIN_SIZE / t->len;
+    t->copies = train < 1 ? 1 : train > MAX_PIPELINED ? MAX_PIPELINED : train;
+    r->size += (size_t)t->copies * t->len;
+  }
+  r->train_n = conf->status_n;
+
+  for (k = 0; k < 2; k++) {
+    r->buf[k] = malloc(r->size);
+    if (r->buf[k] == NULL) {
+      fprintf(stderr, "cannot alloc response buffers\n");
+      return -1;
+    }
+    for (i = 0; i < r->train_n; i++) {
+      t = &r->trains[i];
+      p = r->buf[k] + t->offset;
+      write_response(p, conf, t->status, body_len, &t->date_offset);
+      for (j = 1; j < t->copies; j++) {
+        memcpy(p + (size_t)j * t->len, p, t->len);
+      }
+    }
+  }
+  build_schedule(r, conf);
+  r->next = 0;
+  r->server = conf->name;
+  r->cur = 0;
+  r->now = 0;
+  return 0;
+}
+
+/* Patches the Date values of the idle buffer when the second changes. */
+int response_update(response_t *r) {
+  char http_date_buf[HTTP_DATE_BUF_LEN];
+  response_train_t *t;
+  time_t now;
+  char *p;
+  int i, j;
+
+  now = get_now();
+  if (now == r->now) {
+    return 0;
+  }
+  if (format_http_date(now, http_date_buf) != HTTP_DATE_BUF_LEN - 1) {
+    return -1;
+  }
+  for (i = 0; i < r->train_n; i++) {
+    t = &r->trains[i];
+    p = r->buf[r->cur ^ 1] + t->offset + t->date_offset;
+    for (j = 0; j < t->copies; j++, p += t->len) {
+      memcpy(p, http_date_buf, HTTP_DATE_BUF_LEN - 1);
+    }
+  }
+  r->cur ^= 1;
+  r->now = now;
+  return 0;
+}
+
+static const char *status_reason(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 400:
+    return "Bad Request";
+  case 403:
+    return "Forbidden";
+  case 404:
+    return "Not Found";
+  case 429:
+    return "Too Many Requests";
+  case 500:
+    return "Internal Server Error";
+  case 502:
+    return "Bad Gateway";
+  case 503:
+    return "Service Unavailable";
+  case 504:
+    return "Gateway Timeout";
+  default:
+    return NULL;
+  }
+}
+
+int response_next(response_t *r, int n, struct iovec *iov) {
+  response_train_t *t = &r->trains[r->schedule[r->next]];
+  int k = 0;
+
+  do {
+    k++;
+    r->next = r->next + 1 == r->schedule_n ? 0 : r->next + 1;
+  } while (k < n && k < t->copies && r->schedule[r->next] == t - r->trains);
+  iov->iov_base = response_buf(r) + t->offset;
+  iov->iov_len = (size_t)k * t->len;
+  return k;
+}
+
+void response_unget(response_t *r, int n) {
+  r->next = ((r->next - n) % r->schedule_n + r->schedule_n) % r->schedule_n;
+}
+
+int response_header(response_t *r, char *buf, size_t size, int status,
+                    off_t length) {
+  const char *date = response_buf(r) + r->trains[0].offset +
+                     r->trains[0].date_offset;
+
+  return snprintf(buf, size,
+                  "HTTP/1.1 %d %s\r\n"
+                  "Date: %.*s\r\n"
+                  "Server: %s\r\n"
+                  "Content-Type: application/octet-stream\r\n"
+                  "Content-Length: %lld\r\n"
+                  "\r\n",
+                  status, status_reason(status), (int)(HTTP_DATE_BUF_LEN - 1),
+                  date, r->server, (long long)length);
+}
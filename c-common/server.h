@@ -0,0 +1,280 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "http_header.h"
+#include "stats.h"
+#include "timer.h"
+
+#define SERVER_PORT 3000
+#define SERVER_BACKLOG 511
+/* preallocated per worker, the pool grows beyond them on demand */
+#define WORKER_CONNECTIONS 1024
+#define BUF_SIZE 1024
+/* a request is at least 16 bytes, "GET / HTTP/1.1\r\n\r\n" is 18 */
+#define MAX_PIPELINED (BUF_SIZE / 16)
+#define RESPONSE_BODY "Hello, world!\n"
+#define RESPONSE_BUF_SIZE 256
+/* statuses in STATUS_MIX */
+#define RESPONSE_STATUS_MAX 8
+/* the longest schedule a STATUS_MIX may reduce to, see response_init */
+#define RESPONSE_SCHEDULE_MAX 1000
+/* of the chunks a chunked body is sent in */
+#define RESPONSE_CHUNK_SIZE (16 * 1024)
+#define HTTP_DATE_BUF_LEN sizeof("Sun, 06 Nov 1994 08:49:37 GMT")
+
+/*
+ * The timers of a connection, after client_header_timeout,
+ * keepalive_timeout and send_timeout of nginx. The header timer runs from
+ * accept or the first byte of a request until its header is complete, and
+ * is not restarted by the reads in between, so a slowloris client cannot
+ * hold a connection by trickling bytes.
+ */
+enum {
+  TIMER_NONE,
+  TIMER_HEADER,
+  TIMER_KEEPALIVE, /* idle between requests */
+  TIMER_SEND,      /* no progress on a blocked send */
+  TIMER_KINDS,
+};
+
+/*
+ * The server core shared by the C origins. A program picks one of the
+ * backends at the bottom, which only differ in their I/O model; connection
+ * handling, request framing and the response come from here.
+ */
+
+typedef struct {
+  const char *name; /* the Server header value */
+  int workers;      /* threads or processes */
+  /*
+   * When set, each worker has its own SO_REUSEPORT listener and is pinned
+   * to a CPU, instead of all workers sharing one listener.
+   */
+  int reuseport;
+  int reuseport_cbpf; /* steer connections to the worker on the SYN's CPU */
+  int *listeners;
+  int listener_n;
+  server_stats_t *stats; /* one per worker */
+  long body_size;        /* -1 for RESPONSE_BODY */
+  int chunked;           /* Transfer-Encoding: chunked */
+  int status_n;
+  int statuses[RESPONSE_STATUS_MAX];
+  int weights[RESPONSE_STATUS_MAX];
+  long timeouts[TIMER_KINDS]; /* in ms by timer kind, 0 for none */
+} server_conf_t;
+
+typedef struct {
+  server_conf_t *conf;
+  int index;
+  int listener;
+  server_stats_t *stats;
+} server_worker_t;
+
+typedef struct connection_s connection_t;
+
+/*
+ * The part of a connection every backend has. A backend which needs more
+ * state embeds it as the first member of its own connection type.
+ */
+struct connection_s {
+  connection_t *next; /* in the free list */
+  int fd;
+  unsigned tcp_nodelay : 1;
+  unsigned timer_kind : 2;
+  wheel_timer_t timer;
+  int last;             /* received bytes in buf */
+  http_header_t header; /* scan state of the incomplete request */
+  char *buf;            /* BUF_SIZE bytes, may be NULL if allocated lazily */
+};
+
+#define connection_of_timer(t)                                                 \
+  ((connection_t *)((char *)(t)-offsetof(connection_t, timer)))
+
+/*
+ * The connection timers of a worker. A timer is only moved when it would
+ * expire more than CONNECTION_TIMER_LAZY ms later, as with
+ * NGX_TIMER_LAZY_DELAY, so a busy connection does not relink it for every
+ * request.
+ */
+#define CONNECTION_TIMER_LAZY 300
+
+typedef struct {
+  timer_wheel_t wheel;
+  const long *timeouts;
+  uint64_t now; /* in ms, when the events being handled were polled */
+} connection_timers_t;
+
+typedef struct connection_chunk_s connection_chunk_t;
+
+/*
+ * A slab of connections which grows in huge page chunks and never shrinks
+ * below them, see grow_pool. The free list is LIFO.
+ */
+typedef struct {
+  size_t size; /* of a connection including the backend part */
+  int with_buffers;
+  int per_chunk;      /* connections in a chunk */
+  size_t bufs_offset; /* of the buffers in a chunk */
+  connection_chunk_t *chunks;
+  connection_t *free;
+  int free_n;
+  int n; /* connections in all chunks */
+} connection_pool_t;
+
+/*
+ * Every request with the same status gets the same response, so the one of
+ * each status is built once as a train of up to MAX_PIPELINED copies back
+ * to back, and only the Date values are patched when the second changes. A
+ * send may still read its buffer after it is submitted with io_uring, so
+ * the idle one of two buffers is patched and then swapped. The trains of
+ * all statuses share a buffer, which io_uring registers as one.
+ */
+#define RESPONSE_TRAIN_SIZE (256 * 1024)
+
+typedef struct {
+  int status;
+  size_t offset;      /* of the train in a buffer */
+  size_t len;         /* of one response */
+  size_t date_offset; /* in a response */
+  int copies;         /* of the response in the train */
+} response_train_t;
+
+typedef struct {
+  const char *server;
+  char *buf[2];
+  size_t size; /* of a buffer */
+  int cur;
+  response_train_t trains[RESPONSE_STATUS_MAX];
+  int train_n;
+  /* the trains in the order of the status mix, repeated */
+  unsigned char schedule[RESPONSE_SCHEDULE_MAX];
+  int schedule_n;
+  int next; /* in the schedule */
+  time_t now;
+} response_t;
+
+#define response_buf(r) ((r)->buf[(r)->cur])
+
+/*
+ * Reads NUM_CPUS, REUSEPORT, REUSEPORT_CBPF, the response settings
+ * BODY_SIZE, CHUNKED and STATUS_MIX, and the timeouts HEADER_TIMEOUT,
+ * KEEPALIVE_TIMEOUT and SEND_TIMEOUT from the environment. default_workers
+ * is used without NUM_CPUS, or the number of CPUs if it is -1.
+ */
+void server_conf_init(server_conf_t *conf, const char *name,
+                      int default_workers);
+void server_open_listeners(server_conf_t *conf, int nonblocking);
+void server_close_listeners(server_conf_t *conf);
+/*
+ * Run the workers until SIGINT or SIGTERM. The stats are dumped on SIGUSR1
+ * and before returning, see dump_stats.
+ */
+int server_run_threads(server_conf_t *conf, void *(*worker)(void *));
+/*
+ * The master process supervises the workers like the one of nginx: a worker
+ * killed by a signal is respawned, SIGQUIT drains the workers and returns
+ * once they exit, and SIGUSR2 starts the binary again on the same
+ * listeners, for an upgrade without a dropped connection. The master writes
+ * its pid to PID_FILE if set, which is renamed with an .oldbin suffix while
+ * the new binary runs.
+ */
+int server_run_processes(server_conf_t *conf, void *(*worker)(void *));
+
+/*
+ * Set in a worker process by SIGQUIT, on which it stops accepting, closes
+ * its idle connections and exits once the rest are done. SIGQUIT is only
+ * unblocked while the worker waits for events with server_wait_mask, so it
+ * cannot arrive between a check and the wait, see epoll_pwait(2). The mask
+ * keeps it blocked in worker threads.
+ */
+extern volatile sig_atomic_t server_quit;
+extern sigset_t server_wait_mask;
+
+int get_flag_from_env(const char *name);
+/* Reads a size in bytes with an optional K, M or G suffix. */
+long get_size_from_env(const char *name, long default_value);
+/* Reads a time in ms from seconds, or with an ms, s or m suffix. */
+long get_msec_from_env(const char *name, long default_value);
+int pin_thread(pthread_t thread, int n);
+
+/* Preallocates at least n connections of size bytes. */
+void connection_pool_init(connection_pool_t *pool, int n, size_t size,
+                          int with_buffers);
+/* Returns NULL only when the pool cannot grow any more. */
+connection_t *get_connection(connection_pool_t *pool, int fd);
+void free_connection(connection_pool_t *pool, connection_t *c);
+/* Calls handler for each connection in use, which may free it. */
+void connection_pool_each(connection_pool_t *pool,
+                          void (*handler)(connection_t *c, void *arg),
+                          void *arg);
+void init_connection(connection_t *c, int fd);
+int set_tcp_nodelay(connection_t *c);
+
+void connection_timers_init(connection_timers_t *t, const server_conf_t *conf);
+/* Takes the time of the events polled, before they are handled. */
+void connection_timers_update(connection_timers_t *t);
+/* Starts the timer of kind for c, or stops it if kind has no timeout. */
+void connection_timer(connection_timers_t *t, connection_t *c, int kind);
+/*
+ * Starts the header timer, unless it runs already, if c waits for its first
+ * request or has the start of one, or the keepalive timer otherwise.
+ */
+void connection_timer_read(connection_timers_t *t, connection_t *c);
+void connection_timer_del(connection_timers_t *t, connection_t *c);
+
+int frame_buffer(char *buf, int *last, http_header_t *header, int *closing);
+int frame_requests(connection_t *c, int *closing);
+
+int response_init(response_t *r, const server_conf_t *conf);
+int response_update(response_t *r);
+/*
+ * Takes the next responses of the status mix for up to n requests. They are
+ * the ones with the same status as the first, which are set in iov as one
+ * run of copies. Returns the number of responses taken.
+ */
+int response_next(response_t *r, int n, struct iovec *iov);
+/* Puts back the last n responses taken when they could not be sent. */
+void response_unget(response_t *r, int n);
+/*
+ * Formats the header of a response with a body of length bytes, with the
+ * Date of the last response_update. Returns its length like snprintf.
+ */
+int response_header(response_t *r, char *buf, size_t size, int status,
+                    off_t length);
+
+/*
+ * The modes of the threads backend, from THREADS_MODE:
+ *
+ * - accept: each worker blocks in accept and serves one connection at a
+ *   time until it is closed.
+ * - queue: ACCEPTORS threads (1 by default) accept and poll the idle
+ *   connections with epoll, and push a connection a request arrived on
+ *   into an fd_queue_t, which the workers pop. A worker reads what is
+ *   ready without blocking, answers the complete requests and hands the
+ *   connection back to be polled with the rest of a partial request in its
+ *   buffer, so a connection only keeps a worker while it has bytes to
+ *   answer. The queue holds a listen backlog of connections, beyond which
+ *   the acceptors wait.
+ * - spawn: ACCEPTORS threads start a thread with a stack of STACK_SIZE
+ *   bytes (64K by default) for each connection.
+ *
+ * The blocking reads and writev calls are bounded by SO_RCVTIMEO and
+ * SO_SNDTIMEO after the timeouts of the conf.
+ */
+enum { THREADS_ACCEPT, THREADS_QUEUE, THREADS_SPAWN };
+
+/* backends */
+int threads_mode_from_env(void);
+int threads_run(server_conf_t *conf, int mode);
+int epoll_threads_run(server_conf_t *conf);
+int epoll_prefork_run(server_conf_t *conf);
+int uring_run(server_conf_t *conf); /* in libcserver_uring.a */
+
+#endif /* SERVER_H */
@@ -0,0 +1,170 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define STATS_HALF (STATS_SUB_BUCKETS / 2)
+#define STATS_SHIFT (STATS_SUB_BUCKET_BITS - 1)
+
+uint64_t stats_now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t value) {
+  int msb;
+
+  if (value < STATS_SUB_BUCKETS) {
+    return value;
+  }
+  msb = 63 - __builtin_clzll(value);
+  return (msb - STATS_SHIFT) * STATS_HALF + (value >> (msb - STATS_SHIFT));
+}
+
+static uint64_t bucket_lower(int index) {
+  if (index < STATS_SUB_BUCKETS) {
+    return index;
+  }
+  return (uint64_t)(index % STATS_HALF + STATS_HALF)
+         << (index / STATS_HALF - 1);
+}
+
+void stats_record(stats_histogram_t *h, uint64_t value, uint64_t count) {
+  if (h->count == 0 || value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+  h->count += count;
+  h->sum += value * count;
+  h->buckets[bucket_index(value)] += count;
+}
+
+server_stats_t *stats_alloc(int n) {
+  server_stats_t *stats;
+
+  /* anonymous shared mappings are zero filled */
+  stats = mmap(NULL, sizeof(server_stats_t) * n, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (stats == MAP_FAILED) {
+    perror("cannot map stats");
+    exit(EXIT_FAILURE);
+  }
+  return stats;
+}
+
+static uint64_t percentile(const stats_histogram_t *h, double p) {
+  uint64_t rank, seen;
+  int i;
+
+  rank = (uint64_t)(h->count * p);
+  if (rank >= h->count) {
+    rank = h->count - 1;
+  }
+  for (i = 0, seen = 0; i < STATS_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen > rank) {
+      return bucket_lower(i);
+    }
+  }
+  return h->max;
+}
+
+void stats_merge(stats_histogram_t *t, const stats_histogram_t *h) {
+  int i;
+
+  if (h->count == 0) {
+    return;
+  }
+  if (t->count == 0 || h->min < t->min) {
+    t->min = h->min;
+  }
+  if (h->max > t->max) {
+    t->max = h->max;
+  }
+  t->count += h->count;
+  t->sum += h->sum;
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    t->buckets[i] += h->buckets[i];
+  }
+}
+
+void stats_add(server_stats_t *total, const server_stats_t *s) {
+  total->accepts += s->accepts;
+  total->requests += s->requests;
+  total->bytes_in += s->bytes_in;
+  total->bytes_out += s->bytes_out;
+  total->eagains += s->eagains;
+  total->polls += s->polls;
+  total->events += s->events;
+  total->timeouts += s->timeouts;
+  total->spins += s->spins;
+  total->syscalls += s->syscalls;
+  stats_merge(&total->service_time_ns, &s->service_time_ns);
+}
+
+void stats_dump_histogram(FILE *fp, const stats_histogram_t *h) {
+  const char *sep = "";
+  int i;
+
+  fprintf(fp, "{\"count\":%" PRIu64, h->count);
+  if (h->count > 0) {
+    fprintf(fp,
+            ",\"min\":%" PRIu64 ",\"max\":%" PRIu64 ",\"mean\":%" PRIu64
+            ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64
+            ",\"p999\":%" PRIu64,
+            h->min, h->max, h->sum / h->count, percentile(h, 0.5),
+            percentile(h, 0.9), percentile(h, 0.99), percentile(h, 0.999));
+  }
+  /* [lower bound, count] of the buckets which are not empty */
+  fprintf(fp, ",\"buckets\":[");
+  for (i = 0; i < STATS_BUCKETS; i++) {
+    if (h->buckets[i] > 0) {
+      fprintf(fp, "%s[%" PRIu64 ",%" PRIu64 "]", sep, bucket_lower(i),
+              h->buckets[i]);
+      sep = ",";
+    }
+  }
+  fprintf(fp, "]}");
+}
+
+static void dump_one(FILE *fp, const server_stats_t *s) {
+  fprintf(fp,
+          "{\"accepts\":%" PRIu64 ",\"requests\":%" PRIu64
+          ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+          ",\"eagains\":%" PRIu64 ",\"polls\":%" PRIu64
+          ",\"events\":%" PRIu64 ",\"timeouts\":%" PRIu64
+          ",\"spins\":%" PRIu64 ",\"syscalls\":%" PRIu64
+          ",\"service_time_ns\":",
+          s->accepts, s->requests, s->bytes_in, s->bytes_out, s->eagains,
+          s->polls, s->events, s->timeouts, s->spins, s->syscalls);
+  stats_dump_histogram(fp, &s->service_time_ns);
+  fputc('}', fp);
+}
+
+void stats_dump(FILE *fp, const char *server, server_stats_t *stats, int n) {
+  server_stats_t snapshot, total;
+  int i;
+
+  memset(&total, 0, sizeof(total));
+  fprintf(fp, "{\"server\":\"%s\",\"workers\":[", server);
+  for (i = 0; i < n; i++) {
+    /* a copy, so that the total and the percentiles agree */
+    memcpy(&snapshot, &stats[i], sizeof(snapshot));
+    stats_add(&total, &snapshot);
+    if (i > 0) {
+      fputc(',', fp);
+    }
+    dump_one(fp, &snapshot);
+  }
+  fprintf(fp, "],\"total\":");
+  dump_one(fp, &total);
+  fprintf(fp, "}\n");
+  fflush(fp);
+}
@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Per-worker counters and a service time histogram. Each worker only writes
+ * its own server_stats_t, which is cache line aligned so that workers never
+ * share a line, and the dump reads them without locking.
+ */
+
+/*
+ * Log-linear buckets as in HdrHistogram: values below STATS_SUB_BUCKETS
+ * are exact, and every power of two above is split into STATS_SUB_BUCKETS/2
+ * buckets, so a recorded value is off by less than 1/16.
+ */
+#define STATS_SUB_BUCKET_BITS 5
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BUCKET_BITS)
+#define STATS_BUCKETS                                                          \
+  ((64 - STATS_SUB_BUCKET_BITS + 2) * (STATS_SUB_BUCKETS / 2))
+
+typedef struct {
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+typedef struct {
+  uint64_t accepts;
+  uint64_t requests;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t eagains;  /* reads and accepts which found nothing */
+  uint64_t polls;    /* epoll_wait or io_uring_submit_and_wait calls */
+  uint64_t events;   /* events or CQEs the polls returned */
+  uint64_t timeouts; /* connections closed by a timer */
+  uint64_t spins;    /* polls without events while busy polling */
+  uint64_t syscalls; /* made to serve connections, including the polls */
+  /* from the read a request is framed in until its response is written */
+  stats_histogram_t service_time_ns;
+} __attribute__((aligned(64))) server_stats_t;
+
+uint64_t stats_now_ns(void);
+void stats_record(stats_histogram_t *h, uint64_t value, uint64_t count);
+/* Adds the values recorded in h to t. */
+void stats_merge(stats_histogram_t *t, const stats_histogram_t *h);
+/*
+ * Writes a histogram as a JSON object of its count, min, max, mean and
+ * percentiles, and its buckets which are not empty as [lower bound, count].
+ */
+void stats_dump_histogram(FILE *fp, const stats_histogram_t *h);
+
+/* Adds the counters and the histogram of s to total. */
+void stats_add(server_stats_t *total, const server_stats_t *s);
+
+/* Allocates n zeroed stats which forked workers share with the parent. */
+server_stats_t *stats_alloc(int n);
+/* Writes the stats of n workers and their total as one JSON object. */
+void stats_dump(FILE *fp, const char *server, server_stats_t *stats, int n);
+
+#endif /* STATS_H */
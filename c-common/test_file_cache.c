@@ -0,0 +1,73 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+
+static int failures;
+
+/* Checks that path fails with err, or is served if err is 0. */
+static void expect(file_cache_t *cache, const char *path, int err) {
+  cached_file_t *file;
+
+  errno = 0;
+  file = file_cache_get(cache, path, strlen(path), 0);
+  if (file != NULL) {
+    file_cache_put(file);
+  }
+  if (err == 0 ? file == NULL : file != NULL || errno != err) {
+    fprintf(stderr, "FAIL %s: %s\n", path,
+            file != NULL ? "served" : strerror(errno));
+    failures++;
+  }
+}
+
+int main(void) {
+  char root[] = "/tmp/file_cache_XXXXXX", path[64];
+  file_cache_t cache;
+  FILE *fp;
+
+  if (mkdtemp(root) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "%s/index.html", root);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  fputs("hello\n", fp);
+  fclose(fp);
+  snprintf(path, sizeof(path), "%s/inside", root);
+  symlink("index.html", path);
+  snprintf(path, sizeof(path), "%s/passwd", root);
+  symlink("/etc/passwd", path);
+  snprintf(path, sizeof(path), "%s/up", root);
+  symlink("..", path);
+
+  if (file_cache_init(&cache, root) == -1) {
+    return EXIT_FAILURE;
+  }
+  expect(&cache, "/", 0);
+  expect(&cache, "/index.html", 0);
+  expect(&cache, "/inside", 0);
+  expect(&cache, "/missing", ENOENT);
+  expect(&cache, "/../etc/passwd", EACCES);
+  expect(&cache, "//etc/passwd", EACCES);
+  expect(&cache, "/a//b", EACCES);
+  expect(&cache, "/passwd", EACCES);
+  expect(&cache, "/up/etc/passwd", EACCES);
+
+  snprintf(path, sizeof(path), "rm -r %s", root);
+  if (system(path) != 0) {
+    fprintf(stderr, "cannot remove %s\n", root);
+  }
+  if (failures > 0) {
+    return EXIT_FAILURE;
+  }
+  printf("file_cache: ok\n");
+  return EXIT_SUCCESS;
+}
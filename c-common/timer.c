@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+/* the farthest a timer may be from now */
+#define WHEEL_SPAN ((uint64_t)1 << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+void timer_wheel_init(timer_wheel_t *w, uint64_t now) {
+  int i;
+
+  w->now = now;
+  w->n = 0;
+  for (i = 0; i < TIMER_LEVELS; i++) {
+    w->used[i] = 0;
+  }
+  for (i = 0; i < TIMER_LEVELS * TIMER_SLOTS; i++) {
+    w->slots[i] = NULL;
+  }
+}
+
+/* Links a timer into the slot of its expiry relative to w->now. */
+static void link_timer(timer_wheel_t *w, wheel_timer_t *t) {
+  uint64_t delta;
+  int level, index;
+
+  if (t->expires < w->now) {
+    /* already due, it expires with the next tick */
+    t->expires = w->now;
+  }
+  delta = t->expires - w->now;
+  if (delta >= WHEEL_SPAN) {
+    t->expires = w->now + WHEEL_SPAN - 1;
+    delta = WHEEL_SPAN - 1;
+  }
+  for (level = 0; level < TIMER_LEVELS - 1; level++) {
+    if (delta < (uint64_t)1 << (TIMER_SLOT_BITS * (level + 1))) {
+      break;
+    }
+  }
+  index = t->expires >> (TIMER_SLOT_BITS * level) & SLOT_MASK;
+
+  t->slot = level * TIMER_SLOTS + index;
+  t->next = w->slots[t->slot];
+  if (t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  w->slots[t->slot] = t;
+  t->pprev = &w->slots[t->slot];
+  w->used[level] |= (uint64_t)1 << index;
+}
+
+void timer_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t expires) {
+  t->expires = expires;
+  link_timer(w, t);
+  w->n++;
+}
+
+void timer_del(timer_wheel_t *w, wheel_timer_t *t) {
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->pprev = NULL;
+  if (w->slots[t->slot] == NULL) {
+    w->used[t->slot / TIMER_SLOTS] &=
+        ~((uint64_t)1 << (t->slot & SLOT_MASK));
+  }
+  w->n--;
+}
+
+/* Moves the timers of a slot of a level above 0 down to the levels below. */
+static void cascade(timer_wheel_t *w, int level, int index) {
+  wheel_timer_t *t, *next;
+
+  t = w->slots[level * TIMER_SLOTS + index];
+  w->slots[level * TIMER_SLOTS + index] = NULL;
+  w->used[level] &= ~((uint64_t)1 << index);
+  for (; t != NULL; t = next) {
+    next = t->next;
+    link_timer(w, t);
+  }
+}
+
+void timer_wheel_expire(timer_wheel_t *w, uint64_t now, timer_handler_t handler,
+                        void *arg) {
+  wheel_timer_t *t;
+  uint64_t bits;
+  int index, level;
+
+  while (w->now <= now) {
+    if (w->n == 0) {
+      w->now = now + 1;
+      return;
+    }
+
+    index = w->now & SLOT_MASK;
+    if (index == 0) {
+      /* level 0 wrapped around, so does each level above whose index is 0 */
+      for (level = 1; level < TIMER_LEVELS; level++) {
+        index = w->now >> (TIMER_SLOT_BITS * level) & SLOT_MASK;
+        cascade(w, level, index);
+        if (index != 0) {
+          break;
+        }
+      }
+      index = 0;
+    }
+
+    while ((t = w->slots[index]) != NULL) {
+      timer_del(w, t);
+      handler(t, arg);
+    }
+
+    /* skip the empty slots up to the next one in use or the wrap around */
+    bits = w->used[0] & ~(uint64_t)0 << index;
+    w->now += bits != 0 ? (uint64_t)__builtin_ctzll(bits) - index
+                        : (uint64_t)(TIMER_SLOTS - index);
+    if (w->now > now + 1) {
+      w->now = now + 1;
+    }
+  }
+}
+
+uint64_t timer_wheel_next(const timer_wheel_t *w) {
+  int index = w->now & SLOT_MASK;
+  uint64_t bits;
+
+  if (w->n == 0) {
+    return UINT64_MAX;
+  }
+  bits = w->used[0] & ~(uint64_t)0 << index;
+  if (bits != 0) {
+    return w->now + __builtin_ctzll(bits) - index;
+  }
+  /*
+   * The timers are further out, cascade them at the wrap around. At index 0
+   * the wrap around is the tick due now, whose cascade has not run yet and
+   * may bring timers into any slot of level 0.
+   */
+  if (index == 0) {
+    return w->now;
+  }
+  return w->now + TIMER_SLOTS - index;
+}
@@ -0,0 +1,58 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel in ms ticks, as the one of the Linux kernel
+ * before 4.8. Level 0 has a slot per tick for the next TIMER_SLOTS ticks,
+ * and each level above has slots TIMER_SLOTS times as wide, whose timers
+ * are cascaded to the level below when it wraps around. Adding and deleting
+ * a timer is O(1), and so is finding the next slot to wait for with the
+ * bitmap of the slots in use. A timer further out than the wheel reaches is
+ * clamped to its end.
+ */
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+typedef struct wheel_timer_s wheel_timer_t;
+
+struct wheel_timer_s {
+  wheel_timer_t *next;
+  wheel_timer_t **pprev; /* NULL while not pending */
+  uint64_t expires;      /* in ms */
+  uint16_t slot;         /* level * TIMER_SLOTS + index */
+};
+
+typedef struct {
+  uint64_t now; /* the next tick to expire */
+  int n;        /* pending timers */
+  uint64_t used[TIMER_LEVELS];
+  wheel_timer_t *slots[TIMER_LEVELS * TIMER_SLOTS];
+} timer_wheel_t;
+
+typedef void (*timer_handler_t)(wheel_timer_t *t, void *arg);
+
+void timer_wheel_init(timer_wheel_t *w, uint64_t now);
+/* Adds a timer which is not pending to expire at expires ms. */
+void timer_add(timer_wheel_t *w, wheel_timer_t *t, uint64_t expires);
+void timer_del(timer_wheel_t *w, wheel_timer_t *t);
+
+#define timer_init(t) ((t)->pprev = NULL)
+#define timer_pending(t) ((t)->pprev != NULL)
+
+/*
+ * Calls handler for each timer which expires by now, after deleting it, so
+ * that the handler may add it again.
+ */
+void timer_wheel_expire(timer_wheel_t *w, uint64_t now, timer_handler_t handler,
+                        void *arg);
+/*
+ * Returns the ms by which timer_wheel_expire should be called next, which
+ * may be a cascade before any timer expires, or UINT64_MAX without timers.
+ */
+uint64_t timer_wheel_next(const timer_wheel_t *w);
+
+#endif /* TIMER_H */
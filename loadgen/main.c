@@ -0,0 +1,994 @@
+#define _GNU_SOURCE /* for strcasestr and sched_getaffinity */
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.h"
+
+/*
+ * A load generator for the origins and proxies. Each thread runs an epoll
+ * loop over its share of the connections.
+ *
+ * Without -r it runs a closed loop: every connection keeps -p requests in
+ * flight and sends the next one as soon as a response is complete, and the
+ * latency is measured from the send. With -r the requests are started at a
+ * fixed total rate whether or not the earlier ones are complete, and the
+ * latency is measured from when each should have been sent, so a stall of
+ * the server shows up in the histogram instead of slowing down the load
+ * (coordinated omission). A request which finds every connection busy waits
+ * with its intended start time. The requests not complete at the end, in
+ * flight or waiting, are recorded with their latency until the end and
+ * counted as unfinished.
+ *
+ * The requests are taken in turn from a ring of request heads, which holds
+ * the request of the URL, or the ones of a corpus file with -f. Each
+ * connection starts at its own head and sends the following ones in order,
+ * and a pipelined batch of them goes out with one send until the end of the
+ * ring. The requests and errors are also counted by head, so that the heads
+ * a server rejects, such as the ones larger than its buffer, show up by
+ * their size. A request lost behind a rejected one in a pipelined batch is
+ * counted against its own head.
+ */
+
+#define MAX_DEPTH 64
+#define MAX_EVENTS 512
+#define READ_BUF_SIZE (64 * 1024)
+#define LINE_SIZE 128
+#define MAX_STATUS 600
+
+enum {
+  STATUS_LINE,
+  HEADER_LINE,
+  BODY,
+  BODY_UNTIL_CLOSE,
+  CHUNK_SIZE_LINE,
+  CHUNK_DATA,
+  CHUNK_END_LINE,
+  TRAILER_LINE,
+};
+
+/* An incremental parser of responses, which skips their bodies. */
+typedef struct {
+  int state;
+  int status;
+  unsigned chunked : 1;
+  unsigned close : 1; /* Connection: close */
+  long long length;   /* Content-Length, -1 without */
+  uint64_t remaining; /* of the body or chunk */
+  int line_len;
+  char line[LINE_SIZE];
+} parser_t;
+
+typedef struct {
+  int fd; /* -1 while closed */
+  unsigned connecting : 1;
+  int responses; /* since connected */
+  int inflight;  /* requests sent or being sent and not answered */
+  int first;     /* in starts */
+  uint64_t starts[MAX_DEPTH];
+  int next;   /* the request head to start next */
+  size_t pos; /* in lg.requests of the bytes still to send */
+  size_t out; /* bytes of requests still to send */
+  parser_t parser;
+} conn_t;
+
+typedef struct {
+  uint64_t requests;
+  uint64_t errors;
+} head_stats_t;
+
+typedef struct {
+  uint64_t requests; /* complete responses */
+  uint64_t errors;   /* requests lost with a failed connection */
+  uint64_t connects;
+  uint64_t retries;    /* requests sent again after the server closed */
+  uint64_t unfinished; /* requests of the open loop not complete at the end */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t statuses[MAX_STATUS];
+  stats_histogram_t latency_ns;
+  head_stats_t *heads; /* of each head of the URL or the corpus */
+} __attribute__((aligned(64))) lg_stats_t;
+
+typedef struct {
+  int index;
+  int epoll_fd;
+  conn_t *conns;
+  int conn_n;
+  int rr;          /* where the search for a free connection starts */
+  uint64_t issued; /* requests started in the open loop */
+  double interval; /* between them in ns, 0 in the closed loop */
+  lg_stats_t stats;
+  char buf[READ_BUF_SIZE];
+} lg_thread_t;
+
+static struct {
+  int threads;
+  int connections;
+  int duration; /* seconds */
+  double rate;  /* requests per second, 0 for the closed loop */
+  int depth;
+  int keepalive;
+  const char *output;
+  const char *url;
+  const char *corpus;
+  struct addrinfo *addr;
+  /* the request heads back to back, at least MAX_DEPTH of them */
+  char *requests;
+  size_t requests_len;
+  size_t *offsets; /* of each head, and requests_len after the last */
+  int request_n;
+  int head_n; /* of the URL or the corpus, before the copies */
+  uint64_t start_ns;
+  uint64_t end_ns;
+} lg;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-c connections] [-t threads] [-d seconds] [-r rate] "
+          "[-p depth] [-n] [-f corpus] [-o file] http://host:port/path\n"
+          "  -r  requests per second in total, the closed loop without it\n"
+          "  -p  pipelined requests per connection\n"
+          "  -n  a new connection for every request\n"
+          "  -f  replay the request heads of a file instead of the URL "
+          "path\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+static int header_is(const char *line, const char *name) {
+  size_t len = strlen(name);
+
+  return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+/* Ends the request head written to out so far. */
+static void end_request(FILE *out) {
+  static int size;
+
+  if (lg.request_n + 2 > size) {
+    size = size > 0 ? size * 2 : 64;
+    lg.offsets = realloc(lg.offsets, sizeof(size_t) * size);
+    if (lg.offsets == NULL) {
+      perror("cannot alloc requests");
+      exit(EXIT_FAILURE);
+    }
+  }
+  lg.offsets[0] = 0;
+  lg.offsets[++lg.request_n] = ftell(out);
+}
+
+/* Writes the headers of the URL and -n, which end a request head. */
+static void end_headers_of_url(FILE *out, const char *host, const char *port) {
+  fprintf(out, "Host: %s:%s\r\n%s\r\n", host, port,
+          lg.keepalive ? "" : "Connection: close\r\n");
+  end_request(out);
+}
+
+/*
+ * Reads the request heads of a corpus: a request line and its header lines,
+ * separated by blank lines, with LF or CRLF line ends. Lines starting with
+ * # are comments. The Host and Connection headers of the corpus are
+ * replaced by the ones of the URL and -n.
+ */
+static void read_corpus(FILE *out, const char *host, const char *port) {
+  char *line = NULL;
+  size_t size = 0;
+  int in_head = 0;
+  ssize_t n;
+  FILE *fp;
+
+  fp = fopen(lg.corpus, "r");
+  if (fp == NULL) {
+    perror(lg.corpus);
+    exit(EXIT_FAILURE);
+  }
+  while ((n = getline(&line, &size, fp)) != -1) {
+    while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) {
+      line[--n] = '\0';
+    }
+    if (line[0] == '#') {
+      continue;
+    }
+    if (n == 0) {
+      if (in_head) {
+        end_headers_of_url(out, host, port);
+        in_head = 0;
+      }
+      continue;
+    }
+    if (in_head && (header_is(line, "Host") || header_is(line, "Connection"))) {
+      continue;
+    }
+    fprintf(out, "%s\r\n", line);
+    in_head = 1;
+  }
+  if (in_head) {
+    end_headers_of_url(out, host, port);
+  }
+  free(line);
+  fclose(fp);
+  if (lg.request_n == 0) {
+    fprintf(stderr, "no requests in %s\n", lg.corpus);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Resolves the URL and builds the request heads, repeated until there are
+ * MAX_DEPTH, so that a pipelined batch of them is sent at once.
+ */
+static void parse_url(const char *url) {
+  char host[256], port[16];
+  const char *p, *path;
+  struct addrinfo hints;
+  size_t host_len, len;
+  int i, n, copies;
+  FILE *out;
+
+  p = url;
+  if (strncmp(p, "http://", 7) == 0) {
+    p += 7;
+  }
+  path = strchr(p, '/');
+  if (path == NULL) {
+    path = "/";
+    host_len = strlen(p);
+  } else {
+    host_len = path - p;
+  }
+  if (host_len >= sizeof(host)) {
+    fprintf(stderr, "too long host: %s\n", url);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(host, p, host_len);
+  host[host_len] = '\0';
+
+  strcpy(port, "80");
+  p = strrchr(host, ':');
+  if (p != NULL) {
+    snprintf(port, sizeof(port), "%s", p + 1);
+    host[p - host] = '\0';
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  n = getaddrinfo(host, port, &hints, &lg.addr);
+  if (n != 0) {
+    fprintf(stderr, "cannot resolve %s: %s\n", host, gai_strerror(n));
+    exit(EXIT_FAILURE);
+  }
+
+  out = open_memstream(&lg.requests, &lg.requests_len);
+  if (out == NULL) {
+    perror("open_memstream");
+    exit(EXIT_FAILURE);
+  }
+  if (lg.corpus != NULL) {
+    read_corpus(out, host, port);
+  } else {
+    fprintf(out, "GET %s HTTP/1.1\r\n", path);
+    end_headers_of_url(out, host, port);
+  }
+  if (fclose(out) != 0) {
+    perror("cannot alloc requests");
+    exit(EXIT_FAILURE);
+  }
+
+  len = lg.requests_len;
+  n = lg.request_n;
+  lg.head_n = n;
+  copies = (MAX_DEPTH + n - 1) / n;
+  lg.requests = realloc(lg.requests, len * copies);
+  lg.offsets = realloc(lg.offsets, sizeof(size_t) * (n * copies + 1));
+  if (lg.requests == NULL || lg.offsets == NULL) {
+    perror("cannot alloc requests");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 1; i < copies; i++) {
+    memcpy(lg.requests + i * len, lg.requests, len);
+  }
+  for (i = n; i < n * copies; i++) {
+    lg.offsets[i + 1] = lg.offsets[i % n + 1] + len * (i / n);
+  }
+  lg.request_n = n * copies;
+  lg.requests_len = len * copies;
+}
+
+static void parser_init(parser_t *p) {
+  p->state = STATUS_LINE;
+  p->close = 0;
+  p->line_len = 0;
+}
+
+/*
+ * Takes the bytes of a line from buf until its LF. Returns 1 when the line
+ * is complete in p->line without its CRLF, which is truncated to LINE_SIZE.
+ */
+static int take_line(parser_t *p, const char *buf, size_t n, size_t *used) {
+  const char *lf = memchr(buf, '\n', n);
+  size_t len = lf != NULL ? (size_t)(lf - buf) : n;
+  size_t room = LINE_SIZE - 1 - p->line_len;
+
+  memcpy(p->line + p->line_len, buf, len < room ? len : room);
+  p->line_len += len < room ? len : room;
+  if (lf == NULL) {
+    *used = n;
+    return 0;
+  }
+  *used = len + 1;
+  if (p->line_len > 0 && p->line[p->line_len - 1] == '\r') {
+    p->line_len--;
+  }
+  p->line[p->line_len] = '\0';
+  p->line_len = 0;
+  return 1;
+}
+
+/* Returns 1 when the response is complete after the headers, -1 on error. */
+static int end_headers(parser_t *p) {
+  if (p->status < 200) {
+    /* an interim response, the real one follows */
+    p->state = STATUS_LINE;
+    return 0;
+  }
+  if (p->status == 204 || p->status == 304) {
+    return 1;
+  }
+  if (p->chunked) {
+    p->state = CHUNK_SIZE_LINE;
+  } else if (p->length >= 0) {
+    p->remaining = p->length;
+    p->state = BODY;
+    return p->remaining == 0;
+  } else {
+    p->state = BODY_UNTIL_CLOSE;
+  }
+  return 0;
+}
+
+/*
+ * Parses the next bytes of the response. Returns 1 when it is complete with
+ * the bytes used from buf, 0 when buf is used up before, or -1 on an error.
+ */
+static int parse_response(parser_t *p, const char *buf, size_t n,
+                          size_t *used) {
+  size_t pos = 0, k, len;
+  int rc;
+
+  while (pos < n) {
+    switch (p->state) {
+    case BODY:
+    case CHUNK_DATA:
+      len = n - pos < p->remaining ? n - pos : p->remaining;
+      p->remaining -= len;
+      pos += len;
+      if (p->remaining > 0) {
+        break;
+      }
+      if (p->state == CHUNK_DATA) {
+        p->state = CHUNK_END_LINE;
+        break;
+      }
+      *used = pos;
+      p->state = STATUS_LINE;
+      return 1;
+
+    case BODY_UNTIL_CLOSE:
+      pos = n;
+      break;
+
+    default:
+      if (!take_line(p, buf + pos, n - pos, &k)) {
+        pos = n;
+        break;
+      }
+      pos += k;
+      rc = 0;
+      switch (p->state) {
+      case STATUS_LINE:
+        if (strncmp(p->line, "HTTP/1.", 7) != 0 || strlen(p->line) < 12) {
+          fprintf(stderr, "invalid status line: %s\n", p->line);
+          return -1;
+        }
+        p->status = atoi(p->line + 9);
+        p->chunked = 0;
+        p->close = 0;
+        p->length = -1;
+        p->state = HEADER_LINE;
+        break;
+      case HEADER_LINE:
+        if (p->line[0] == '\0') {
+          rc = end_headers(p);
+        } else if (header_is(p->line, "Content-Length")) {
+          p->length = strtoll(p->line + sizeof("Content-Length"), NULL, 10);
+        } else if (header_is(p->line, "Transfer-Encoding")) {
+          p->chunked = strcasestr(p->line, "chunked") != NULL;
+        } else if (header_is(p->line, "Connection")) {
+          p->close = strcasestr(p->line, "close") != NULL;
+        }
+        break;
+      case CHUNK_SIZE_LINE:
+        p->remaining = strtoull(p->line, NULL, 16);
+        p->state = p->remaining > 0 ? CHUNK_DATA : TRAILER_LINE;
+        break;
+      case CHUNK_END_LINE:
+        p->state = CHUNK_SIZE_LINE;
+        break;
+      case TRAILER_LINE:
+        rc = p->line[0] == '\0';
+        break;
+      }
+      if (rc) {
+        *used = pos;
+        p->state = STATUS_LINE;
+        return 1;
+      }
+    }
+  }
+  *used = pos;
+  return 0;
+}
+
+static void open_conn(lg_thread_t *t, conn_t *c) {
+  struct epoll_event ev;
+  struct addrinfo *ai = lg.addr;
+  int fd;
+
+  fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+      errno != EINPROGRESS) {
+    perror("connect");
+    exit(EXIT_FAILURE);
+  }
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+  c->fd = fd;
+  c->connecting = 1;
+  c->responses = 0;
+  /* the requests started so far are sent again from the first */
+  c->pos = lg.offsets[(c->next - c->inflight + lg.request_n) % lg.request_n];
+  c->out = (lg.offsets[c->next] - c->pos + lg.requests_len) % lg.requests_len;
+  if (c->out == 0 && c->inflight > 0) {
+    /* all of the ring */
+    c->out = lg.requests_len;
+  }
+  parser_init(&c->parser);
+}
+
+/* Sends the requests not sent yet. Returns -1 on an error. */
+static int flush_requests(lg_thread_t *t, conn_t *c) {
+  size_t len;
+  ssize_t n;
+
+  while (c->out > 0 && !c->connecting) {
+    /* up to the end of the ring, the rest wraps around */
+    len = lg.requests_len - c->pos;
+    n = send(c->fd, lg.requests + c->pos, c->out < len ? c->out : len,
+             MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      }
+      return -1;
+    }
+    c->out -= n;
+    c->pos = (c->pos + n) % lg.requests_len;
+    t->stats.bytes_out += n;
+  }
+  return 0;
+}
+
+/* Starts a request on c, which must have room for it. */
+static void start_request(lg_thread_t *t, conn_t *c, uint64_t start_ns) {
+  int i = c->next;
+
+  c->starts[(c->first + c->inflight) % MAX_DEPTH] = start_ns;
+  c->inflight++;
+  c->next = (i + 1) % lg.request_n;
+  if (c->fd == -1) {
+    open_conn(t, c);
+    return;
+  }
+  c->out += lg.offsets[i + 1] - lg.offsets[i];
+  if (flush_requests(t, c) == -1) {
+    /* the error is found by the next read */
+    c->out = 0;
+  }
+}
+
+static int has_room(conn_t *c) {
+  if (!lg.keepalive) {
+    return c->fd == -1 && c->inflight == 0;
+  }
+  return c->inflight < lg.depth && !c->parser.close;
+}
+
+/*
+ * Returns when the i-th request of the open loop on t should start. The
+ * schedule of each thread is offset by its share of the interval, so that
+ * the threads together start the requests at an even rate instead of in
+ * bursts of one per thread.
+ */
+static uint64_t intended_ns(lg_thread_t *t, uint64_t i) {
+  return lg.start_ns +
+         (uint64_t)((i + (double)t->index / lg.threads) * t->interval);
+}
+
+/* Starts the requests of the open loop which are due by now. */
+static void start_due(lg_thread_t *t, uint64_t now) {
+  int i;
+
+  while (intended_ns(t, t->issued) <= now &&
+         intended_ns(t, t->issued) < lg.end_ns) {
+    for (i = 0; i < t->conn_n; i++) {
+      if (has_room(&t->conns[(t->rr + i) % t->conn_n])) {
+        break;
+      }
+    }
+    if (i == t->conn_n) {
+      /* every connection is busy, the request waits */
+      return;
+    }
+    i = (t->rr + i) % t->conn_n;
+    t->rr = i + 1;
+    start_request(t, &t->conns[i], intended_ns(t, t->issued++));
+  }
+}
+
+/* Starts the next requests on c after a response or a failure. */
+static void refill(lg_thread_t *t, conn_t *c, uint64_t now) {
+  if (t->interval > 0) {
+    start_due(t, now);
+    return;
+  }
+  while (has_room(c)) {
+    start_request(t, c, now);
+  }
+}
+
+/* Returns the head of the URL or the corpus of the k-th request in flight. */
+static int head_of(conn_t *c, int k) {
+  return (c->next - c->inflight + k + lg.request_n) % lg.request_n % lg.head_n;
+}
+
+/* Counts the requests in flight on c as errors. */
+static void lose_requests(lg_thread_t *t, conn_t *c) {
+  int k;
+
+  for (k = 0; k < c->inflight; k++) {
+    t->stats.heads[head_of(c, k)].errors++;
+  }
+  t->stats.errors += c->inflight;
+  c->inflight = 0;
+}
+
+static void close_conn(conn_t *c) {
+  close(c->fd);
+  c->fd = -1;
+  c->connecting = 0;
+  c->out = 0;
+}
+
+/*
+ * The connection is closed by the server or failed. The requests in flight
+ * are sent again if it served any, as a client retries idempotent requests
+ * when a keepalive connection is closed, and lost otherwise.
+ */
+static void conn_failed(lg_thread_t *t, conn_t *c, uint64_t now) {
+  int served = c->responses > 0;
+
+  close_conn(c);
+  if (c->inflight == 0) {
+    return;
+  }
+  if (served && lg.keepalive) {
+    t->stats.retries += c->inflight;
+    open_conn(t, c);
+    return;
+  }
+  lose_requests(t, c);
+  if (now < lg.end_ns) {
+    refill(t, c, now);
+  }
+}
+
+static void complete_response(lg_thread_t *t, conn_t *c, uint64_t now) {
+  lg_stats_t *st = &t->stats;
+  int status = c->parser.status;
+
+  st->requests++;
+  st->heads[head_of(c, 0)].requests++;
+  if (status >= 0 && status < MAX_STATUS) {
+    st->statuses[status]++;
+  }
+  stats_record(&st->latency_ns, now - c->starts[c->first], 1);
+  c->first = (c->first + 1) % MAX_DEPTH;
+  c->inflight--;
+  c->responses++;
+}
+
+static void handle_event(lg_thread_t *t, conn_t *c, uint32_t events,
+                         uint64_t now) {
+  size_t pos, used;
+  socklen_t len;
+  ssize_t n;
+  int err, rc;
+
+  if (c->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+    len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+        err != 0) {
+      conn_failed(t, c, now);
+      return;
+    }
+    c->connecting = 0;
+    t->stats.connects++;
+  }
+  if (flush_requests(t, c) == -1) {
+    conn_failed(t, c, now);
+    return;
+  }
+
+  for (;;) {
+    n = recv(c->fd, t->buf, READ_BUF_SIZE, 0);
+    if (n == -1 && errno == EAGAIN) {
+      return;
+    }
+    if (n <= 0) {
+      if (n == 0 && c->parser.state == BODY_UNTIL_CLOSE && c->inflight > 0) {
+        complete_response(t, c, now);
+      }
+      conn_failed(t, c, now);
+      return;
+    }
+    t->stats.bytes_in += n;
+
+    for (pos = 0; pos < (size_t)n; pos += used) {
+      rc = parse_response(&c->parser, t->buf + pos, n - pos, &used);
+      if (rc == 1 && c->inflight == 0) {
+        fprintf(stderr, "response without a request\n");
+        rc = -1;
+      }
+      if (rc == -1) {
+        lose_requests(t, c);
+        close_conn(c);
+        refill(t, c, now);
+        return;
+      }
+      if (rc == 1) {
+        complete_response(t, c, now);
+        if (!lg.keepalive || c->parser.close) {
+          /* the rest is sent again on a new connection */
+          conn_failed(t, c, now);
+          if (c->fd == -1) {
+            refill(t, c, now);
+          }
+          return;
+        }
+        refill(t, c, now);
+      }
+    }
+  }
+}
+
+/*
+ * Records the requests of the open loop which are not complete at the end,
+ * those in flight and those due but waiting for a connection, with their
+ * latency until the end.
+ */
+static void record_unfinished(lg_thread_t *t) {
+  lg_stats_t *st = &t->stats;
+  conn_t *c;
+  int i, k;
+
+  for (i = 0; i < t->conn_n; i++) {
+    c = &t->conns[i];
+    for (k = 0; k < c->inflight; k++) {
+      stats_record(&st->latency_ns,
+                   lg.end_ns - c->starts[(c->first + k) % MAX_DEPTH], 1);
+    }
+    st->unfinished += c->inflight;
+  }
+  for (; intended_ns(t, t->issued) < lg.end_ns; t->issued++) {
+    stats_record(&st->latency_ns, lg.end_ns - intended_ns(t, t->issued), 1);
+    st->unfinished++;
+  }
+}
+
+static void *lg_thread(void *arg) {
+  lg_thread_t *t = arg;
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t now, next;
+  int nfds, timeout, i;
+
+  t->epoll_fd = epoll_create1(0);
+  if (t->epoll_fd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < t->conn_n; i++) {
+    t->conns[i].fd = -1;
+    t->conns[i].inflight = 0;
+    t->conns[i].first = 0;
+    /* the connections start at different heads of the ring */
+    t->conns[i].next = (i * lg.threads + t->index) % lg.request_n;
+    parser_init(&t->conns[i].parser);
+  }
+
+  now = stats_now_ns();
+  if (t->interval == 0) {
+    for (i = 0; i < t->conn_n; i++) {
+      refill(t, &t->conns[i], now);
+    }
+  }
+
+  while (now < lg.end_ns) {
+    next = lg.end_ns;
+    if (t->interval > 0) {
+      start_due(t, now);
+      if (intended_ns(t, t->issued) < next) {
+        next = intended_ns(t, t->issued);
+      }
+    }
+    timeout = next > now ? (int)((next - now + 999999) / 1000000) : 0;
+
+    nfds = epoll_wait(t->epoll_fd, events, MAX_EVENTS, timeout);
+    if (nfds == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    now = stats_now_ns();
+    for (i = 0; i < nfds; i++) {
+      if (((conn_t *)events[i].data.ptr)->fd != -1) {
+        handle_event(t, events[i].data.ptr, events[i].events, now);
+      }
+    }
+  }
+
+  if (t->interval > 0) {
+    record_unfinished(t);
+  }
+  for (i = 0; i < t->conn_n; i++) {
+    if (t->conns[i].fd != -1) {
+      close(t->conns[i].fd);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Returns the number of CPUs the process may run on, which is smaller than
+ * the online CPUs under taskset.
+ */
+static int allowed_cpus(void) {
+  cpu_set_t allowed;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    perror("sched_getaffinity failed");
+    exit(EXIT_FAILURE);
+  }
+  return CPU_COUNT(&allowed);
+}
+
+/* Raises the soft limit of open files to the hard limit for -c 10000. */
+static void raise_nofile_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+    perror("getrlimit failed");
+    return;
+  }
+  if (rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+      perror("setrlimit failed");
+    }
+  }
+}
+
+static double cpu_seconds(void) {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void dump(FILE *fp, lg_thread_t *threads, double cpu) {
+  lg_stats_t total;
+  const char *sep = "";
+  int i, j;
+
+  memset(&total, 0, sizeof(total));
+  for (i = 0; i < lg.threads; i++) {
+    lg_stats_t *s = &threads[i].stats;
+
+    total.requests += s->requests;
+    total.errors += s->errors;
+    total.connects += s->connects;
+    total.retries += s->retries;
+    total.unfinished += s->unfinished;
+    total.bytes_in += s->bytes_in;
+    total.bytes_out += s->bytes_out;
+    for (j = 0; j < MAX_STATUS; j++) {
+      total.statuses[j] += s->statuses[j];
+    }
+    stats_merge(&total.latency_ns, &s->latency_ns);
+  }
+
+  fprintf(fp,
+          "{\"url\":\"%s\",\"mode\":\"%s\",\"threads\":%d,"
+          "\"connections\":%d,\"depth\":%d,\"keepalive\":%s,\"rate\":%.0f,"
+          "\"duration_s\":%d,\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+          ",\"connects\":%" PRIu64 ",\"retries\":%" PRIu64
+          ",\"unfinished\":%" PRIu64
+          ",\"bytes_in\":%" PRIu64 ",\"bytes_out\":%" PRIu64
+          ",\"rps\":%.1f,\"cpu_s\":%.2f,\"statuses\":{",
+          lg.url, lg.rate > 0 ? "open" : "closed", lg.threads, lg.connections,
+          lg.depth, lg.keepalive ? "true" : "false", lg.rate, lg.duration,
+          total.requests, total.errors, total.connects, total.retries,
+          total.unfinished, total.bytes_in, total.bytes_out,
+          (double)total.requests / lg.duration, cpu);
+  for (j = 0; j < MAX_STATUS; j++) {
+    if (total.statuses[j] > 0) {
+      fprintf(fp, "%s\"%d\":%" PRIu64, sep, j, total.statuses[j]);
+      sep = ",";
+    }
+  }
+  fprintf(fp, "},\"heads\":[");
+  for (j = 0; j < lg.head_n; j++) {
+    head_stats_t head = {0, 0};
+
+    for (i = 0; i < lg.threads; i++) {
+      head.requests += threads[i].stats.heads[j].requests;
+      head.errors += threads[i].stats.heads[j].errors;
+    }
+    fprintf(fp,
+            "%s{\"bytes\":%zu,\"requests\":%" PRIu64 ",\"errors\":%" PRIu64
+            "}",
+            j > 0 ? "," : "", lg.offsets[j + 1] - lg.offsets[j], head.requests,
+            head.errors);
+  }
+  fprintf(fp, "],\"latency_ns\":");
+  stats_dump_histogram(fp, &total.latency_ns);
+  fprintf(fp, "}\n");
+}
+
+int main(int argc, char **argv) {
+  lg_thread_t *threads;
+  pthread_t *tids;
+  conn_t *conns;
+  FILE *fp;
+  int opt, cpus, i, n;
+
+  lg.connections = 100;
+  lg.threads = -1;
+  lg.duration = 15;
+  lg.rate = 0;
+  lg.depth = 1;
+  lg.keepalive = 1;
+  lg.output = NULL;
+  while ((opt = getopt(argc, argv, "c:t:d:r:p:nf:o:")) != -1) {
+    switch (opt) {
+    case 'c':
+      lg.connections = atoi(optarg);
+      break;
+    case 't':
+      lg.threads = atoi(optarg);
+      break;
+    case 'd':
+      lg.duration = atoi(optarg);
+      break;
+    case 'r':
+      lg.rate = atof(optarg);
+      break;
+    case 'p':
+      lg.depth = atoi(optarg);
+      break;
+    case 'n':
+      lg.keepalive = 0;
+      break;
+    case 'f':
+      lg.corpus = optarg;
+      break;
+    case 'o':
+      lg.output = optarg;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || lg.connections < 1 || lg.duration < 1 ||
+      lg.depth < 1 || lg.depth > MAX_DEPTH || lg.rate < 0) {
+    usage(argv[0]);
+  }
+  if (!lg.keepalive) {
+    lg.depth = 1;
+  }
+  lg.url = argv[optind];
+  parse_url(lg.url);
+  raise_nofile_limit();
+  cpus = allowed_cpus();
+
+  if (lg.threads == -1) {
+    lg.threads = cpus;
+  }
+  if (lg.threads > lg.connections) {
+    lg.threads = lg.connections;
+  }
+
+  threads = aligned_alloc(64, sizeof(lg_thread_t) * lg.threads);
+  tids = malloc(sizeof(pthread_t) * lg.threads);
+  conns = calloc(lg.connections, sizeof(conn_t));
+  if (threads == NULL || tids == NULL || conns == NULL) {
+    perror("cannot alloc threads");
+    exit(EXIT_FAILURE);
+  }
+  memset(threads, 0, sizeof(lg_thread_t) * lg.threads);
+
+  lg.start_ns = stats_now_ns();
+  lg.end_ns = lg.start_ns + (uint64_t)lg.duration * 1000000000;
+  for (i = 0, n = 0; i < lg.threads; i++) {
+    threads[i].index = i;
+    threads[i].conns = conns + n;
+    /* the connections are spread evenly, the first threads get the rest */
+    threads[i].conn_n =
+        lg.connections / lg.threads + (i < lg.connections % lg.threads);
+    n += threads[i].conn_n;
+    threads[i].interval = lg.rate > 0 ? 1e9 * lg.threads / lg.rate : 0;
+    threads[i].stats.heads = calloc(lg.head_n, sizeof(head_stats_t));
+    if (threads[i].stats.heads == NULL) {
+      perror("cannot alloc threads");
+      exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&tids[i], NULL, lg_thread, &threads[i]) != 0) {
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    /* a thread per CPU, unless there are more threads than CPUs */
+    if (lg.threads <= cpus && pin_thread(tids[i], i) == -1) {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (i = 0; i < lg.threads; i++) {
+    pthread_join(tids[i], NULL);
+  }
+
+  fp = stdout;
+  if (lg.output != NULL) {
+    fp = fopen(lg.output, "w");
+    if (fp == NULL) {
+      perror("cannot open output");
+      exit(EXIT_FAILURE);
+    }
+  }
+  dump(fp, threads, cpu_seconds());
+  if (fp != stdout) {
+    fclose(fp);
+  }
+  return 0;
+}
@@ -0,0 +1,294 @@
+/*
+ * Compares the ways the C origins find the end of a request header block
+ * and the "Connection: close" header: memmem with the byte at a time
+ * ngx_strlcasestrn, memmem with the CRLF walk origin-c-epoll used, and
+ * the shared http_scan_header in each of its implementations. The header
+ * blocks are what oha and a browser send.
+ */
+
+#define _GNU_SOURCE /* for memmem */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycles"
+static uint64_t ticks() { return __rdtsc(); }
+#else
+#define TICK_UNIT "ns"
+static uint64_t ticks() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#include "http_header.h"
+
+#define ITERATIONS 2000000
+#define CRLFCRLF "\r\n\r\n"
+#define CRLFCRLF_LEN (sizeof(CRLFCRLF) - 1)
+
+typedef unsigned char u_char;
+typedef int ngx_int_t;
+typedef unsigned int ngx_uint_t;
+
+typedef struct {
+  const char *name;
+  const char *req;
+} request_t;
+
+static request_t requests[] = {
+    {"oha", "GET / HTTP/1.1\r\n"
+            "accept: */*\r\n"
+            "user-agent: oha/1.4.5\r\n"
+            "host: localhost:3000\r\n"
+            "\r\n"},
+    {"oha-close", "GET / HTTP/1.1\r\n"
+                  "accept: */*\r\n"
+                  "user-agent: oha/1.4.5\r\n"
+                  "host: localhost:3000\r\n"
+                  "connection: close\r\n"
+                  "\r\n"},
+    {"browser",
+     "GET /index.html HTTP/1.1\r\n"
+     "Host: localhost:3000\r\n"
+     "Connection: keep-alive\r\n"
+     "Cache-Control: max-age=0\r\n"
+     "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", "
+     "\"Not-A.Brand\";v=\"99\"\r\n"
+     "sec-ch-ua-mobile: ?0\r\n"
+     "sec-ch-ua-platform: \"Linux\"\r\n"
+     "Upgrade-Insecure-Requests: 1\r\n"
+     "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, "
+     "like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+     "Accept: "
+     "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/"
+     "webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+     "Sec-Fetch-Site: none\r\n"
+     "Sec-Fetch-Mode: navigate\r\n"
+     "Sec-Fetch-User: ?1\r\n"
+     "Sec-Fetch-Dest: document\r\n"
+     "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+     "Accept-Language: en-US,en;q=0.9,ja;q=0.8\r\n"
+     "Cookie: _ga=GA1.1.1234567890.1700000000; "
+     "session=0123456789abcdef0123456789abcdef; theme=dark\r\n"
+     "\r\n"},
+};
+
+static volatile size_t sink;
+
+/* origin-c-sync, origin-c-epoll-mp and origin-liburing */
+
+static ngx_int_t ngx_strncasecmp(u_char *s1, u_char *s2, size_t n) {
+  ngx_uint_t c1, c2;
+
+  while (n) {
+    c1 = (ngx_uint_t)*s1++;
+    c2 = (ngx_uint_t)*s2++;
+
+    c1 = (c1 >= 'A' && c1 <= 'Z') ? (c1 | 0x20) : c1;
+    c2 = (c2 >= 'A' && c2 <= 'Z') ? (c2 | 0x20) : c2;
+
+    if (c1 == c2) {
+
+      if (c1) {
+        n--;
+        continue;
+      }
+
+      return 0;
+    }
+
+    return c1 - c2;
+  }
+
+  return 0;
+}
+
+static u_char *ngx_strlcasestrn(u_char *s1, u_char *last, u_char *s2,
+                                size_t n) {
+  ngx_uint_t c1, c2;
+
+  c2 = (ngx_uint_t)*s2++;
+  c2 = (c2 >= 'A' && c2 <= 'Z') ? (c2 | 0x20) : c2;
+  last -= n;
+
+  do {
+    do {
+      if (s1 >= last) {
+        return NULL;
+      }
+
+      c1 = (ngx_uint_t)*s1++;
+
+      c1 = (c1 >= 'A' && c1 <= 'Z') ? (c1 | 0x20) : c1;
+
+    } while (c1 != c2);
+
+  } while (ngx_strncasecmp(s1, s2, n) != 0);
+
+  return --s1;
+}
+
+#define CONNECTION_CLOSE "\r\nConnection: close\r\n"
+
+static int has_connection_close_strlcasestrn(char *req, int n) {
+  return ngx_strlcasestrn((u_char *)req, (u_char *)req + n,
+                          (u_char *)CONNECTION_CLOSE,
+                          sizeof(CONNECTION_CLOSE) - 2) != NULL;
+}
+
+/* origin-c-epoll */
+
+static char *skip_ows(char *s, int n) {
+  char *end = s + n;
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  return s;
+}
+
+#define CONNECTION "connection"
+#define CONNECTION_LEN (sizeof(CONNECTION) - 1)
+#define CLOSE "close"
+#define CLOSE_LEN (sizeof(CLOSE) - 1)
+
+static char *find_crlf(char *s, int n) {
+  char *p = memchr(s, '\r', n);
+  if (p != NULL && p + 1 < s + n && p[1] == '\n') {
+    return p;
+  }
+  return NULL;
+}
+
+static int has_connection_close_crlf_walk(char *req, int n) {
+  char *field_end = find_crlf(req, n);
+  if (field_end == NULL) {
+    return 0;
+  }
+  n -= (field_end - req) + 2;
+  char *p = field_end + 2;
+  while ((field_end = find_crlf(p, n)) != NULL) {
+    if (field_end == p) {
+      break;
+    }
+
+    if (p + CONNECTION_LEN + 1 < field_end && (p[0] | 0x20) == 'c' &&
+        (p[1] | 0x20) == 'o' && (p[2] | 0x20) == 'n' &&
+        (p[3] | 0x20) == 'n' && (p[4] | 0x20) == 'e' &&
+        (p[5] | 0x20) == 'c' && (p[6] | 0x20) == 't' &&
+        (p[7] | 0x20) == 'i' && (p[8] | 0x20) == 'o' &&
+        (p[9] | 0x20) == 'n' && p[10] == ':') {
+      p += CONNECTION_LEN + 1;
+      p = skip_ows(p, field_end - p);
+      int val_len = field_end - p;
+      if (p + CLOSE_LEN <= field_end && (p[0] | 0x20) == 'c' &&
+          (p[1] | 0x20) == 'l' && (p[2] | 0x20) == 'o' &&
+          (p[3] | 0x20) == 's' && (p[4] | 0x20) == 'e' &&
+          skip_ows(p + CLOSE_LEN, val_len - CLOSE_LEN) == field_end) {
+        return 1;
+      }
+    }
+
+    n -= (field_end - p) + 2;
+    p = field_end + 2;
+  }
+  return 0;
+}
+
+/* Each method returns the header end offset and sets *closing. */
+
+static size_t frame_strlcasestrn(char *buf, size_t len, int *closing) {
+  char *p = memmem(buf, len, CRLFCRLF, CRLFCRLF_LEN);
+  if (p == NULL) {
+    return 0;
+  }
+  p += CRLFCRLF_LEN;
+  *closing = has_connection_close_strlcasestrn(buf, p - buf);
+  return p - buf;
+}
+
+static size_t frame_crlf_walk(char *buf, size_t len, int *closing) {
+  char *p = memmem(buf, len, CRLFCRLF, CRLFCRLF_LEN);
+  if (p == NULL) {
+    return 0;
+  }
+  p += CRLFCRLF_LEN;
+  *closing = has_connection_close_crlf_walk(buf, p - buf);
+  return p - buf;
+}
+
+static size_t frame_scan_header(char *buf, size_t len, int *closing) {
+  http_header_t h;
+  size_t n;
+
+  http_header_init(&h);
+  n = http_scan_header(buf, len, &h);
+  *closing = h.connection_close;
+  return n;
+}
+
+typedef struct {
+  const char *name;
+  const char *scan_header_impl; /* NULL for the old methods */
+  size_t (*frame)(char *buf, size_t len, int *closing);
+} method_t;
+
+static method_t methods[] = {
+    {"strlcasestrn", NULL, frame_strlcasestrn},
+    {"crlf_walk", NULL, frame_crlf_walk},
+    {"scan_header_scalar", "scalar", frame_scan_header},
+    {"scan_header_sse4.2", "sse4.2", frame_scan_header},
+    {"scan_header_avx2", "avx2", frame_scan_header},
+};
+
+static double bench(method_t *m, char *buf, size_t len, size_t expect_len,
+                    int expect_closing) {
+  uint64_t start;
+  size_t n;
+  int closing, i;
+
+  closing = -1;
+  n = m->frame(buf, len, &closing);
+  if (n != expect_len || closing != expect_closing) {
+    fprintf(stderr, "%s: got header end %zu closing %d, want %zu %d\n",
+            m->name, n, closing, expect_len, expect_closing);
+    exit(EXIT_FAILURE);
+  }
+
+  start = ticks();
+  for (i = 0; i < ITERATIONS; i++) {
+    sink = m->frame(buf, len, &closing);
+  }
+  return (double)(ticks() - start) / ITERATIONS;
+}
+
+int main(int argc, char *argv[]) {
+  char buf[4096];
+  size_t i, j, len;
+  int closing;
+  method_t *m;
+
+  printf("request,bytes,method,%s_per_request\n", TICK_UNIT);
+  for (i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+    len = strlen(requests[i].req);
+    memcpy(buf, requests[i].req, len);
+    closing = strstr(requests[i].name, "close") != NULL;
+
+    for (j = 0; j < sizeof(methods) / sizeof(methods[0]); j++) {
+      m = &methods[j];
+      if (m->scan_header_impl != NULL &&
+          http_scan_header_use(m->scan_header_impl) == -1) {
+        continue;
+      }
+      printf("%s,%zu,%s,%.1f\n", requests[i].name, len, m->name,
+             bench(m, buf, len, len, closing));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Measures the cost of producing one origin response: formatting it with
+ * snprintf for every response, as the C origins used to, against pointing
+ * at a prebuilt response whose Date value is patched when the second
+ * changes. The clock is simulated so that the second changes every
+ * RESPONSES_PER_SECOND responses and the patch cost is amortized.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICK_UNIT "cycles"
+static uint64_t ticks() { return __rdtsc(); }
+#else
+#define TICK_UNIT "ns"
+static uint64_t ticks() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define RESPONSES 10000000
+#define RESPONSES_PER_SECOND 100000
+#define RESPONSE_BODY "Hello, world!\n"
+#define SERVER "origin-c-epoll"
+#define HTTP_DATE_BUF_LEN sizeof("Sun, 06 Nov 1994 08:49:37 GMT")
+#define RESPONSE_BUF_SIZE 256
+#define RESPONSE_DATE_OFFSET (sizeof("HTTP/1.1 200 OK\r\nDate: ") - 1)
+
+typedef struct {
+  char buf[RESPONSE_BUF_SIZE];
+  int len;
+  time_t now;
+} response_t;
+
+static volatile const char *sink;
+static volatile int sink_len;
+
+static int format_http_date(time_t now, char buffer[HTTP_DATE_BUF_LEN]) {
+  struct tm *tm;
+
+  tm = gmtime(&now);
+  if (tm == NULL) {
+    perror("gmtime failed");
+    return -1;
+  }
+  return (int)strftime(buffer, HTTP_DATE_BUF_LEN, "%a, %d %b %Y %H:%M:%S GMT",
+                       tm);
+}
+
+static time_t simulated_now(long i) {
+  return 1700000000 + i / RESPONSES_PER_SECOND;
+}
+
+static int format_response(char *buf, size_t size, char *http_date_buf) {
+  return snprintf(buf, size,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Date: %s\r\n"
+                  "Server: %s\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Content-Length: %zu\r\n"
+                  "\r\n"
+                  "%s",
+                  http_date_buf, SERVER, sizeof(RESPONSE_BODY) - 1,
+                  RESPONSE_BODY);
+}
+
+static int update_response(response_t *r, time_t now) {
+  char http_date_buf[HTTP_DATE_BUF_LEN];
+
+  if (now == r->now) {
+    return 0;
+  }
+  if (format_http_date(now, http_date_buf) != HTTP_DATE_BUF_LEN - 1) {
+    return -1;
+  }
+  memcpy(r->buf + RESPONSE_DATE_OFFSET, http_date_buf, HTTP_DATE_BUF_LEN - 1);
+  r->now = now;
+  return 0;
+}
+
+static double bench_snprintf() {
+  char buf[RESPONSE_BUF_SIZE], http_date_buf[HTTP_DATE_BUF_LEN];
+  time_t now, prev_now = 0;
+  uint64_t start;
+  long i;
+
+  start = ticks();
+  for (i = 0; i < RESPONSES; i++) {
+    now = simulated_now(i);
+    if (now != prev_now) {
+      if (format_http_date(now, http_date_buf) == -1) {
+        exit(EXIT_FAILURE);
+      }
+      prev_now = now;
+    }
+    sink_len = format_response(buf, sizeof(buf), http_date_buf);
+    sink = buf;
+  }
+  return (double)(ticks() - start) / RESPONSES;
+}
+
+static double bench_template() {
+  response_t r;
+  uint64_t start;
+  long i;
+
+  r.len = format_response(r.buf, sizeof(r.buf),
+                          "Thu, 01 Jan 1970 00:00:00 GMT");
+  r.now = 0;
+
+  start = ticks();
+  for (i = 0; i < RESPONSES; i++) {
+    if (update_response(&r, simulated_now(i)) == -1) {
+      exit(EXIT_FAILURE);
+    }
+    sink_len = r.len;
+    sink = r.buf;
+  }
+  return (double)(ticks() - start) / RESPONSES;
+}
+
+int main(int argc, char *argv[]) {
+  double s, t;
+
+  /* warm up the gmtime and stdio paths */
+  bench_snprintf();
+  bench_template();
+
+  s = bench_snprintf();
+  t = bench_template();
+  printf("method,%s_per_response\n", TICK_UNIT);
+  printf("snprintf,%.1f\n", s);
+  printf("template,%.1f\n", t);
+  printf("saved,%.1f\n", s - t);
+  return 0;
+}
@@ -1,7 +1,43 @@
-use std::{convert::Infallible, io};
+use std::{
+    convert::Infallible,
+    io,
+    pin::Pin,
+    slice::Chunks,
+    task::{Context, Poll},
+};
 
-use actix_http::{HttpService, Request, Response, StatusCode};
+use actix_http::{
+    body::{BodySize, MessageBody},
+    HttpService, Request, Response, StatusCode,
+};
 use actix_server::Server;
+use bytes::Bytes;
+
+#[path = "../../rust-common/response.rs"]
+mod response;
+
+/// A body of unknown size, which is sent with chunked transfer encoding.
+struct ChunkedBody(Chunks<'static, u8>);
+
+impl MessageBody for ChunkedBody {
+    type Error = Infallible;
+
+    fn size(&self) -> BodySize {
+        BodySize::Stream
+    }
+
+    fn poll_next(
+        self: Pin<&mut Self>,
+        _: &mut Context<'_>,
+    ) -> Poll<Option<Result<Bytes, Self::Error>>> {
+        Poll::Ready(
+            self.get_mut()
+                .0
+                .next()
+                .map(|chunk| Ok(Bytes::from_static(chunk))),
+        )
+    }
+}
 
 #[actix_rt::main]
 async fn main() -> io::Result<()> {
@@ -11,10 +47,18 @@ async fn main() -> io::Result<()> {
         .bind("hello-world", ("127.0.0.1", 3000), || {
             HttpService::build()
                 .finish(|_req: Request| async move {
-                    let mut res = Response::build(StatusCode::OK);
+                    let settings = response::settings();
+                    let status = StatusCode::from_u16(settings.next_status()).unwrap();
+                    let mut res = Response::build(status);
                     res.insert_header(("Server", "actix"));
                     res.insert_header(("Content-Type", "text/plain"));
-                    Ok::<_, Infallible>(res.body("Hello, world!\n"))
+                    let res = if settings.chunked {
+                        res.body(ChunkedBody(settings.body.chunks(response::CHUNK_SIZE)))
+                            .map_into_boxed_body()
+                    } else {
+                        res.body(&settings.body[..]).map_into_boxed_body()
+                    };
+                    Ok::<_, Infallible>(res)
                 })
                 .tcp()
         })?
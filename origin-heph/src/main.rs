@@ -14,10 +14,18 @@ use heph_rt::timer::Deadline;
 use heph_rt::{Runtime, ThreadLocal};
 use log::{error, info, warn};
 
+#[path = "../../rust-common/response.rs"]
+mod response;
+
 fn main() -> Result<(), heph_rt::Error> {
     // Enable logging.
     std_logger::Config::logfmt().init();
 
+    // OneshotBody always has a Content-Length.
+    if response::settings().chunked {
+        warn!("CHUNKED is not supported, sending a Content-Length");
+    }
+
     let actor = actor_fn(http_actor);
     let address = "0.0.0.0:3000".parse().unwrap();
     let server = http::server::Server::new(address, conn_supervisor, actor, ActorOptions::default())
@@ -97,8 +105,9 @@ async fn http_actor(
                     let body = Cow::from("Not expecting a body");
                     (StatusCode::PAYLOAD_TOO_LARGE, body, true)
                 } else {
-                    let body = Cow::from("Hello, world!\n");
-                    (StatusCode::OK, body, false)
+                    let settings = response::settings();
+                    let body = Cow::from(settings.body_str());
+                    (StatusCode(settings.next_status()), body, false)
                 }
             }
             // No more requests.
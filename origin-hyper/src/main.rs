@@ -1,22 +1,72 @@
 use std::convert::Infallible;
 use std::net::SocketAddr;
+use std::pin::Pin;
+use std::slice::Chunks;
+use std::task::{Context, Poll};
 
-use http_body_util::Full;
-use hyper::body::Bytes;
+use hyper::body::{Body, Bytes, Frame, SizeHint};
 use hyper::header::{HeaderValue, CONTENT_TYPE, SERVER};
 use hyper::server::conn::http1;
 use hyper::service::service_fn;
-use hyper::{Request, Response};
+use hyper::{Request, Response, StatusCode};
 use hyper_util::rt::TokioIo;
-use once_cell::sync::Lazy;
 use tokio::net::TcpListener;
 
+#[path = "../../rust-common/response.rs"]
+mod response;
+
 static HYPER: HeaderValue = HeaderValue::from_static("hyper");
 static TEXT_PLAIN: HeaderValue = HeaderValue::from_static("text/plain");
-static BODY_BYTES: Lazy<Bytes> = Lazy::new(|| Bytes::from("Hello, world!\n"));
 
-async fn hello(_: Request<hyper::body::Incoming>) -> Result<Response<Full<Bytes>>, Infallible> {
-    let mut res = Response::new(Full::new(BODY_BYTES.clone()));
+/// The body from the settings. Without an exact size hint hyper sends it
+/// with chunked transfer encoding.
+struct ResponseBody {
+    chunks: Chunks<'static, u8>,
+    size: Option<u64>,
+}
+
+impl ResponseBody {
+    fn new(settings: &'static response::Settings) -> Self {
+        let (chunk_size, size) = if settings.chunked {
+            (response::CHUNK_SIZE, None)
+        } else {
+            (settings.body.len().max(1), Some(settings.body.len() as u64))
+        };
+        ResponseBody {
+            chunks: settings.body.chunks(chunk_size),
+            size,
+        }
+    }
+}
+
+impl Body for ResponseBody {
+    type Data = Bytes;
+    type Error = Infallible;
+
+    fn poll_frame(
+        self: Pin<&mut Self>,
+        _: &mut Context<'_>,
+    ) -> Poll<Option<Result<Frame<Bytes>, Infallible>>> {
+        let chunk = self.get_mut().chunks.next();
+        Poll::Ready(chunk.map(|chunk| Ok(Frame::data(Bytes::from_static(chunk)))))
+    }
+
+    fn is_end_stream(&self) -> bool {
+        self.chunks.len() == 0
+    }
+
+    fn size_hint(&self) -> SizeHint {
+        match self.size {
+            Some(size) => SizeHint::with_exact(size),
+            None => SizeHint::default(),
+        }
+    }
+}
+
+async fn hello(_: Request<hyper::body::Incoming>) -> Result<Response<ResponseBody>, Infallible> {
+    let settings = response::settings();
+    let mut res = Response::new(ResponseBody::new(settings));
+    *res.status_mut() = StatusCode::from_u16(settings.next_status()).unwrap();
     let headers = res.headers_mut();
     headers.insert(SERVER, HYPER.clone());
     headers.insert(CONTENT_TYPE, TEXT_PLAIN.clone());
@@ -1,14 +1,34 @@
-use std::io;
+use std::task::{Context, Poll};
+use std::{error::Error, io, rc::Rc, slice::Chunks};
 
+use ntex::http::body::{Body, BodySize, MessageBody};
 use ntex::http::header::{HeaderValue, CONTENT_TYPE, SERVER};
 use ntex::http::{self, HttpService, HttpServiceConfig, Response};
 use ntex::time::Seconds;
 use ntex::util::{Bytes, Ready};
 use ntex::SharedCfg;
 
+#[path = "../../rust-common/response.rs"]
+mod response;
+
 const TEXT_PLAIN: HeaderValue = HeaderValue::from_static("text/plain");
 const NTEX: HeaderValue = HeaderValue::from_static("ntex");
-const BODY_TEXT: Bytes = Bytes::from_static(b"Hello, world!\n");
+
+/// A body of unknown size, which is sent with chunked transfer encoding.
+struct ChunkedBody(Chunks<'static, u8>);
+
+impl MessageBody for ChunkedBody {
+    fn size(&self) -> BodySize {
+        BodySize::Stream
+    }
+
+    fn poll_next_chunk(
+        &mut self,
+        _: &mut Context<'_>,
+    ) -> Poll<Option<Result<Bytes, Rc<dyn Error>>>> {
+        Poll::Ready(self.0.next().map(|chunk| Ok(Bytes::from_static(chunk))))
+    }
+}
 
 #[ntex::main]
 async fn main() -> io::Result<()> {
@@ -18,9 +38,15 @@ async fn main() -> io::Result<()> {
         .backlog(1024)
         .bind("hello-world", "127.0.0.1:3000", async |_| {
             HttpService::new(|_req| {
+                let settings = response::settings();
+                let body = if settings.chunked {
+                    Body::from_message(ChunkedBody(settings.body.chunks(response::CHUNK_SIZE)))
+                } else {
+                    Body::from(Bytes::from_static(&settings.body))
+                };
                 let mut res = Response::with_body(
-                    http::StatusCode::OK,
-                    BODY_TEXT,
+                    http::StatusCode::from_u16(settings.next_status()).unwrap(),
+                    body,
                 );
                 let headers = res.headers_mut();
                 headers.insert(CONTENT_TYPE, TEXT_PLAIN);
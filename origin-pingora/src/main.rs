@@ -10,11 +10,12 @@ use pingora::{
 };
 use tokio::io::AsyncWriteExt;
 
+#[path = "../../rust-common/response.rs"]
+mod response;
+
 #[derive(Clone)]
 pub struct HelloApp;
 
-const BODY: &[u8] = b"Hello, world!\n";
-
 fn to_date_string(epoch_sec: i64) -> String {
     let dt = DateTime::from_timestamp(epoch_sec, 0).unwrap();
     dt.format("%a, %d %b %Y %H:%M:%S GMT").to_string()
@@ -31,9 +32,16 @@ impl ServerApp for HelloApp {
             .duration_since(SystemTime::UNIX_EPOCH)
             .unwrap();
         let date = to_date_string(d.as_secs() as i64);
-        let header = format!("HTTP/1.1 200 OK\r\ncontent-type: text/plain\r\ncontent-length: {}\r\ndate: {}\r\nserver: pingora\r\n\r\n", BODY.len(), date);
+        let settings = response::settings();
+        let status = settings.next_status();
+        let length = if settings.chunked {
+            "transfer-encoding: chunked".to_string()
+        } else {
+            format!("content-length: {}", settings.body.len())
+        };
+        let header = format!("HTTP/1.1 {} {}\r\ncontent-type: text/plain\r\n{}\r\ndate: {}\r\nserver: pingora\r\n\r\n", status, response::reason(status).unwrap(), length, date);
         io.write_all(header.as_bytes()).await.unwrap();
-        io.write_all(BODY).await.unwrap();
+        io.write_all(settings.wire_body()).await.unwrap();
         io.flush().await.unwrap();
         None
     }
@@ -15,12 +15,18 @@
 
 use bytes::BytesMut;
 use futures::SinkExt;
-use http::{header::HeaderValue, Request, Response};
+use http::{
+    header::{HeaderValue, TRANSFER_ENCODING},
+    Request, Response,
+};
 use std::{env, error::Error, fmt, io};
 use tokio::net::{TcpListener, TcpStream};
 use tokio_stream::StreamExt;
 use tokio_util::codec::{Decoder, Encoder, Framed};
 
+#[path = "../../rust-common/response.rs"]
+mod response;
+
 #[tokio::main]
 async fn main() -> Result<(), Box<dyn Error>> {
     // Parse the arguments, bind the TCP socket we'll be listening to, spin up
@@ -57,12 +63,16 @@ async fn process(stream: TcpStream) -> Result<(), Box<dyn Error>> {
     Ok(())
 }
 
-async fn respond(_req: Request<()>) -> Result<Response<String>, Box<dyn Error>> {
-    let mut response = Response::builder();
+/// The body is kept as it is sent, with the chunk framing if chunked.
+async fn respond(_req: Request<()>) -> Result<Response<&'static [u8]>, Box<dyn Error>> {
+    let settings = response::settings();
+    let mut response = Response::builder().status(settings.next_status());
     response = response.header("Content-Type", "text/plain");
-    let body = "Hello, World!\n".to_string();
+    if settings.chunked {
+        response = response.header(TRANSFER_ENCODING, "chunked");
+    }
     let response = response
-        .body(body)
+        .body(settings.wire_body())
         .map_err(|err| io::Error::new(io::ErrorKind::Other, err))?;
 
     Ok(response)
@@ -72,10 +82,10 @@ struct Http;
 
 /// Implementation of encoding an HTTP response into a `BytesMut`, basically
 /// just writing out an HTTP/1.1 response.
-impl Encoder<Response<String>> for Http {
+impl Encoder<Response<&'static [u8]>> for Http {
     type Error = io::Error;
 
-    fn encode(&mut self, item: Response<String>, dst: &mut BytesMut) -> io::Result<()> {
+    fn encode(&mut self, item: Response<&'static [u8]>, dst: &mut BytesMut) -> io::Result<()> {
         use std::fmt::Write;
 
         write!(
@@ -83,14 +93,15 @@ impl Encoder<Response<String>> for Http {
             "\
              HTTP/1.1 {}\r\n\
              Server: tokio\r\n\
-             Content-Length: {}\r\n\
              Date: {}\r\n\
              ",
             item.status(),
-            item.body().len(),
             date::now()
         )
         .unwrap();
+        if !item.headers().contains_key(TRANSFER_ENCODING) {
+            write!(BytesWrite(dst), "Content-Length: {}\r\n", item.body().len()).unwrap();
+        }
 
         for (k, v) in item.headers() {
             dst.extend_from_slice(k.as_str().as_bytes());
@@ -100,7 +111,7 @@ impl Encoder<Response<String>> for Http {
         }
 
         dst.extend_from_slice(b"\r\n");
-        dst.extend_from_slice(item.body().as_bytes());
+        dst.extend_from_slice(item.body());
 
         return Ok(());
 
@@ -4,6 +4,8 @@ use std::sync::{mpsc, Arc, Mutex};
 use std::thread;
 
 mod date;
+#[path = "../../rust-common/response.rs"]
+mod response;
 
 fn main() {
     let listener = TcpListener::bind("127.0.0.1:3000").unwrap();
@@ -28,10 +30,17 @@ fn handle_connection(mut stream: TcpStream) {
     //     .take_while(|line| !line.is_empty())
     //     .collect();
 
-    let content = "Hello, world!\n";
-    let response = format!("HTTP/1.1 200 OK\r\nServer: toysync\r\nDate: {}\r\nContent-Type: text/plain\r\nContent-Length: {}\r\n\r\n{}", date::now(), content.len(), content);
-
-    stream.write_all(response.as_bytes()).unwrap();
+    let settings = response::settings();
+    let status = settings.next_status();
+    let length = if settings.chunked {
+        "Transfer-Encoding: chunked".to_string()
+    } else {
+        format!("Content-Length: {}", settings.body.len())
+    };
+    let mut response = format!("HTTP/1.1 {} {}\r\nServer: toysync\r\nDate: {}\r\nContent-Type: text/plain\r\n{}\r\n\r\n", status, response::reason(status).unwrap(), date::now(), length).into_bytes();
+    response.extend_from_slice(settings.wire_body());
+
+    stream.write_all(&response).unwrap();
 }
 
 pub struct ThreadPool {
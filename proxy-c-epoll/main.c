@@ -0,0 +1,1112 @@
+#define _GNU_SOURCE /* for accept4, memmem */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 512
+#define BUF_SIZE 4096
+#define PORT 3001
+#define UPSTREAM_ADDR "127.0.0.1"
+#define UPSTREAM_PORT 3000
+#define WORKER_CONNECTIONS 1024
+#define KEEPALIVE_CONNECTIONS 32
+
+typedef int ngx_int_t;
+typedef unsigned int ngx_uint_t;
+typedef unsigned char u_char;
+typedef int ngx_socket_t;
+
+typedef enum {
+  NGX_TCP_NODELAY_UNSET = 0,
+  NGX_TCP_NODELAY_SET,
+  NGX_TCP_NODELAY_DISABLED
+} ngx_connection_tcp_nodelay_e;
+
+typedef enum { LISTENER = 0, CLIENT, UPSTREAM } connection_type_e;
+
+typedef enum {
+  /* client */
+  CLIENT_READING_REQUEST = 0,
+  CLIENT_WAITING_UPSTREAM,
+  /* upstream */
+  UPSTREAM_IDLE,
+  UPSTREAM_CONNECTING,
+  UPSTREAM_SENDING,
+  UPSTREAM_READING
+} connection_state_e;
+
+/* the position in a chunked upstream body, see parse_chunked */
+typedef enum {
+  CHUNK_SIZE = 0,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER, /* at the start of a trailer line or the final CRLF */
+  CHUNK_TRAILER_LINE,
+  CHUNK_LAST_LF,
+  CHUNK_DONE
+} chunk_state_e;
+
+typedef struct ngx_connection_s ngx_connection_t;
+
+struct ngx_connection_s {
+  void *data; /* free list link */
+  ngx_socket_t fd;
+  unsigned type : 2;            /* connection_type_e */
+  unsigned tcp_nodelay : 2;     /* ngx_connection_tcp_nodelay_e */
+  unsigned instance : 1;
+  unsigned closing : 1;         /* client sent "Connection: close" */
+  unsigned keepalive : 1;       /* upstream may be reused after response */
+  unsigned close_delimited : 1; /* upstream body ends when origin closes */
+  unsigned chunked : 1;         /* upstream body is chunked */
+  unsigned chunk_state : 4;     /* chunk_state_e */
+  unsigned reused : 1;          /* upstream came from the keepalive pool */
+  connection_state_e state;
+
+  /* client <-> upstream pairing while a request is in flight */
+  ngx_connection_t *peer;
+
+  /* idle upstream keepalive queue */
+  ngx_connection_t *prev;
+  ngx_connection_t *next;
+
+  /*
+   * Client: request bytes are in buf[0, last), the request to forward is
+   * buf[0, request_len) and buf[0, pos) has already been sent upstream.
+   * Upstream: response bytes are in buf[pos, last) waiting to be written
+   * to the client.
+   */
+  size_t pos;
+  size_t last;
+  size_t request_len;
+  size_t header_len;
+  size_t remaining; /* response bytes still expected from upstream */
+  size_t chunk_size; /* bytes of the current chunk still expected */
+
+  u_char buf[BUF_SIZE];
+};
+
+typedef struct {
+  int epoll_fd;
+  ngx_connection_t *free_connections;
+  ngx_uint_t free_connection_n;
+  ngx_connection_t keepalive; /* sentinel of the idle upstream queue */
+  ngx_uint_t keepalive_n;
+  struct sockaddr_in upstream_addr;
+} worker_t;
+
+static void upstream_send(worker_t *wk, ngx_connection_t *u);
+static void upstream_read(worker_t *wk, ngx_connection_t *u);
+static void client_read(worker_t *wk, ngx_connection_t *c);
+
+static void init_connections(ngx_connection_t *connections,
+                             ngx_uint_t connection_n) {
+  ngx_uint_t i;
+  ngx_connection_t *c, *next;
+
+  i = connection_n;
+  c = connections;
+  next = NULL;
+
+  do {
+    i--;
+
+    c[i].data = next;
+    c[i].fd = (ngx_socket_t)-1;
+    c[i].instance = 1;
+    c[i].tcp_nodelay = NGX_TCP_NODELAY_UNSET;
+
+    next = &c[i];
+  } while (i);
+}
+
+static ngx_connection_t *get_connection(worker_t *wk, ngx_socket_t fd,
+                                        connection_type_e type) {
+  ngx_connection_t *c;
+  unsigned instance;
+
+  c = wk->free_connections;
+  if (c == NULL) {
+    fprintf(stderr, "worker_connections are not enough\n");
+    return NULL;
+  }
+  wk->free_connections = c->data;
+  wk->free_connection_n--;
+
+  /*
+   * Flip the instance bit so that events still queued for the previous
+   * user of this slot are recognized as stale. See ngx_get_connection.
+   */
+  instance = c->instance;
+  memset(c, 0, offsetof(ngx_connection_t, buf));
+  c->instance = !instance;
+  c->fd = fd;
+  c->type = type;
+  c->tcp_nodelay = NGX_TCP_NODELAY_UNSET;
+  return c;
+}
+
+static void free_connection(worker_t *wk, ngx_connection_t *c) {
+  c->data = wk->free_connections;
+  wk->free_connections = c;
+  wk->free_connection_n++;
+}
+
+static void close_connection(worker_t *wk, ngx_connection_t *c) {
+  ngx_socket_t fd;
+
+  fd = c->fd;
+  c->fd = (ngx_socket_t)-1;
+  free_connection(wk, c);
+  close(fd);
+}
+
+static int add_connection(worker_t *wk, ngx_connection_t *c) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = (void *)((uintptr_t)c | c->instance);
+  if (epoll_ctl(wk->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+    perror("epoll_ctl: add connection");
+    return -1;
+  }
+  return 0;
+}
+
+static void keepalive_insert(worker_t *wk, ngx_connection_t *u) {
+  ngx_connection_t *h = &wk->keepalive;
+
+  u->next = h->next;
+  u->next->prev = u;
+  u->prev = h;
+  h->next = u;
+  wk->keepalive_n++;
+}
+
+static void keepalive_remove(worker_t *wk, ngx_connection_t *u) {
+  u->next->prev = u->prev;
+  u->prev->next = u->next;
+  u->prev = NULL;
+  u->next = NULL;
+  wk->keepalive_n--;
+}
+
+static int set_tcp_nodelay(ngx_connection_t *c) {
+  int tcp_nodelay;
+
+  if (c->tcp_nodelay != NGX_TCP_NODELAY_UNSET) {
+    return 0;
+  }
+  tcp_nodelay = 1;
+  if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&tcp_nodelay,
+                 sizeof(int)) == -1) {
+    perror("setsockopt TCP_NODELAY");
+    return -1;
+  }
+  c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+  return 0;
+}
+
+#define CRLF "\r\n"
+#define CRLFCRLF "\r\n\r\n"
+#define CONNECTION "connection:"
+#define CONNECTION_LEN (sizeof(CONNECTION) - 1)
+#define CONTENT_LENGTH "content-length:"
+#define CONTENT_LENGTH_LEN (sizeof(CONTENT_LENGTH) - 1)
+#define TRANSFER_ENCODING "transfer-encoding:"
+#define TRANSFER_ENCODING_LEN (sizeof(TRANSFER_ENCODING) - 1)
+#define KEEP_ALIVE "keep-alive:"
+#define KEEP_ALIVE_LEN (sizeof(KEEP_ALIVE) - 1)
+#define CLOSE "close"
+#define CLOSE_LEN (sizeof(CLOSE) - 1)
+
+static u_char *skip_ows(u_char *s, u_char *end) {
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  return s;
+}
+
+static int value_is_close(u_char *p, u_char *end) {
+  p = skip_ows(p, end);
+  return p + CLOSE_LEN <= end &&
+         strncasecmp((char *)p, CLOSE, CLOSE_LEN) == 0 &&
+         skip_ows(p + CLOSE_LEN, end) == end;
+}
+
+/*
+ * Returns the length of the header block including the terminating empty
+ * line, or 0 if it has not been received completely yet.
+ */
+static size_t find_header_end(u_char *buf, size_t n) {
+  u_char *p = memmem(buf, n, CRLFCRLF, sizeof(CRLFCRLF) - 1);
+  if (p == NULL) {
+    return 0;
+  }
+  return p - buf + sizeof(CRLFCRLF) - 1;
+}
+
+/*
+ * Scans the header fields in buf[0, header_len) for the fields the proxy
+ * needs to frame a message. content_length is set to -1 when there is no
+ * Content-Length field.
+ */
+static void parse_header_fields(u_char *buf, size_t header_len, int *closing,
+                                long *content_length, int *chunked) {
+  u_char *p, *end, *field_end;
+
+  *closing = 0;
+  *content_length = -1;
+  *chunked = 0;
+
+  end = buf + header_len;
+  p = memmem(buf, header_len, CRLF, sizeof(CRLF) - 1);
+  if (p == NULL) {
+    return;
+  }
+  p += sizeof(CRLF) - 1;
+  while ((field_end = memmem(p, end - p, CRLF, sizeof(CRLF) - 1)) != NULL &&
+         field_end != p) {
+    if (p + CONNECTION_LEN <= field_end &&
+        strncasecmp((char *)p, CONNECTION, CONNECTION_LEN) == 0) {
+      *closing = value_is_close(p + CONNECTION_LEN, field_end);
+    } else if (p + CONTENT_LENGTH_LEN <= field_end &&
+               strncasecmp((char *)p, CONTENT_LENGTH, CONTENT_LENGTH_LEN) ==
+                   0) {
+      *content_length = strtol((char *)p + CONTENT_LENGTH_LEN, NULL, 10);
+    } else if (p + TRANSFER_ENCODING_LEN <= field_end &&
+               strncasecmp((char *)p, TRANSFER_ENCODING,
+                           TRANSFER_ENCODING_LEN) == 0) {
+      *chunked = 1;
+    }
+    p = field_end + sizeof(CRLF) - 1;
+  }
+}
+
+/*
+ * Removes the hop-by-hop Connection and Keep-Alive fields from the request
+ * header in c->buf[0, header_len), moving the bytes after them down, so that
+ * a client's "Connection: close" does not close the pooled upstream. See
+ * proxy_set_header Connection "" of nginx. Returns the new header length.
+ */
+static size_t strip_hop_by_hop(ngx_connection_t *c, size_t header_len) {
+  u_char *p, *end, *field_end;
+  size_t field_len;
+
+  end = c->buf + header_len;
+  p = memmem(c->buf, header_len, CRLF, sizeof(CRLF) - 1);
+  if (p == NULL) {
+    return header_len;
+  }
+  p += sizeof(CRLF) - 1;
+  while ((field_end = memmem(p, end - p, CRLF, sizeof(CRLF) - 1)) != NULL &&
+         field_end != p) {
+    field_end += sizeof(CRLF) - 1;
+    if ((p + CONNECTION_LEN <= field_end &&
+         strncasecmp((char *)p, CONNECTION, CONNECTION_LEN) == 0) ||
+        (p + KEEP_ALIVE_LEN <= field_end &&
+         strncasecmp((char *)p, KEEP_ALIVE, KEEP_ALIVE_LEN) == 0)) {
+      field_len = field_end - p;
+      memmove(p, field_end, c->buf + c->last - field_end);
+      c->last -= field_len;
+      end -= field_len;
+      continue;
+    }
+    p = field_end;
+  }
+  return end - c->buf;
+}
+
+static int hex_digit(u_char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+/*
+ * Follows the chunked framing of the upstream body over the next n bytes
+ * in p, so that the upstream can be reused once the last chunk and the
+ * trailer are relayed. Returns 1 when the body is complete, 0 while more
+ * is expected and -1 on a framing error or bytes past the end.
+ */
+static int parse_chunked(ngx_connection_t *u, u_char *p, size_t n) {
+  u_char *end = p + n;
+  size_t len;
+  int d;
+
+  while (p < end) {
+    switch (u->chunk_state) {
+    case CHUNK_SIZE:
+      d = hex_digit(*p);
+      if (d >= 0) {
+        if (u->chunk_size > (SIZE_MAX >> 4)) {
+          return -1;
+        }
+        u->chunk_size = (u->chunk_size << 4) | d;
+      } else if (*p == ';' || *p == ' ' || *p == '\t') {
+        u->chunk_state = CHUNK_EXTENSION;
+      } else if (*p == '\r') {
+        u->chunk_state = CHUNK_SIZE_LF;
+      } else {
+        return -1;
+      }
+      p++;
+      break;
+    case CHUNK_EXTENSION:
+      if (*p++ == '\r') {
+        u->chunk_state = CHUNK_SIZE_LF;
+      }
+      break;
+    case CHUNK_SIZE_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = u->chunk_size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+      break;
+    case CHUNK_DATA:
+      len = end - p;
+      if (len > u->chunk_size) {
+        len = u->chunk_size;
+      }
+      p += len;
+      u->chunk_size -= len;
+      if (u->chunk_size == 0) {
+        u->chunk_state = CHUNK_DATA_CR;
+      }
+      break;
+    case CHUNK_DATA_CR:
+      if (*p++ != '\r') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_DATA_LF;
+      break;
+    case CHUNK_DATA_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_SIZE;
+      break;
+    case CHUNK_TRAILER:
+      u->chunk_state = *p++ == '\r' ? CHUNK_LAST_LF : CHUNK_TRAILER_LINE;
+      break;
+    case CHUNK_TRAILER_LINE:
+      if (*p++ == '\n') {
+        u->chunk_state = CHUNK_TRAILER;
+      }
+      break;
+    case CHUNK_LAST_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_DONE;
+      break;
+    default:
+      /* bytes after the end of the body */
+      return -1;
+    }
+  }
+  return u->chunk_state == CHUNK_DONE;
+}
+
+/* Whether the whole response has been received from the upstream. */
+static int response_complete(ngx_connection_t *u) {
+  if (u->close_delimited) {
+    return 0;
+  }
+  return u->chunked ? u->chunk_state == CHUNK_DONE : u->remaining == 0;
+}
+
+static void finalize_upstream(worker_t *wk, ngx_connection_t *u) {
+  if (u->prev != NULL) {
+    keepalive_remove(wk, u);
+  }
+  if (u->peer != NULL) {
+    u->peer->peer = NULL;
+    u->peer = NULL;
+  }
+  close_connection(wk, u);
+}
+
+static void finalize_client(worker_t *wk, ngx_connection_t *c) {
+  /* an upstream in the middle of a response cannot be reused */
+  if (c->peer != NULL) {
+    finalize_upstream(wk, c->peer);
+  }
+  close_connection(wk, c);
+}
+
+static ngx_connection_t *upstream_connect(worker_t *wk) {
+  ngx_socket_t fd;
+  ngx_connection_t *u;
+
+  fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    perror("socket: upstream");
+    return NULL;
+  }
+
+  u = get_connection(wk, fd, UPSTREAM);
+  if (u == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  if (set_tcp_nodelay(u) == -1) {
+    close_connection(wk, u);
+    return NULL;
+  }
+
+  if (connect(fd, (struct sockaddr *)&wk->upstream_addr,
+              sizeof(wk->upstream_addr)) == -1 &&
+      errno != EINPROGRESS) {
+    perror("connect: upstream");
+    close_connection(wk, u);
+    return NULL;
+  }
+
+  if (add_connection(wk, u) == -1) {
+    close_connection(wk, u);
+    return NULL;
+  }
+
+  u->state = UPSTREAM_CONNECTING;
+  return u;
+}
+
+static ngx_connection_t *upstream_get(worker_t *wk) {
+  ngx_connection_t *u;
+
+  /* LIFO so that the most recently used (and still warm) socket is reused */
+  u = wk->keepalive.next;
+  if (u != &wk->keepalive) {
+    keepalive_remove(wk, u);
+    u->reused = 1;
+    u->state = UPSTREAM_SENDING;
+    return u;
+  }
+  return upstream_connect(wk);
+}
+
+static void upstream_release(worker_t *wk, ngx_connection_t *u) {
+  ngx_connection_t *oldest;
+
+  u->peer = NULL;
+  if (!u->keepalive) {
+    close_connection(wk, u);
+    return;
+  }
+
+  if (wk->keepalive_n == KEEPALIVE_CONNECTIONS) {
+    oldest = wk->keepalive.prev;
+    finalize_upstream(wk, oldest);
+  }
+
+  u->state = UPSTREAM_IDLE;
+  u->pos = 0;
+  u->last = 0;
+  keepalive_insert(wk, u);
+}
+
+/*
+ * Starts forwarding the request framed in c->buf[0, c->request_len).
+ */
+static void proxy_request(worker_t *wk, ngx_connection_t *c) {
+  ngx_connection_t *u;
+
+  u = upstream_get(wk);
+  if (u == NULL) {
+    finalize_client(wk, c);
+    return;
+  }
+
+  c->state = CLIENT_WAITING_UPSTREAM;
+  c->pos = 0;
+  c->peer = u;
+  u->peer = c;
+  u->pos = 0;
+  u->last = 0;
+  u->header_len = 0;
+
+  if (u->state == UPSTREAM_SENDING) {
+    upstream_send(wk, u);
+  }
+}
+
+/*
+ * A reused keepalive connection may have been closed by the origin just
+ * before we wrote to it. Retry once on a fresh connection, like nginx's
+ * ngx_http_upstream_next does for NGX_HTTP_UPSTREAM_FT_ERROR.
+ */
+static void upstream_retry(worker_t *wk, ngx_connection_t *u) {
+  ngx_connection_t *c;
+
+  c = u->peer;
+  finalize_upstream(wk, u);
+
+  u = upstream_connect(wk);
+  if (u == NULL) {
+    finalize_client(wk, c);
+    return;
+  }
+  c->pos = 0;
+  c->peer = u;
+  u->peer = c;
+}
+
+static void upstream_send(worker_t *wk, ngx_connection_t *u) {
+  ngx_connection_t *c;
+  ssize_t n;
+  int err;
+  socklen_t len;
+
+  c = u->peer;
+
+  if (u->state == UPSTREAM_CONNECTING) {
+    len = sizeof(err);
+    if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 ||
+        err != 0) {
+      fprintf(stderr, "connect upstream failed: %s\n", strerror(err));
+      finalize_upstream(wk, u);
+      finalize_client(wk, c);
+      return;
+    }
+    u->state = UPSTREAM_SENDING;
+  }
+
+  while (c->pos < c->request_len) {
+    n = send(u->fd, c->buf + c->pos, c->request_len - c->pos, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      if (u->reused && c->pos == 0) {
+        upstream_retry(wk, u);
+        return;
+      }
+      perror("send: upstream");
+      finalize_upstream(wk, u);
+      finalize_client(wk, c);
+      return;
+    }
+    c->pos += n;
+  }
+
+  u->state = UPSTREAM_READING;
+  upstream_read(wk, u);
+}
+
+/*
+ * Writes u->buf[pos, last) to the client. Returns 1 when everything was
+ * written, 0 on EAGAIN and -1 on error.
+ */
+static int client_flush(ngx_connection_t *c, ngx_connection_t *u) {
+  ssize_t n;
+
+  while (u->pos < u->last) {
+    n = send(c->fd, u->buf + u->pos, u->last - u->pos, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      }
+      perror("send: client");
+      return -1;
+    }
+    u->pos += n;
+  }
+  u->pos = 0;
+  u->last = 0;
+  return 1;
+}
+
+static void finalize_request(worker_t *wk, ngx_connection_t *c,
+                             ngx_connection_t *u) {
+  size_t rest;
+
+  upstream_release(wk, u);
+  c->peer = NULL;
+
+  if (c->closing) {
+    close_connection(wk, c);
+    return;
+  }
+
+  if (set_tcp_nodelay(c) == -1) {
+    close_connection(wk, c);
+    return;
+  }
+
+  /* keep pipelined bytes which followed the request */
+  rest = c->last - c->request_len;
+  memmove(c->buf, c->buf + c->request_len, rest);
+  c->last = rest;
+  c->request_len = 0;
+  c->state = CLIENT_READING_REQUEST;
+  client_read(wk, c);
+}
+
+static void upstream_read(worker_t *wk, ngx_connection_t *u) {
+  ngx_connection_t *c;
+  ssize_t n;
+  int rc, closing, chunked;
+  long content_length;
+
+  c = u->peer;
+
+  for (;;) {
+    if (u->last == BUF_SIZE) {
+      /* the client has to drain the buffer before we read more */
+      return;
+    }
+
+    n = recv(u->fd, u->buf + u->last, BUF_SIZE - u->last, 0);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+    }
+
+    if (n <= 0) {
+      /* a stale pooled connection is closed or reset by the origin */
+      if (u->reused && u->header_len == 0 && u->last == 0 &&
+          (n == 0 || errno == ECONNRESET)) {
+        upstream_retry(wk, u);
+        return;
+      }
+      if (n == -1) {
+        perror("recv: upstream");
+      }
+      if (u->header_len != 0 && u->close_delimited) {
+        /* close delimited body is complete */
+        u->keepalive = 0;
+        c->closing = 1;
+        rc = client_flush(c, u);
+        if (rc == -1) {
+          finalize_upstream(wk, u);
+          finalize_client(wk, c);
+          return;
+        }
+        if (rc == 0) {
+          /* finish once the client accepted the rest */
+          u->remaining = 0;
+          u->close_delimited = 0;
+          return;
+        }
+        finalize_request(wk, c, u);
+        return;
+      }
+      finalize_upstream(wk, u);
+      finalize_client(wk, c);
+      return;
+    }
+    u->last += n;
+
+    if (u->header_len == 0) {
+      u->header_len = find_header_end(u->buf, u->last);
+      if (u->header_len == 0) {
+        if (u->last == BUF_SIZE) {
+          fprintf(stderr, "too large upstream response header\n");
+          finalize_upstream(wk, u);
+          finalize_client(wk, c);
+          return;
+        }
+        continue;
+      }
+
+      parse_header_fields(u->buf, u->header_len, &closing, &content_length,
+                          &chunked);
+      u->keepalive = !closing;
+      u->chunked = chunked;
+      if (content_length >= 0 && !chunked) {
+        if (u->last > u->header_len + content_length) {
+          fprintf(stderr, "upstream sent more data than expected\n");
+          finalize_upstream(wk, u);
+          finalize_client(wk, c);
+          return;
+        }
+        u->remaining = u->header_len + content_length - u->last;
+      } else if (chunked) {
+        /* relayed as is, while the framing tells where the body ends */
+        u->chunk_state = CHUNK_SIZE;
+        u->chunk_size = 0;
+        if (parse_chunked(u, u->buf + u->header_len,
+                          u->last - u->header_len) == -1) {
+          fprintf(stderr, "invalid upstream chunked body\n");
+          finalize_upstream(wk, u);
+          finalize_client(wk, c);
+          return;
+        }
+      } else {
+        /*
+         * A close delimited body is relayed as is until the origin closes,
+         * and neither side is kept alive.
+         */
+        u->keepalive = 0;
+        u->close_delimited = 1;
+        c->closing = 1;
+        u->remaining = 0;
+      }
+    } else if (u->chunked) {
+      if (parse_chunked(u, u->buf + u->last - n, n) == -1) {
+        fprintf(stderr, "invalid upstream chunked body\n");
+        finalize_upstream(wk, u);
+        finalize_client(wk, c);
+        return;
+      }
+    } else if (!u->close_delimited) {
+      if ((size_t)n > u->remaining) {
+        fprintf(stderr, "upstream sent more data than expected\n");
+        finalize_upstream(wk, u);
+        finalize_client(wk, c);
+        return;
+      }
+      u->remaining -= n;
+    }
+
+    rc = client_flush(c, u);
+    if (rc == -1) {
+      finalize_upstream(wk, u);
+      finalize_client(wk, c);
+      return;
+    }
+    if (rc == 0) {
+      /* resumed by the client write event */
+      return;
+    }
+    if (response_complete(u)) {
+      finalize_request(wk, c, u);
+      return;
+    }
+  }
+}
+
+static void client_write(worker_t *wk, ngx_connection_t *c) {
+  ngx_connection_t *u;
+  int rc;
+
+  u = c->peer;
+  if (u == NULL || u->state != UPSTREAM_READING || u->pos == u->last) {
+    return;
+  }
+
+  rc = client_flush(c, u);
+  if (rc == -1) {
+    finalize_upstream(wk, u);
+    finalize_client(wk, c);
+    return;
+  }
+  if (rc == 0) {
+    return;
+  }
+  if (response_complete(u)) {
+    finalize_request(wk, c, u);
+    return;
+  }
+  upstream_read(wk, u);
+}
+
+static void client_read(worker_t *wk, ngx_connection_t *c) {
+  ssize_t n;
+  size_t header_len;
+  int closing, chunked;
+  long content_length;
+
+  if (c->state != CLIENT_READING_REQUEST) {
+    /* pipelined bytes are read once the current response is done */
+    return;
+  }
+
+  for (;;) {
+    header_len = find_header_end(c->buf, c->last);
+    if (header_len != 0) {
+      parse_header_fields(c->buf, header_len, &closing, &content_length,
+                          &chunked);
+      if (chunked ||
+          (content_length > 0 &&
+           header_len + content_length > BUF_SIZE)) {
+        fprintf(stderr, "unsupported request body\n");
+        finalize_client(wk, c);
+        return;
+      }
+      if (content_length < 0) {
+        content_length = 0;
+      }
+      if (header_len + content_length <= c->last) {
+        c->closing = closing;
+        header_len = strip_hop_by_hop(c, header_len);
+        c->request_len = header_len + content_length;
+        proxy_request(wk, c);
+        return;
+      }
+    } else if (c->last == BUF_SIZE) {
+      fprintf(stderr, "too large request header\n");
+      finalize_client(wk, c);
+      return;
+    }
+
+    n = recv(c->fd, c->buf + c->last, BUF_SIZE - c->last, 0);
+    if (n == -1) {
+      if (errno == EAGAIN) {
+        return;
+      }
+      perror("recv: client");
+    }
+    if (n <= 0) {
+      finalize_client(wk, c);
+      return;
+    }
+    c->last += n;
+  }
+}
+
+static void handle_accept(worker_t *wk, int server_fd) {
+  ngx_connection_t *c;
+  int client_fd;
+
+  client_fd = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK);
+  if (client_fd == -1) {
+    if (errno != EAGAIN) {
+      perror("accept");
+    }
+    return;
+  }
+
+  c = get_connection(wk, client_fd, CLIENT);
+  if (c == NULL) {
+    close(client_fd);
+    return;
+  }
+  c->state = CLIENT_READING_REQUEST;
+  if (add_connection(wk, c) == -1) {
+    close_connection(wk, c);
+  }
+}
+
+void *handle_client(void *arg) {
+  ngx_uint_t server_fd_requests = 0;
+  int server_fd;
+  struct epoll_event ev, events[MAX_EVENTS];
+  int nfds, i;
+  uint32_t revents;
+  unsigned instance;
+  ngx_connection_t *c, *connections;
+  worker_t wk;
+
+  server_fd = *(int *)arg;
+
+  connections = malloc(sizeof(ngx_connection_t) * WORKER_CONNECTIONS);
+  if (connections == NULL) {
+    fprintf(stderr, "cannot alloc connections\n");
+    exit(EXIT_FAILURE);
+  }
+  init_connections(connections, WORKER_CONNECTIONS);
+  wk.free_connections = &connections[0];
+  wk.free_connection_n = WORKER_CONNECTIONS;
+  wk.keepalive.next = &wk.keepalive;
+  wk.keepalive.prev = &wk.keepalive;
+  wk.keepalive_n = 0;
+
+  memset(&wk.upstream_addr, 0, sizeof(wk.upstream_addr));
+  wk.upstream_addr.sin_family = AF_INET;
+  wk.upstream_addr.sin_addr.s_addr = inet_addr(UPSTREAM_ADDR);
+  wk.upstream_addr.sin_port = htons(UPSTREAM_PORT);
+
+  wk.epoll_fd = epoll_create1(0);
+  if (wk.epoll_fd == -1) {
+    perror("epoll_create1 failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  /* the listener is tagged with a NULL pointer */
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(wk.epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+    perror("epoll_ctl: add server_fd");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  while (1) {
+    nfds = epoll_wait(wk.epoll_fd, events, MAX_EVENTS, -1);
+    if (nfds == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      close(server_fd);
+      exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < nfds; i++) {
+      if (events[i].data.ptr == NULL) {
+        handle_accept(&wk, server_fd);
+
+        /*
+         * Re-add the socket periodically so that other worker threads
+         * will get a chance to accept connections.
+         * See ngx_reorder_accept_events.
+         */
+        if (server_fd_requests++ % 16 == 0) {
+          if (epoll_ctl(wk.epoll_fd, EPOLL_CTL_DEL, server_fd, &ev) == -1) {
+            perror("epoll_ctl: del server_fd");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+          }
+
+          ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+          ev.data.ptr = NULL;
+          if (epoll_ctl(wk.epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+            perror("epoll_ctl: add server_fd");
+            close(server_fd);
+            exit(EXIT_FAILURE);
+          }
+        }
+        continue;
+      }
+
+      instance = (uintptr_t)events[i].data.ptr & 1;
+      c = (ngx_connection_t *)((uintptr_t)events[i].data.ptr & ~(uintptr_t)1);
+      revents = events[i].events;
+
+      if (c->fd == -1 || c->instance != instance) {
+        /* stale event for a connection closed earlier in this batch */
+        continue;
+      }
+
+      if (c->type == CLIENT) {
+        if (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+          client_write(&wk, c);
+          if (c->fd == -1 || c->instance != instance) {
+            continue;
+          }
+        }
+        if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+          client_read(&wk, c);
+        }
+        continue;
+      }
+
+      /* UPSTREAM */
+      if (c->state == UPSTREAM_IDLE) {
+        if (revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+          /* closed by the origin or unexpected data while idle */
+          finalize_upstream(&wk, c);
+        }
+        continue;
+      }
+      if ((revents & (EPOLLOUT | EPOLLERR | EPOLLHUP)) &&
+          (c->state == UPSTREAM_CONNECTING || c->state == UPSTREAM_SENDING)) {
+        upstream_send(&wk, c);
+        continue;
+      }
+      if ((revents & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+          c->state == UPSTREAM_READING) {
+        upstream_read(&wk, c);
+      }
+    }
+  }
+}
+
+static long get_logical_cpu_cores() { return sysconf(_SC_NPROCESSORS_ONLN); }
+
+static long get_num_cpus_from_env() {
+  char *val = getenv("NUM_CPUS");
+  if (val == NULL) {
+    return -1;
+  }
+  return atoi(val);
+}
+
+int main() {
+  int server_fd, rc, reuseaddr;
+  struct sockaddr_in server_addr;
+  unsigned long nb;
+  int thread_count = get_num_cpus_from_env();
+  if (thread_count == -1) {
+    thread_count = get_logical_cpu_cores();
+  }
+  printf("thread_count=%d\n", thread_count);
+  pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+  if (threads == NULL) {
+    fprintf(stderr, "cannot allocate threads\n");
+    exit(EXIT_FAILURE);
+  }
+
+  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_fd == -1) {
+    perror("socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_addr.s_addr = INADDR_ANY;
+  server_addr.sin_port = htons(PORT);
+
+  reuseaddr = 1;
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, (const void *)&reuseaddr,
+                 sizeof(int)) == -1) {
+    perror("setsockopt reuse addr failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  nb = 1;
+  if (ioctl(server_fd, FIONBIO, &nb) == -1) {
+    perror("ioctl FIONBIO failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) <
+      0) {
+    perror("bind failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  if (listen(server_fd, 511) < 0) {
+    perror("listen failed");
+    close(server_fd);
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    rc = pthread_create(&threads[i], NULL, handle_client, (void *)&server_fd);
+    if (rc != 0) {
+      perror("Create thread failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    rc = pthread_join(threads[i], NULL);
+    if (rc != 0) {
+      perror("Join thread failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  close(server_fd);
+  return 0;
+}
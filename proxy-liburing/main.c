@@ -0,0 +1,903 @@
+/* SPDX-License-Identifier: MIT */
+
+#define _GNU_SOURCE /* for memmem */
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+#define LISTEN_PORT 3001
+#define LISTEN_BACKLOG 511
+#define UPSTREAM_ADDR "127.0.0.1"
+#define UPSTREAM_PORT 3000
+#define WORKER_CONNECTIONS 1024
+#define KEEPALIVE_CONNECTIONS 32
+#define BUF_SIZE 4096
+
+typedef int ngx_int_t;
+typedef unsigned int ngx_uint_t;
+typedef unsigned char u_char;
+
+/*
+ * Several operations of one connection can be in flight at once when they
+ * are linked, so the operation is kept in the low bits of the user_data
+ * instead of in the connection.
+ */
+enum {
+  ACCEPT,
+  READ,
+  WRITE,
+  CLOSE,
+  UP_CONNECT,
+  UP_SEND,
+  UP_RECV,
+};
+
+#define OP_MASK 7
+
+enum {
+  CLIENT,
+  UPSTREAM,
+};
+
+/* the position in a chunked upstream body, see parse_chunked */
+typedef enum {
+  CHUNK_SIZE = 0,
+  CHUNK_EXTENSION,
+  CHUNK_SIZE_LF,
+  CHUNK_DATA,
+  CHUNK_DATA_CR,
+  CHUNK_DATA_LF,
+  CHUNK_TRAILER, /* at the start of a trailer line or the final CRLF */
+  CHUNK_TRAILER_LINE,
+  CHUNK_LAST_LF,
+  CHUNK_DONE
+} chunk_state_e;
+
+typedef struct connection connection;
+
+typedef struct connection {
+  uint8_t kind;
+  uint8_t closing;         /* client sent "Connection: close" */
+  uint8_t nodelay_set;
+  uint8_t error;           /* close once all pending operations completed */
+  uint8_t close_submitted;
+  uint8_t keepalive;       /* upstream may be reused after the response */
+  uint8_t reused;          /* upstream came from the keepalive pool */
+  uint8_t close_delimited; /* upstream body ends when the origin closes */
+  uint8_t chunked;         /* upstream body is chunked */
+  uint8_t chunk_state;     /* chunk_state_e */
+  uint8_t response_done;   /* client: the last WRITE ends the response */
+  uint8_t read_linked;     /* client: a READ is linked after the WRITE */
+  uint8_t retried;
+  uint16_t pending; /* operations submitted and not completed yet */
+  connection *next; /* free list or keepalive list link */
+  connection *peer;
+  int32_t fd;
+  uint32_t last;        /* bytes in buf */
+  uint32_t request_len; /* client: bytes of buf forwarded upstream */
+  uint32_t header_len;  /* upstream: response header length */
+  uint64_t remaining;   /* upstream: response bytes still expected */
+  uint64_t chunk_size;  /* upstream: bytes of the chunk still expected */
+  u_char buf[BUF_SIZE];
+} __attribute__((aligned(OP_MASK + 1))) connection;
+
+typedef struct {
+  struct io_uring ring;
+  connection *free_connections;
+  int free_connection_n;
+  connection *keepalive;
+  int keepalive_n;
+  struct sockaddr_in upstream_addr;
+} worker;
+
+static void init_connections(connection *connections, int connection_n) {
+  int i;
+  connection *c, *next;
+
+  i = connection_n;
+  c = connections;
+  next = NULL;
+
+  do {
+    i--;
+
+    c[i].next = next;
+    c[i].fd = -1;
+
+    next = &c[i];
+  } while (i);
+}
+
+static connection *get_connection(worker *wk, int fd, int kind) {
+  connection *c;
+
+  c = wk->free_connections;
+  if (c == NULL) {
+    fprintf(stderr, "worker_connections are not enough\n");
+    return NULL;
+  }
+  wk->free_connections = c->next;
+  wk->free_connection_n--;
+  memset(c, 0, offsetof(connection, buf));
+  c->fd = fd;
+  c->kind = kind;
+  return c;
+}
+
+static void free_connection(worker *wk, connection *c) {
+  c->fd = -1;
+  c->next = wk->free_connections;
+  wk->free_connections = c;
+  wk->free_connection_n++;
+}
+
+static int listen_socket(struct sockaddr_in *addr, int port) {
+  int fd, ret;
+
+  fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+  int32_t val = 1;
+  ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+  assert(ret != -1);
+
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = inet_addr("127.0.0.1");
+  addr->sin_port = htons(port);
+  ret = bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+  assert(!ret);
+  ret = listen(fd, LISTEN_BACKLOG);
+  assert(ret != -1);
+
+  return fd;
+}
+
+static int set_tcp_nodelay(connection *c) {
+  int tcp_nodelay = 1;
+
+  if (c->nodelay_set) {
+    return 0;
+  }
+  if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&tcp_nodelay,
+                 sizeof(int)) == -1) {
+    perror("setsockopt TCP_NODELAY");
+    return -1;
+  }
+  c->nodelay_set = 1;
+  return 0;
+}
+
+static struct io_uring_sqe *get_sqe(struct io_uring *ring) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  if (sqe == NULL) {
+    /* flush the SQ ring to the kernel and try again */
+    io_uring_submit(ring);
+    sqe = io_uring_get_sqe(ring);
+    if (sqe == NULL) {
+      fprintf(stderr, "cannot get sqe\n");
+      exit(1);
+    }
+  }
+  return sqe;
+}
+
+static void set_data(struct io_uring_sqe *sqe, connection *c, int op,
+                     unsigned flags) {
+  io_uring_sqe_set_data64(sqe, (uint64_t)(uintptr_t)c | op);
+  io_uring_sqe_set_flags(sqe, flags);
+  if (op != ACCEPT) {
+    c->pending++;
+  }
+}
+
+static void prep_accept(struct io_uring *ring, int fd, connection *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_accept(sqe, fd, NULL, NULL, 0);
+  set_data(sqe, c, ACCEPT, 0);
+}
+
+static void prep_recv(struct io_uring *ring, connection *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_recv(sqe, c->fd, c->buf + c->last, BUF_SIZE - c->last, 0);
+  set_data(sqe, c, READ, 0);
+}
+
+/*
+ * MSG_WAITALL makes io_uring retry short sends itself, and makes a short
+ * send fail the link so that the linked operation is not started.
+ */
+static void prep_send(struct io_uring *ring, connection *c, const void *buf,
+                      size_t len, unsigned flags) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_send(sqe, c->fd, buf, len, MSG_WAITALL | MSG_NOSIGNAL);
+  set_data(sqe, c, WRITE, flags);
+}
+
+static void prep_close(struct io_uring *ring, connection *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_close(sqe, c->fd);
+  c->close_submitted = 1;
+  set_data(sqe, c, CLOSE, 0);
+}
+
+static void prep_up_connect(struct io_uring *ring, connection *u,
+                            struct sockaddr_in *addr) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_connect(sqe, u->fd, (struct sockaddr *)addr, sizeof(*addr));
+  set_data(sqe, u, UP_CONNECT, IOSQE_IO_LINK);
+}
+
+static void prep_up_send(struct io_uring *ring, connection *u, connection *c) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_send(sqe, u->fd, c->buf, c->request_len,
+                     MSG_WAITALL | MSG_NOSIGNAL);
+  set_data(sqe, u, UP_SEND, IOSQE_IO_LINK);
+}
+
+static void prep_up_recv(struct io_uring *ring, connection *u) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  io_uring_prep_recv(sqe, u->fd, u->buf + u->last, BUF_SIZE - u->last, 0);
+  set_data(sqe, u, UP_RECV, 0);
+}
+
+/*
+ * Marks the connection as failed. It is closed as soon as the last of its
+ * pending operations, possibly cancelled by a broken link, has completed.
+ */
+static void fail_connection(worker *wk, connection *c) {
+  c->error = 1;
+  if (c->pending == 0 && !c->close_submitted) {
+    prep_close(&wk->ring, c);
+  }
+}
+
+static void finalize_upstream(worker *wk, connection *u) {
+  connection *c = u->peer;
+
+  u->peer = NULL;
+  fail_connection(wk, u);
+  if (c != NULL) {
+    c->peer = NULL;
+    fail_connection(wk, c);
+  }
+}
+
+static void finalize_client(worker *wk, connection *c) {
+  connection *u = c->peer;
+
+  c->peer = NULL;
+  fail_connection(wk, c);
+  if (u != NULL) {
+    /* an upstream in the middle of a response cannot be reused */
+    u->peer = NULL;
+    fail_connection(wk, u);
+  }
+}
+
+#define CRLF "\r\n"
+#define CRLFCRLF "\r\n\r\n"
+#define CONNECTION "connection:"
+#define CONNECTION_LEN (sizeof(CONNECTION) - 1)
+#define CONTENT_LENGTH "content-length:"
+#define CONTENT_LENGTH_LEN (sizeof(CONTENT_LENGTH) - 1)
+#define TRANSFER_ENCODING "transfer-encoding:"
+#define TRANSFER_ENCODING_LEN (sizeof(TRANSFER_ENCODING) - 1)
+#define CLOSE_TOKEN "close"
+#define CLOSE_TOKEN_LEN (sizeof(CLOSE_TOKEN) - 1)
+
+static u_char *skip_ows(u_char *s, u_char *end) {
+  while (s < end && (*s == ' ' || *s == '\t')) {
+    s++;
+  }
+  return s;
+}
+
+static int value_is_close(u_char *p, u_char *end) {
+  p = skip_ows(p, end);
+  return p + CLOSE_TOKEN_LEN <= end &&
+         strncasecmp((char *)p, CLOSE_TOKEN, CLOSE_TOKEN_LEN) == 0 &&
+         skip_ows(p + CLOSE_TOKEN_LEN, end) == end;
+}
+
+/*
+ * Returns the length of the header block including the terminating empty
+ * line, or 0 if it has not been received completely yet.
+ */
+static size_t find_header_end(u_char *buf, size_t n) {
+  u_char *p = memmem(buf, n, CRLFCRLF, sizeof(CRLFCRLF) - 1);
+  if (p == NULL) {
+    return 0;
+  }
+  return p - buf + sizeof(CRLFCRLF) - 1;
+}
+
+/*
+ * Scans the header fields in buf[0, header_len) for the fields the proxy
+ * needs to frame a message. content_length is set to -1 when there is no
+ * Content-Length field.
+ */
+static void parse_header_fields(u_char *buf, size_t header_len, int *closing,
+                                long *content_length, int *chunked) {
+  u_char *p, *end, *field_end;
+
+  *closing = 0;
+  *content_length = -1;
+  *chunked = 0;
+
+  end = buf + header_len;
+  p = memmem(buf, header_len, CRLF, sizeof(CRLF) - 1);
+  if (p == NULL) {
+    return;
+  }
+  p += sizeof(CRLF) - 1;
+  while ((field_end = memmem(p, end - p, CRLF, sizeof(CRLF) - 1)) != NULL &&
+         field_end != p) {
+    if (p + CONNECTION_LEN <= field_end &&
+        strncasecmp((char *)p, CONNECTION, CONNECTION_LEN) == 0) {
+      *closing = value_is_close(p + CONNECTION_LEN, field_end);
+    } else if (p + CONTENT_LENGTH_LEN <= field_end &&
+               strncasecmp((char *)p, CONTENT_LENGTH, CONTENT_LENGTH_LEN) ==
+                   0) {
+      *content_length = strtol((char *)p + CONTENT_LENGTH_LEN, NULL, 10);
+    } else if (p + TRANSFER_ENCODING_LEN <= field_end &&
+               strncasecmp((char *)p, TRANSFER_ENCODING,
+                           TRANSFER_ENCODING_LEN) == 0) {
+      *chunked = 1;
+    }
+    p = field_end + sizeof(CRLF) - 1;
+  }
+}
+
+/*
+ * Returns 1 and sets c->request_len and closing when buf holds a complete
+ * request, 0 when more bytes are needed and -1 for requests the proxy
+ * cannot frame. c->closing is left to the caller, since the request may be
+ * a pipelined one which follows a response still being written.
+ */
+static int frame_request(connection *c, int *closing) {
+  size_t header_len;
+  int chunked;
+  long content_length;
+
+  header_len = find_header_end(c->buf, c->last);
+  if (header_len == 0) {
+    return c->last == BUF_SIZE ? -1 : 0;
+  }
+
+  parse_header_fields(c->buf, header_len, closing, &content_length,
+                      &chunked);
+  if (chunked || (content_length > 0 &&
+                  header_len + content_length > BUF_SIZE)) {
+    fprintf(stderr, "unsupported request body\n");
+    return -1;
+  }
+  if (content_length < 0) {
+    content_length = 0;
+  }
+  if (header_len + content_length > c->last) {
+    return 0;
+  }
+  c->request_len = header_len + content_length;
+  return 1;
+}
+
+static int hex_digit(u_char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  ch |= 0x20;
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  return -1;
+}
+
+/*
+ * Follows the chunked framing of the upstream body over the next n bytes
+ * in p, so that the upstream can be reused once the last chunk and the
+ * trailer are relayed. Returns 1 when the body is complete, 0 while more
+ * is expected and -1 on a framing error or bytes past the end.
+ */
+static int parse_chunked(connection *u, u_char *p, size_t n) {
+  u_char *end = p + n;
+  size_t len;
+  int d;
+
+  while (p < end) {
+    switch (u->chunk_state) {
+    case CHUNK_SIZE:
+      d = hex_digit(*p);
+      if (d >= 0) {
+        if (u->chunk_size > (UINT64_MAX >> 4)) {
+          return -1;
+        }
+        u->chunk_size = (u->chunk_size << 4) | d;
+      } else if (*p == ';' || *p == ' ' || *p == '\t') {
+        u->chunk_state = CHUNK_EXTENSION;
+      } else if (*p == '\r') {
+        u->chunk_state = CHUNK_SIZE_LF;
+      } else {
+        return -1;
+      }
+      p++;
+      break;
+    case CHUNK_EXTENSION:
+      if (*p++ == '\r') {
+        u->chunk_state = CHUNK_SIZE_LF;
+      }
+      break;
+    case CHUNK_SIZE_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = u->chunk_size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+      break;
+    case CHUNK_DATA:
+      len = end - p;
+      if (len > u->chunk_size) {
+        len = u->chunk_size;
+      }
+      p += len;
+      u->chunk_size -= len;
+      if (u->chunk_size == 0) {
+        u->chunk_state = CHUNK_DATA_CR;
+      }
+      break;
+    case CHUNK_DATA_CR:
+      if (*p++ != '\r') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_DATA_LF;
+      break;
+    case CHUNK_DATA_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_SIZE;
+      break;
+    case CHUNK_TRAILER:
+      u->chunk_state = *p++ == '\r' ? CHUNK_LAST_LF : CHUNK_TRAILER_LINE;
+      break;
+    case CHUNK_TRAILER_LINE:
+      if (*p++ == '\n') {
+        u->chunk_state = CHUNK_TRAILER;
+      }
+      break;
+    case CHUNK_LAST_LF:
+      if (*p++ != '\n') {
+        return -1;
+      }
+      u->chunk_state = CHUNK_DONE;
+      break;
+    default:
+      /* bytes after the end of the body */
+      return -1;
+    }
+  }
+  return u->chunk_state == CHUNK_DONE;
+}
+
+/* Whether the whole response has been received from the upstream. */
+static int response_complete(connection *u) {
+  if (u->close_delimited) {
+    return 0;
+  }
+  return u->chunked ? u->chunk_state == CHUNK_DONE : u->remaining == 0;
+}
+
+static connection *upstream_connect(worker *wk) {
+  connection *u;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd == -1) {
+    perror("socket: upstream");
+    return NULL;
+  }
+  u = get_connection(wk, fd, UPSTREAM);
+  if (u == NULL) {
+    close(fd);
+    return NULL;
+  }
+  if (set_tcp_nodelay(u) == -1) {
+    close(fd);
+    free_connection(wk, u);
+    return NULL;
+  }
+  return u;
+}
+
+/*
+ * Forwards the request in c->buf[0, c->request_len). The upstream connect
+ * (for a new connection), the send and the first recv are linked so the
+ * whole exchange is submitted with a single io_uring_enter.
+ */
+static void proxy_request(worker *wk, connection *c, int fresh) {
+  connection *u = NULL;
+
+  if (!fresh && wk->keepalive != NULL) {
+    /* LIFO so that the most recently used socket is reused */
+    u = wk->keepalive;
+    wk->keepalive = u->next;
+    wk->keepalive_n--;
+    u->reused = 1;
+  } else {
+    u = upstream_connect(wk);
+    if (u == NULL) {
+      finalize_client(wk, c);
+      return;
+    }
+    prep_up_connect(&wk->ring, u, &wk->upstream_addr);
+  }
+
+  c->peer = u;
+  u->peer = c;
+  u->last = 0;
+  u->header_len = 0;
+  u->close_delimited = 0;
+  prep_up_send(&wk->ring, u, c);
+  prep_up_recv(&wk->ring, u);
+}
+
+/*
+ * A reused keepalive connection may have been closed by the origin just
+ * before we wrote to it. Retry once on a fresh connection, like nginx's
+ * ngx_http_upstream_next does for NGX_HTTP_UPSTREAM_FT_ERROR.
+ */
+static void upstream_retry(worker *wk, connection *u) {
+  connection *c = u->peer;
+
+  u->peer = NULL;
+  c->peer = NULL;
+  fail_connection(wk, u);
+  c->retried = 1;
+  proxy_request(wk, c, 1);
+}
+
+static void upstream_release(worker *wk, connection *u) {
+  u->peer = NULL;
+  if (!u->keepalive || wk->keepalive_n == KEEPALIVE_CONNECTIONS) {
+    fail_connection(wk, u);
+    return;
+  }
+  u->next = wk->keepalive;
+  wk->keepalive = u;
+  wk->keepalive_n++;
+}
+
+/*
+ * Handles the next request of a client: reads more bytes, or starts the
+ * next pipelined request already in the buffer.
+ */
+static void client_next(worker *wk, connection *c) {
+  int closing;
+
+  switch (frame_request(c, &closing)) {
+  case 1:
+    c->closing = closing;
+    if (set_tcp_nodelay(c) == -1) {
+      finalize_client(wk, c);
+      return;
+    }
+    c->retried = 0;
+    proxy_request(wk, c, 0);
+    break;
+  case 0:
+    prep_recv(&wk->ring, c);
+    break;
+  default:
+    finalize_client(wk, c);
+    break;
+  }
+}
+
+/*
+ * Relays u->buf[0, u->last) to the client. When the response is complete
+ * the next client READ is linked after the WRITE, otherwise the next
+ * upstream recv is, so that the buffer is reused only after it was sent.
+ */
+static void relay_response(worker *wk, connection *u, int done) {
+  connection *c = u->peer;
+  size_t rest;
+  int closing;
+
+  c->response_done = done;
+  c->read_linked = 0;
+
+  if (!done) {
+    prep_send(&wk->ring, c, u->buf, u->last, IOSQE_IO_LINK);
+    u->last = 0;
+    prep_up_recv(&wk->ring, u);
+    return;
+  }
+
+  /* keep pipelined bytes which followed the request */
+  rest = c->last - c->request_len;
+  memmove(c->buf, c->buf + c->request_len, rest);
+  c->last = rest;
+  c->request_len = 0;
+
+  if (!c->closing && frame_request(c, &closing) == 0) {
+    prep_send(&wk->ring, c, u->buf, u->last, IOSQE_IO_LINK);
+    prep_recv(&wk->ring, c);
+    c->read_linked = 1;
+  } else {
+    prep_send(&wk->ring, c, u->buf, u->last, 0);
+  }
+}
+
+static void handle_up_recv(worker *wk, connection *u, int res) {
+  connection *c = u->peer;
+  int closing, chunked;
+  long content_length;
+
+  if (res <= 0) {
+    if (u->reused && !c->retried && u->header_len == 0 && u->last == 0 &&
+        (res == 0 || res == -ECONNRESET)) {
+      upstream_retry(wk, u);
+      return;
+    }
+    if (res == 0 && u->close_delimited) {
+      /* close delimited body is complete */
+      u->keepalive = 0;
+      c->closing = 1;
+      relay_response(wk, u, 1);
+      return;
+    }
+    if (res < 0) {
+      fprintf(stderr, "upstream recv error: %s\n", strerror(-res));
+    }
+    finalize_upstream(wk, u);
+    return;
+  }
+  u->last += res;
+
+  if (u->header_len == 0) {
+    u->header_len = find_header_end(u->buf, u->last);
+    if (u->header_len == 0) {
+      if (u->last == BUF_SIZE) {
+        fprintf(stderr, "too large upstream response header\n");
+        finalize_upstream(wk, u);
+        return;
+      }
+      prep_up_recv(&wk->ring, u);
+      return;
+    }
+
+    parse_header_fields(u->buf, u->header_len, &closing, &content_length,
+                        &chunked);
+    u->keepalive = !closing;
+    u->chunked = chunked;
+    if (content_length >= 0 && !chunked) {
+      if (u->last > u->header_len + content_length) {
+        fprintf(stderr, "upstream sent more data than expected\n");
+        finalize_upstream(wk, u);
+        return;
+      }
+      u->remaining = u->header_len + content_length - u->last;
+    } else if (chunked) {
+      /* relayed as is, while the framing tells where the body ends */
+      u->chunk_state = CHUNK_SIZE;
+      u->chunk_size = 0;
+      if (parse_chunked(u, u->buf + u->header_len,
+                        u->last - u->header_len) == -1) {
+        fprintf(stderr, "invalid upstream chunked body\n");
+        finalize_upstream(wk, u);
+        return;
+      }
+    } else {
+      /*
+       * A close delimited body is relayed as is until the origin closes,
+       * and neither side is kept alive.
+       */
+      u->keepalive = 0;
+      u->close_delimited = 1;
+      c->closing = 1;
+      u->remaining = 0;
+    }
+  } else if (u->chunked) {
+    if (parse_chunked(u, u->buf + u->last - res, res) == -1) {
+      fprintf(stderr, "invalid upstream chunked body\n");
+      finalize_upstream(wk, u);
+      return;
+    }
+  } else if (!u->close_delimited) {
+    if ((uint64_t)res > u->remaining) {
+      fprintf(stderr, "upstream sent more data than expected\n");
+      finalize_upstream(wk, u);
+      return;
+    }
+    u->remaining -= res;
+  }
+
+  relay_response(wk, u, response_complete(u));
+}
+
+static void handle_write(worker *wk, connection *c, int res) {
+  connection *u = c->peer;
+
+  if (res < 0) {
+    fprintf(stderr, "send error: %s\n", strerror(-res));
+    finalize_client(wk, c);
+    return;
+  }
+  if (!c->response_done) {
+    /* the linked upstream recv continues the response */
+    return;
+  }
+
+  c->peer = NULL;
+  upstream_release(wk, u);
+  if (c->closing) {
+    fail_connection(wk, c);
+  } else if (!c->read_linked) {
+    client_next(wk, c);
+  }
+}
+
+static int serve(int server_sock) {
+  int ret = 0;
+  worker wk;
+  connection accept_conn;
+
+  ret = io_uring_queue_init(2048, &wk.ring, 0);
+  if (ret < 0) {
+    fprintf(stderr, "init ring error: %s\n", strerror(-ret));
+    return ret;
+  }
+
+  connection *connections = malloc(sizeof(connection) * WORKER_CONNECTIONS);
+  if (connections == NULL) {
+    fprintf(stderr, "cannot alloc connections\n");
+    return -1;
+  }
+  init_connections(connections, WORKER_CONNECTIONS);
+  wk.free_connections = &connections[0];
+  wk.free_connection_n = WORKER_CONNECTIONS;
+  wk.keepalive = NULL;
+  wk.keepalive_n = 0;
+
+  memset(&wk.upstream_addr, 0, sizeof(wk.upstream_addr));
+  wk.upstream_addr.sin_family = AF_INET;
+  wk.upstream_addr.sin_addr.s_addr = inet_addr(UPSTREAM_ADDR);
+  wk.upstream_addr.sin_port = htons(UPSTREAM_PORT);
+
+  prep_accept(&wk.ring, server_sock, &accept_conn);
+  while (1) {
+    io_uring_submit_and_wait(&wk.ring, 1);
+
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    unsigned count = 0;
+    io_uring_for_each_cqe(&wk.ring, head, cqe) {
+      ++count;
+      uint64_t data = io_uring_cqe_get_data64(cqe);
+      connection *c = (connection *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+      int op = data & OP_MASK;
+      int res = cqe->res;
+
+      if (op == ACCEPT) {
+        if (res < 0) {
+          fprintf(stderr, "accept error: %s\n", strerror(-res));
+        } else {
+          c = get_connection(&wk, res, CLIENT);
+          if (c == NULL) {
+            close(res);
+          } else {
+            prep_recv(&wk.ring, c);
+          }
+        }
+        prep_accept(&wk.ring, server_sock, &accept_conn);
+        continue;
+      }
+
+      c->pending--;
+      if (op == CLOSE) {
+        if (c->pending == 0) {
+          free_connection(&wk, c);
+        }
+        continue;
+      }
+      if (c->error) {
+        /* includes operations cancelled by a failed link */
+        fail_connection(&wk, c);
+        continue;
+      }
+
+      switch (op) {
+      case READ:
+        if (res <= 0) {
+          if (res < 0) {
+            fprintf(stderr, "recv error: %s\n", strerror(-res));
+          }
+          finalize_client(&wk, c);
+          break;
+        }
+        c->last += res;
+        client_next(&wk, c);
+        break;
+      case WRITE:
+        handle_write(&wk, c, res);
+        break;
+      case UP_CONNECT:
+        if (res < 0) {
+          fprintf(stderr, "upstream connect error: %s\n", strerror(-res));
+          finalize_upstream(&wk, c);
+        }
+        break;
+      case UP_SEND:
+        if (res < 0) {
+          if (c->reused && !c->peer->retried &&
+              (res == -EPIPE || res == -ECONNRESET)) {
+            upstream_retry(&wk, c);
+            break;
+          }
+          fprintf(stderr, "upstream send error: %s\n", strerror(-res));
+          finalize_upstream(&wk, c);
+        }
+        break;
+      case UP_RECV:
+        handle_up_recv(&wk, c, res);
+        break;
+      }
+    }
+    io_uring_cq_advance(&wk.ring, count);
+  }
+
+  return ret;
+}
+
+static void *thread_func(void *arg) {
+  int server_sock = *(int *)arg;
+  serve(server_sock);
+  return NULL;
+}
+
+static long get_logical_cpu_cores() { return sysconf(_SC_NPROCESSORS_ONLN); }
+
+int main(int argc, char *argv[]) {
+  int ret;
+  struct sockaddr_in addr;
+  int thread_count = get_logical_cpu_cores();
+  pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+  if (threads == NULL) {
+    fprintf(stderr, "cannot allocate threads\n");
+    exit(EXIT_FAILURE);
+  }
+
+  int32_t server_sock = listen_socket(&addr, LISTEN_PORT);
+
+  for (int i = 0; i < thread_count; i++) {
+    ret = pthread_create(&threads[i], NULL, thread_func, (void *)&server_sock);
+    if (ret != 0) {
+      perror("Create thread failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    ret = pthread_join(threads[i], NULL);
+    if (ret != 0) {
+      perror("Join thread failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  close(server_sock);
+  return 0;
+}
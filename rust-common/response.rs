@@ -0,0 +1,181 @@
+//! The response settings of the Rust origins, read from the same environment
+//! variables as the C origins in c-common:
+//!
+//! - `BODY_SIZE`: the body length in bytes with an optional K, M or G suffix.
+//!   The body repeats "Hello, world!\n", which is also the default body.
+//! - `CHUNKED`: 1 to send the body with chunked transfer encoding in chunks
+//!   of `CHUNK_SIZE` bytes instead of with a Content-Length.
+//! - `STATUS_MIX`: a comma separated list of status:weight like
+//!   "200:90,404:10", where a missing weight is 1.
+//!
+//! Each origin is a crate of its own, so this file is included with
+//! `#[path]` instead of being a dependency.
+
+#![allow(dead_code)]
+
+use std::cell::Cell;
+use std::env;
+use std::sync::OnceLock;
+
+pub const BODY: &[u8] = b"Hello, world!\n";
+pub const CHUNK_SIZE: usize = 16 * 1024;
+/// The longest schedule a `STATUS_MIX` may reduce to, as in c-common.
+const SCHEDULE_MAX: u32 = 1000;
+
+pub struct Settings {
+    pub body: Vec<u8>,
+    pub chunked: bool,
+    /// The body as it is sent, with the chunk framing if chunked.
+    wire_body: Vec<u8>,
+    schedule: Vec<u16>,
+}
+
+/// Returns the settings, which are read on the first call.
+pub fn settings() -> &'static Settings {
+    static SETTINGS: OnceLock<Settings> = OnceLock::new();
+    SETTINGS.get_or_init(Settings::from_env)
+}
+
+impl Settings {
+    fn from_env() -> Settings {
+        let body = match env::var("BODY_SIZE").ok().filter(|v| !v.is_empty()) {
+            Some(v) => match parse_size(&v) {
+                Some(size) => BODY.iter().copied().cycle().take(size).collect(),
+                None => BODY.to_vec(),
+            },
+            None => BODY.to_vec(),
+        };
+        let chunked = env::var("CHUNKED")
+            .ok()
+            .and_then(|v| v.parse::<i64>().ok())
+            .map_or(false, |v| v != 0);
+        let mix = match env::var("STATUS_MIX").ok().filter(|v| !v.is_empty()) {
+            Some(v) => parse_mix(&v).unwrap_or_else(|| panic!("invalid STATUS_MIX: {v}")),
+            None => vec![(200, 1)],
+        };
+
+        let mut wire_body = Vec::new();
+        if chunked {
+            for chunk in body.chunks(CHUNK_SIZE) {
+                wire_body.extend_from_slice(format!("{:x}\r\n", chunk.len()).as_bytes());
+                wire_body.extend_from_slice(chunk);
+                wire_body.extend_from_slice(b"\r\n");
+            }
+            wire_body.extend_from_slice(b"0\r\n\r\n");
+        } else {
+            wire_body.extend_from_slice(&body);
+        }
+
+        Settings {
+            body,
+            chunked,
+            wire_body,
+            schedule: schedule(&mix),
+        }
+    }
+
+    /// Returns the body as it is sent, for origins which write the response
+    /// themselves.
+    pub fn wire_body(&self) -> &[u8] {
+        &self.wire_body
+    }
+
+    /// Returns the body as UTF-8, which it always is since it repeats `BODY`.
+    pub fn body_str(&self) -> &str {
+        std::str::from_utf8(&self.body).unwrap()
+    }
+
+    /// Returns the status of the next response. Each thread goes through
+    /// the schedule on its own, like each worker of the C origins.
+    pub fn next_status(&self) -> u16 {
+        thread_local!(static NEXT: Cell<usize> = const { Cell::new(0) });
+
+        NEXT.with(|next| {
+            let i = next.get() % self.schedule.len();
+            next.set(i + 1);
+            self.schedule[i]
+        })
+    }
+}
+
+/// Returns the reason phrase of the statuses a `STATUS_MIX` may have.
+pub fn reason(status: u16) -> Option<&'static str> {
+    match status {
+        200 => Some("OK"),
+        400 => Some("Bad Request"),
+        403 => Some("Forbidden"),
+        404 => Some("Not Found"),
+        429 => Some("Too Many Requests"),
+        500 => Some("Internal Server Error"),
+        502 => Some("Bad Gateway"),
+        503 => Some("Service Unavailable"),
+        504 => Some("Gateway Timeout"),
+        _ => None,
+    }
+}
+
+/// Parses a size like get_size_from_env does, where a negative one means the
+/// default body.
+fn parse_size(s: &str) -> Option<usize> {
+    let (digits, shift) = match s.as_bytes()[s.len() - 1] {
+        b'k' | b'K' => (&s[..s.len() - 1], 10),
+        b'm' | b'M' => (&s[..s.len() - 1], 20),
+        b'g' | b'G' => (&s[..s.len() - 1], 30),
+        _ => (s, 0),
+    };
+    let size: i64 = digits
+        .parse()
+        .unwrap_or_else(|_| panic!("invalid BODY_SIZE: {s}"));
+    usize::try_from(size).ok().map(|size| size << shift)
+}
+
+fn parse_mix(s: &str) -> Option<Vec<(u16, u32)>> {
+    let mix = s
+        .split(',')
+        .map(|item| {
+            let (status, weight) = item.split_once(':').unwrap_or((item, "1"));
+            let status: u16 = status.parse().ok()?;
+            let weight: u32 = weight.parse().ok().filter(|&w| w > 0)?;
+            reason(status).map(|_| (status, weight))
+        })
+        .collect::<Option<Vec<_>>>()?;
+    if mix.len() > 8 {
+        return None;
+    }
+    Some(mix)
+}
+
+fn gcd(a: u32, b: u32) -> u32 {
+    if b == 0 {
+        a
+    } else {
+        gcd(b, a % b)
+    }
+}
+
+/// Spreads the statuses over the schedule by their weights with the smooth
+/// weighted round robin of ngx_http_upstream_get_peer, the same order as
+/// build_schedule in c-common/server.c.
+fn schedule(mix: &[(u16, u32)]) -> Vec<u16> {
+    let d = mix.iter().fold(0, |d, &(_, w)| gcd(w, d));
+    let weights: Vec<i64> = mix.iter().map(|&(_, w)| (w / d) as i64).collect();
+    let total: i64 = weights.iter().sum();
+    if total > SCHEDULE_MAX as i64 {
+        panic!("STATUS_MIX weights add up to more than {SCHEDULE_MAX}");
+    }
+
+    let mut current = vec![0; mix.len()];
+    (0..total)
+        .map(|_| {
+            let mut best = 0;
+            for i in 0..mix.len() {
+                current[i] += weights[i];
+                if current[i] > current[best] {
+                    best = i;
+                }
+            }
+            current[best] -= total;
+            mix[best].0
+        })
+        .collect()
+}
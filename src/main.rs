@@ -1,54 +1,124 @@
-use log::info;
+use log::{info, warn};
 use nix::{
-    sys::signal::{kill, Signal::SIGTERM},
+    sys::signal::{
+        kill,
+        Signal::{SIGQUIT, SIGTERM, SIGUSR2},
+    },
     unistd::Pid,
 };
 use std::{
+    collections::BTreeMap,
     env,
     error::Error,
-    fs::{create_dir_all, File},
+    ffi::OsStr,
+    fs::{create_dir_all, read_to_string, File},
     io::Write,
     path::{Path, PathBuf},
-    process::{Child, Command},
+    process::{self, Child, Command, Stdio},
     thread,
     time::Duration,
 };
 
+mod results;
+
 fn main() {
     env_logger::init_from_env(env_logger::Env::new().default_filter_or("info"));
 
-    cpu_power("performance").unwrap();
+    let args: Vec<String> = env::args().collect();
+    match args.get(1).map(String::as_str) {
+        None => {
+            cpu_power("performance").unwrap();
+            bench_all();
+            cpu_power("powersave").unwrap();
+        }
+        Some("sweep") => {
+            cpu_power("performance").unwrap();
+            sweep_all().unwrap();
+            cpu_power("powersave").unwrap();
+        }
+        Some("busy-poll") => {
+            cpu_power("performance").unwrap();
+            busy_poll_all().unwrap();
+            cpu_power("powersave").unwrap();
+        }
+        Some("summary") => {
+            results::summary(args.get(2).map_or("results", String::as_str)).unwrap();
+        }
+        Some("compare") if args.len() == 4 => {
+            let trees = |arg: &str| arg.split(',').map(PathBuf::from).collect::<Vec<_>>();
+            let threshold = env::var("REGRESSION_THRESHOLD")
+                .ok()
+                .and_then(|v| v.parse().ok())
+                .unwrap_or(5.0);
+            let error_tolerance = env::var("ERROR_RATE_TOLERANCE")
+                .ok()
+                .and_then(|v| v.parse().ok())
+                .unwrap_or(0.1);
+            if results::compare(
+                &trees(&args[2]),
+                &trees(&args[3]),
+                threshold,
+                error_tolerance,
+            )
+            .unwrap()
+            {
+                process::exit(1);
+            }
+        }
+        Some(_) => {
+            eprintln!(
+                "usage: benchmark-reverse-proxies [sweep | busy-poll | summary [dir] | \
+                 compare baseline[,baseline...] candidate[,candidate...]]"
+            );
+            process::exit(2);
+        }
+    }
+}
 
-    let origins = [
+fn origins() -> Vec<Server> {
+    vec![
         Server::Rust(String::from("origin-actix")),
         Server::Nginx(String::from("origin-nginx")),
-        Server::Rust(String::from("origin-c-epoll")),
+        Server::C(String::from("origin-c-epoll")),
         Server::MultiProcess(String::from("origin-c-epoll-mp")),
-        Server::Rust(String::from("origin-c-sync")),
+        Server::C(String::from("origin-c-sync")),
         Server::Rust(String::from("origin-heph")),
         Server::Rust(String::from("origin-hyper")),
-        Server::Rust(String::from("origin-liburing")),
+        Server::C(String::from("origin-liburing")),
         Server::Rust(String::from("origin-ntex")),
         Server::Rust(String::from("origin-pingora")),
         Server::Rust(String::from("origin-tokio")),
         Server::Rust(String::from("origin-toysync")),
-    ];
-    for origin in origins {
-        bench_http_origin(&origin).unwrap();
-    }
+    ]
+}
 
-    let proxies = [
+fn proxies() -> Vec<Server> {
+    vec![
         Server::Rust(String::from("proxy-actix")),
+        Server::C(String::from("proxy-c-epoll")),
         Server::Rust(String::from("proxy-hyper")),
+        Server::C(String::from("proxy-liburing")),
         Server::Rust(String::from("proxy-pingora")),
         Server::Nginx(String::from("proxy-nginx")),
-    ];
+    ]
+}
+
+fn bench_all() {
+    for origin in origins() {
+        bench_http_origin(&origin).unwrap();
+        bench_body_sizes(&origin).unwrap();
+    }
+    bench_send_zc(&Server::C(String::from("origin-liburing"))).unwrap();
+    bench_uring_rings(&Server::C(String::from("origin-liburing"))).unwrap();
+    bench_uring_fan_out(&Server::C(String::from("origin-liburing"))).unwrap();
+    bench_threads_modes(&Server::C(String::from("origin-c-sync"))).unwrap();
+    bench_batch_flush(&Server::C(String::from("origin-c-epoll"))).unwrap();
+    bench_reload(&Server::MultiProcess(String::from("origin-c-epoll-mp"))).unwrap();
+
     let origin = Server::Nginx(String::from("origin-nginx"));
-    for proxy in proxies {
+    for proxy in proxies() {
         bench_http_proxy(&proxy, &origin).unwrap();
     }
-
-    cpu_power("powersave").unwrap();
 }
 
 pub type DynError = Box<dyn Error + Send + Sync + 'static>;
@@ -64,50 +134,363 @@ fn bench_http_origin(origin: &Server) -> Result<(), DynError> {
 
     let name = origin.name();
     info!("benchmark origin: {}...", name);
-    let mut origin_proc = origin.spawn()?;
 
     let mut dir = PathBuf::from("results");
     dir.push(name);
     create_dir_all(&dir)?;
 
+    let mut origin_proc = origin.spawn(&dir)?;
+
     let url = "http://localhost:3000";
 
     thread::sleep(Duration::from_secs(2));
     run_curl(url, &dir)?;
 
     thread::sleep(Duration::from_secs(1));
-    run_oha(url, &dir, false)?;
+    run_loadgen(url, &dir, "loadgen-no-keepalive.json", &["-n"])?;
 
     thread::sleep(Duration::from_secs(1));
-    run_oha(url, &dir, true)?;
+    let profiler = Profiler::start(origin, &origin_proc, &dir)?;
+    run_loadgen_keepalive(url, &dir)?;
+    if let Some(profiler) = profiler {
+        profiler.finish(&dir)?;
+    }
+
+    thread::sleep(Duration::from_secs(1));
+    run_loadgen_corpus(url, &dir)?;
 
     origin.kill(&mut origin_proc)?;
     wait_and_write_output(origin_proc, &dir, "origin.txt")?;
     Ok(())
 }
 
+// Sweeps the response body size. CHUNKED and STATUS_MIX are passed on to the
+// origins from the environment of this program.
+fn bench_body_sizes(origin: &Server) -> Result<(), DynError> {
+    // origin-nginx returns the fixed body in its nginx.conf
+    if let Server::Nginx(_) = origin {
+        return Ok(());
+    }
+
+    let sizes = ["0", "1K", "16K", "256K", "4M"];
+    let url = "http://localhost:3000";
+
+    for size in sizes {
+        thread::sleep(Duration::from_secs(10));
+
+        let name = origin.name();
+        info!("benchmark origin: {}, body: {}...", name, size);
+
+        let mut dir = PathBuf::from("results");
+        dir.push(&name);
+        dir.push(size);
+        create_dir_all(&dir)?;
+
+        let mut origin_proc = origin.spawn_with_env(&dir, &[("BODY_SIZE", size)])?;
+
+        thread::sleep(Duration::from_secs(2));
+        run_loadgen_keepalive(url, &dir)?;
+
+        origin.kill(&mut origin_proc)?;
+        wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+    }
+    Ok(())
+}
+
+// Finds the body size above which SEND_ZC beats copying sends.
+fn bench_send_zc(origin: &Server) -> Result<(), DynError> {
+    let sizes = ["1K", "4K", "16K", "64K", "256K", "1M", "4M"];
+    let modes = [("copy", "-1"), ("zc", "0")];
+    let url = "http://localhost:3000";
+
+    for size in sizes {
+        for (mode, threshold) in modes {
+            thread::sleep(Duration::from_secs(10));
+
+            let name = origin.name();
+            info!(
+                "benchmark origin: {}, body: {}, send: {}...",
+                name, size, mode
+            );
+
+            let mut dir = PathBuf::from("results");
+            dir.push(format!("{}-send-zc", name));
+            dir.push(size);
+            dir.push(mode);
+            create_dir_all(&dir)?;
+
+            let mut origin_proc = origin.spawn_with_env(
+                &dir,
+                &[("BODY_SIZE", size), ("SEND_ZC_THRESHOLD", threshold)],
+            )?;
+
+            thread::sleep(Duration::from_secs(2));
+            run_loadgen_keepalive(url, &dir)?;
+
+            origin.kill(&mut origin_proc)?;
+            wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+        }
+    }
+    Ok(())
+}
+
+// Runs origin-liburing with each ring setup, with the sockets in the fd
+// table or as direct descriptors, and with single and multishot accept and
+// recv, into results/<origin>-ring/<setup>/<files>/<recv>/, to pick the ring
+// configuration to deploy. No keepalive is where direct accept counts.
+fn bench_uring_rings(origin: &Server) -> Result<(), DynError> {
+    let setups: [(&str, &[(&str, &str)]); 3] = [
+        ("default", &[]),
+        ("sqpoll", &[("SQPOLL", "1")]),
+        ("defer-taskrun", &[("DEFER_TASKRUN", "1")]),
+    ];
+    let files = [("fd", "0"), ("fixed", "1")];
+    let recvs = [("single", "0"), ("multishot", "1")];
+    let url = "http://localhost:3000";
+
+    for (setup, setup_envs) in setups {
+        for (file, fixed_files) in files {
+            for (recv, multishot) in recvs {
+                thread::sleep(Duration::from_secs(10));
+
+                let name = origin.name();
+                info!(
+                    "benchmark origin: {}, ring: {}, files: {}, recv: {}...",
+                    name, setup, file, recv
+                );
+
+                let mut dir = PathBuf::from("results");
+                dir.push(format!("{}-ring", name));
+                dir.push(setup);
+                dir.push(file);
+                dir.push(recv);
+                create_dir_all(&dir)?;
+
+                let mut envs = setup_envs.to_vec();
+                envs.push(("FIXED_FILES", fixed_files));
+                envs.push(("MULTISHOT", multishot));
+                let mut origin_proc = origin.spawn_with_env(&dir, &envs)?;
+
+                thread::sleep(Duration::from_secs(2));
+                run_loadgen(url, &dir, "loadgen-no-keepalive.json", &["-n"])?;
+
+                thread::sleep(Duration::from_secs(1));
+                run_loadgen_keepalive(url, &dir)?;
+
+                origin.kill(&mut origin_proc)?;
+                wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+            }
+        }
+    }
+    Ok(())
+}
+
+// Runs origin-liburing with the rings attached to one io-wq, and with an
+// acceptor handing connections to the least loaded ring as well, into
+// results/<origin>-<mode>/, against the accepts in every ring of the default
+// run. Without keepalive every request is a connection to spread.
+fn bench_uring_fan_out(origin: &Server) -> Result<(), DynError> {
+    let modes: [(&str, &[(&str, &str)]); 2] = [
+        ("attach-wq", &[("ATTACH_WQ", "1")]),
+        ("msg-ring", &[("ATTACH_WQ", "1"), ("MSG_RING", "1")]),
+    ];
+    let url = "http://localhost:3000";
+
+    for (mode, envs) in modes {
+        thread::sleep(Duration::from_secs(10));
+
+        let name = origin.name();
+        info!("benchmark origin: {}, rings: {}...", name, mode);
+
+        let mut dir = PathBuf::from("results");
+        dir.push(format!("{}-{}", name, mode));
+        create_dir_all(&dir)?;
+
+        let mut origin_proc = origin.spawn_with_env(&dir, envs)?;
+
+        thread::sleep(Duration::from_secs(2));
+        run_loadgen(url, &dir, "loadgen-no-keepalive.json", &["-n"])?;
+
+        thread::sleep(Duration::from_secs(1));
+        run_loadgen_keepalive(url, &dir)?;
+
+        origin.kill(&mut origin_proc)?;
+        wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+    }
+    Ok(())
+}
+
+// Runs origin-c-sync over the fd queue and with a thread per connection, the
+// THREADS_MODE other than its default accept in every thread, into
+// results/<origin>-<mode>/.
+fn bench_threads_modes(origin: &Server) -> Result<(), DynError> {
+    let url = "http://localhost:3000";
+
+    for mode in ["queue", "spawn"] {
+        thread::sleep(Duration::from_secs(10));
+
+        let name = origin.name();
+        info!("benchmark origin: {}, threads: {}...", name, mode);
+
+        let mut dir = PathBuf::from("results");
+        dir.push(format!("{}-{}", name, mode));
+        create_dir_all(&dir)?;
+
+        let mut origin_proc = origin.spawn_with_env(&dir, &[("THREADS_MODE", mode)])?;
+
+        thread::sleep(Duration::from_secs(2));
+        run_loadgen(url, &dir, "loadgen-no-keepalive.json", &["-n"])?;
+
+        thread::sleep(Duration::from_secs(1));
+        run_loadgen_keepalive(url, &dir)?;
+
+        origin.kill(&mut origin_proc)?;
+        wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+    }
+    Ok(())
+}
+
+// Runs origin-c-epoll with and without BATCH_FLUSH at loadgen depths 1 and
+// 64 into results/<origin>-batch-flush/{off,on}/p<depth>/, and logs the
+// syscalls per request from the stats of the origin, which only serves the
+// one loadgen run.
+fn bench_batch_flush(origin: &Server) -> Result<(), DynError> {
+    let modes = [("off", "0"), ("on", "1")];
+    let url = "http://localhost:3000";
+
+    for (mode, batch_flush) in modes {
+        for depth in ["1", "64"] {
+            thread::sleep(Duration::from_secs(10));
+
+            let name = origin.name();
+            info!(
+                "benchmark origin: {}, batch flush: {}, depth: {}...",
+                name, mode, depth
+            );
+
+            let mut dir = PathBuf::from("results");
+            dir.push(format!("{}-batch-flush", name));
+            dir.push(mode);
+            dir.push(format!("p{}", depth));
+            create_dir_all(&dir)?;
+
+            let mut origin_proc = origin.spawn_with_env(&dir, &[("BATCH_FLUSH", batch_flush)])?;
+
+            thread::sleep(Duration::from_secs(2));
+            run_loadgen(url, &dir, "loadgen-keepalive.json", &["-p", depth])?;
+
+            origin.kill(&mut origin_proc)?;
+            wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+
+            let stats: serde_json::Value =
+                serde_json::from_str(&read_to_string(dir.join("stats.json"))?)?;
+            let total = &stats["total"];
+            let requests = total["requests"].as_f64().unwrap_or(0.0);
+            if requests > 0.0 {
+                info!(
+                    "syscalls per request: {:.3}",
+                    total["syscalls"].as_f64().unwrap_or(0.0) / requests
+                );
+            }
+        }
+    }
+    Ok(())
+}
+
+// Upgrades origin-c-epoll-mp to a new binary 5 seconds into loadgen, with
+// the SIGUSR2 and SIGQUIT of nginx, and records the errors and the tail
+// latency around it. The runs with and without keepalive are in
+// results/<origin>-reload/loadgen-{keepalive,no-keepalive}.json. A reload
+// which drops no connection has no errors, only the retries of the idle
+// keepalive connections it closes.
+fn bench_reload(origin: &Server) -> Result<(), DynError> {
+    let runs: [(&str, &[&str]); 2] = [("keepalive", &[]), ("no-keepalive", &["-n"])];
+    let url = "http://localhost:3000";
+
+    for (run, extra_args) in runs {
+        thread::sleep(Duration::from_secs(10));
+
+        let name = origin.name();
+        info!("benchmark reload: {}, {}...", name, run);
+
+        let mut dir = PathBuf::from("results");
+        dir.push(format!("{}-reload", name));
+        create_dir_all(&dir)?;
+
+        let pid_file = dir.join("origin.pid");
+        let origin_proc =
+            origin.spawn_with_env(&dir, &[("PID_FILE", &pid_file.to_string_lossy())])?;
+        thread::sleep(Duration::from_secs(2));
+
+        let loadgen = {
+            let dir = dir.clone();
+            thread::spawn(move || {
+                run_loadgen(url, dir, &format!("loadgen-{}.json", run), extra_args)
+            })
+        };
+        thread::sleep(Duration::from_secs(5));
+        let old = read_pid(&pid_file)?;
+        kill(old, SIGUSR2)?;
+        let new = wait_new_pid(&pid_file, old)?;
+        kill(old, SIGQUIT)?;
+        loadgen.join().map_err(|_| "loadgen thread panicked")??;
+
+        // the old master has exited after its workers drained, and the new
+        // one writes to the same output
+        kill(new, SIGTERM)?;
+        wait_and_write_output(origin_proc, &dir, format!("origin-{}.txt", run))?;
+    }
+    Ok(())
+}
+
+fn read_pid<P: AsRef<Path>>(path: P) -> Result<Pid, DynError> {
+    Ok(Pid::from_raw(read_to_string(path)?.trim().parse()?))
+}
+
+// Waits for the new master of an upgrade to replace the pid of the old one
+// in the pid file, which it writes once its workers are started.
+fn wait_new_pid<P: AsRef<Path>>(path: P, old: Pid) -> Result<Pid, DynError> {
+    for _ in 0..100 {
+        thread::sleep(Duration::from_millis(100));
+        if let Ok(pid) = read_pid(&path) {
+            if pid != old {
+                return Ok(pid);
+            }
+        }
+    }
+    Err("the new binary did not start".into())
+}
+
 fn bench_http_proxy(proxy: &Server, origin: &Server) -> Result<(), DynError> {
     thread::sleep(Duration::from_secs(10));
 
     let name = proxy.name();
     info!("benchmark proxy: {}, origin: {}...", name, origin.name());
-    let mut origin_proc = origin.spawn()?;
-    let mut proxy_proc = proxy.spawn()?;
 
     let mut dir = PathBuf::from("results");
     dir.push(name);
     create_dir_all(&dir)?;
 
+    let mut origin_proc = origin.spawn(&dir)?;
+    let mut proxy_proc = proxy.spawn(&dir)?;
+
     let url = "http://localhost:3001";
 
     thread::sleep(Duration::from_secs(2));
     run_curl(url, &dir)?;
 
     thread::sleep(Duration::from_secs(1));
-    run_oha(url, &dir, false)?;
+    run_loadgen(url, &dir, "loadgen-no-keepalive.json", &["-n"])?;
 
     thread::sleep(Duration::from_secs(1));
-    run_oha(url, &dir, true)?;
+    let profiler = Profiler::start(proxy, &proxy_proc, &dir)?;
+    run_loadgen_keepalive(url, &dir)?;
+    if let Some(profiler) = profiler {
+        profiler.finish(&dir)?;
+    }
+
+    thread::sleep(Duration::from_secs(1));
+    run_loadgen_corpus(url, &dir)?;
 
     proxy.kill(&mut proxy_proc)?;
     wait_and_write_output(proxy_proc, &dir, "proxy.txt")?;
@@ -116,9 +499,144 @@ fn bench_http_proxy(proxy: &Server, origin: &Server) -> Result<(), DynError> {
     Ok(())
 }
 
+// The perf stat events of profile.json, where raw_syscalls:sys_enter counts
+// every syscall.
+const PERF_EVENTS: [&str; 7] = [
+    "cycles",
+    "instructions",
+    "cache-references",
+    "cache-misses",
+    "context-switches",
+    "cpu-migrations",
+    "raw_syscalls:sys_enter",
+];
+
+// Profiles a server with perf for the 15 seconds of the keepalive loadgen
+// run when PROFILE is set. It writes into the result dir:
+//
+// - perf-stat.csv: the counters of PERF_EVENTS.
+// - perf-syscalls.csv: the count of each syscall.
+// - perf.data and flamegraph.svg, if stackcollapse-perf.pl and flamegraph.pl
+//   of FlameGraph are in PATH.
+// - profile.json: the counters, IPC and the counters per request.
+struct Profiler {
+    perfs: Vec<Child>,
+}
+
+impl Profiler {
+    fn start<P: AsRef<Path>>(
+        server: &Server,
+        proc: &Child,
+        output_dir: P,
+    ) -> Result<Option<Profiler>, DynError> {
+        if env::var_os("PROFILE").is_none() {
+            return Ok(None);
+        }
+        let pids = server.pids(proc)?;
+        let dir = output_dir.as_ref();
+        let path = |name: &str| dir.join(name).into_os_string();
+        let perf = |args: &[&OsStr]| {
+            Command::new("perf")
+                .args(args)
+                .args(["-p", &pids, "--", "sleep", "15"])
+                .stdout(Stdio::null())
+                .spawn()
+        };
+
+        let events = PERF_EVENTS.join(",");
+        let perfs = vec![
+            perf(&[
+                "stat".as_ref(),
+                "-x,".as_ref(),
+                "-e".as_ref(),
+                events.as_ref(),
+                "-o".as_ref(),
+                &path("perf-stat.csv"),
+            ])?,
+            perf(&[
+                "stat".as_ref(),
+                "-x,".as_ref(),
+                "-e".as_ref(),
+                "syscalls:sys_enter_*".as_ref(),
+                "-o".as_ref(),
+                &path("perf-syscalls.csv"),
+            ])?,
+            perf(&[
+                "record".as_ref(),
+                "-F".as_ref(),
+                "999".as_ref(),
+                "-g".as_ref(),
+                "-o".as_ref(),
+                &path("perf.data"),
+            ])?,
+        ];
+        Ok(Some(Profiler { perfs }))
+    }
+
+    fn finish<P: AsRef<Path>>(self, output_dir: P) -> Result<(), DynError> {
+        for mut perf in self.perfs {
+            perf.wait()?;
+        }
+        let dir = output_dir.as_ref();
+
+        let cmd = format!(
+            "perf script -i {} | stackcollapse-perf.pl | flamegraph.pl > {}",
+            dir.join("perf.data").to_string_lossy(),
+            dir.join("flamegraph.svg").to_string_lossy(),
+        );
+        let status = Command::new("sh").arg("-c").arg(cmd).status()?;
+        if !status.success() {
+            warn!("cannot make flamegraph.svg in {}", dir.to_string_lossy());
+        }
+
+        let loadgen: serde_json::Value =
+            serde_json::from_str(&read_to_string(dir.join("loadgen-keepalive.json"))?)?;
+        let requests = loadgen["requests"].as_f64().unwrap_or(0.0);
+        let counters = read_perf_stat(dir.join("perf-stat.csv"))?;
+        let mut profile = serde_json::Map::new();
+        for (event, value) in &counters {
+            profile.insert(event.clone(), (*value).into());
+            if requests > 0.0 {
+                profile.insert(format!("{}_per_request", event), (value / requests).into());
+            }
+        }
+        if let (Some(cycles), Some(instructions)) =
+            (counters.get("cycles"), counters.get("instructions"))
+        {
+            if *cycles > 0.0 {
+                profile.insert(String::from("ipc"), (instructions / cycles).into());
+            }
+        }
+        profile.insert(String::from("requests"), requests.into());
+        let mut file = File::create(dir.join("profile.json"))?;
+        serde_json::to_writer(&mut file, &profile)?;
+        Ok(())
+    }
+}
+
+// Reads the counters from the CSV of perf stat -x, skipping the ones which
+// are not counted or supported.
+fn read_perf_stat<P: AsRef<Path>>(path: P) -> Result<BTreeMap<String, f64>, DynError> {
+    let mut counters = BTreeMap::new();
+    for line in read_to_string(path)?.lines() {
+        let fields: Vec<&str> = line.split(',').collect();
+        if line.starts_with('#') || fields.len() < 3 {
+            continue;
+        }
+        if let Ok(value) = fields[0].parse() {
+            counters.insert(String::from(fields[2]), value);
+        }
+    }
+    Ok(counters)
+}
+
 enum Server {
     Rust(String),
+    // A C server, stopped with SIGTERM. The origins on c-common write their
+    // stats to STATS_FILE on it.
+    C(String),
     Nginx(String),
+    // A C origin whose master process supervises worker processes.
     MultiProcess(String),
     Zig(String),
 }
@@ -127,26 +645,58 @@ impl Server {
     fn name(&self) -> String {
         match self {
             Server::Rust(name) => name.clone(),
+            Server::C(name) => name.clone(),
             Server::Nginx(config_dir) => config_dir.clone(),
             Server::MultiProcess(name) => name.clone(),
             Server::Zig(name) => name.clone(),
         }
     }
 
-    fn spawn(&self) -> Result<Child, DynError> {
+    fn spawn<P: AsRef<Path>>(&self, output_dir: P) -> Result<Child, DynError> {
+        self.spawn_with_env(output_dir, &[])
+    }
+
+    fn spawn_with_env<P: AsRef<Path>>(
+        &self,
+        output_dir: P,
+        envs: &[(&str, &str)],
+    ) -> Result<Child, DynError> {
+        self.spawn_on(output_dir, envs, None)
+    }
+
+    // Spawns the server on the CPUs in the taskset list if given.
+    fn spawn_on<P: AsRef<Path>>(
+        &self,
+        output_dir: P,
+        envs: &[(&str, &str)],
+        cpus: Option<&str>,
+    ) -> Result<Child, DynError> {
+        let mut stats_path = PathBuf::from(output_dir.as_ref());
+        stats_path.push("stats.json");
         match self {
             Server::Rust(name) => {
                 let mut server_path = PathBuf::from(name);
                 server_path.push("target/release");
                 server_path.push(name);
-                Ok(Command::new(server_path).spawn()?)
+                Ok(command(server_path, cpus)
+                    .envs(envs.iter().copied())
+                    .spawn()?)
+            }
+            Server::C(name) => {
+                let mut server_path = PathBuf::from(name);
+                server_path.push("target/release");
+                server_path.push(name);
+                Ok(command(server_path, cpus)
+                    .env("STATS_FILE", stats_path)
+                    .envs(envs.iter().copied())
+                    .spawn()?)
             }
             Server::Nginx(config_dir) => {
                 let mut path = env::current_dir()?;
                 path.push(config_dir);
                 path.push("nginx.conf");
                 let path = path.into_os_string().into_string().unwrap();
-                Ok(Command::new("/usr/sbin/nginx")
+                Ok(command("/usr/sbin/nginx", cpus)
                     .args(["-c", &path, "-g", "daemon off;"])
                     .spawn()?)
             }
@@ -154,32 +704,312 @@ impl Server {
                 let mut server_path = PathBuf::from(name);
                 server_path.push("target/release");
                 server_path.push(name);
-                Ok(Command::new(server_path).spawn()?)
+                Ok(command(server_path, cpus)
+                    .env("STATS_FILE", stats_path)
+                    .envs(envs.iter().copied())
+                    .spawn()?)
             }
             Server::Zig(name) => {
                 let mut server_path = PathBuf::from(name);
                 server_path.push("zig-out/bin");
                 server_path.push(name);
                 let cmd = format!("{} >/dev/null 2>&1", server_path.to_string_lossy());
-                Ok(Command::new("sh").arg("-c").arg(cmd).spawn()?)
+                Ok(command("sh", cpus).arg("-c").arg(cmd).spawn()?)
             }
         }
     }
 
+    // Returns the comma separated pids of the server processes for perf -p.
+    fn pids(&self, proc: &Child) -> Result<String, DynError> {
+        let name = match self {
+            Server::MultiProcess(name) => name,
+            Server::Zig(name) => name,
+            _ => return Ok(proc.id().to_string()),
+        };
+        let output = Command::new("pgrep").args(["-d,", "-f", name]).output()?;
+        Ok(String::from_utf8(output.stdout)?.trim().to_string())
+    }
+
     fn kill(&self, proc: &mut Child) -> Result<(), DynError> {
         match self {
             Server::Rust(_) => proc.kill()?,
+            Server::C(_) => kill(Pid::from_raw(proc.id() as i32), SIGTERM)?,
             Server::Nginx(_) => kill(Pid::from_raw(proc.id() as i32), SIGTERM)?,
-            Server::MultiProcess(name) => {
-                let cmd = format!("pgrep -f {} | xargs -r kill", name);
-                let _ = Command::new("sh").arg("-c").arg(cmd).output()?;
-            }
+            // the master stops its workers and dumps their stats
+            Server::MultiProcess(_) => kill(Pid::from_raw(proc.id() as i32), SIGTERM)?,
             Server::Zig(_) => proc.kill()?,
         }
         Ok(())
     }
 }
 
+const SWEEP_CONNECTIONS: [&str; 5] = ["1", "10", "100", "1000", "10000"];
+
+// Sweeps every server over the worker counts 1, 2, 4, ... up to its share of
+// the CPUs and loadgen over SWEEP_CONNECTIONS. The CPUs are split in two:
+// the servers run on the first ones, and loadgen (and origin-nginx behind
+// the proxies) on the last SWEEP_CLIENT_CPUS, half by default. Each point is
+// in results/sweep/<server>/w<workers>/c<connections>.json and a row of
+// results/sweep/sweep.csv.
+fn sweep_all() -> Result<(), DynError> {
+    let (server_cpus, client_cpu_list) = split_cpus()?;
+    let mut workers = Vec::new();
+    let mut n = 1;
+    while n < server_cpus {
+        workers.push(n);
+        n *= 2;
+    }
+    workers.push(server_cpus);
+
+    let dir = PathBuf::from("results/sweep");
+    create_dir_all(&dir)?;
+    let mut csv = File::create(dir.join("sweep.csv"))?;
+    writeln!(
+        csv,
+        "server,workers,connections,rps,p50_us,p99_us,p999_us,errors,busy_cores,rps_per_core"
+    )?;
+
+    let sweep = Sweep {
+        workers,
+        client_cpus: client_cpu_list,
+        duration: env::var("SWEEP_DURATION").unwrap_or_else(|_| String::from("10")),
+    };
+    for origin in origins() {
+        sweep.run(&mut csv, &origin, None)?;
+    }
+    let origin = Server::Nginx(String::from("origin-nginx"));
+    for proxy in proxies() {
+        sweep.run(&mut csv, &proxy, Some(&origin))?;
+    }
+    Ok(())
+}
+
+// Splits the CPUs for the sweeps, and returns the number of the first ones
+// for the servers and the taskset list of the last SWEEP_CLIENT_CPUS for
+// the clients.
+fn split_cpus() -> Result<(usize, String), DynError> {
+    let cpus = thread::available_parallelism()?.get();
+    if cpus < 2 {
+        return Err("the sweep needs at least 2 CPUs".into());
+    }
+    let client_cpus = env::var("SWEEP_CLIENT_CPUS")
+        .ok()
+        .and_then(|v| v.parse().ok())
+        .unwrap_or(cpus / 2)
+        .clamp(1, cpus - 1);
+    let server_cpus = cpus - client_cpus;
+    Ok((server_cpus, format!("{}-{}", server_cpus, cpus - 1)))
+}
+
+// Formats the RPS, latency in microseconds, errors, busy cores and RPS per
+// busy core of a loadgen result as CSV fields.
+fn point_fields(result: &serde_json::Value, busy_cores: f64) -> String {
+    let rps = result["rps"].as_f64().unwrap_or(0.0);
+    let latency = &result["latency_ns"];
+    let us = |key: &str| latency[key].as_f64().unwrap_or(0.0) / 1000.0;
+    format!(
+        "{:.1},{:.1},{:.1},{:.1},{},{:.2},{:.1}",
+        rps,
+        us("p50"),
+        us("p99"),
+        us("p999"),
+        result["errors"].as_u64().unwrap_or(0),
+        busy_cores,
+        if busy_cores > 0.0 {
+            rps / busy_cores
+        } else {
+            0.0
+        },
+    )
+}
+
+// The busy time of the n server CPUs as cores, between two cpu_ticks.
+fn busy_cores(before: (u64, u64), after: (u64, u64), n: usize) -> f64 {
+    // the servers are alone on their CPUs, so the busy time of the CPUs is
+    // the CPU time of the server and its softirqs
+    (after.0 - before.0) as f64 * n as f64 / (after.1 - before.1).max(1) as f64
+}
+
+// The open loop rates of the busy poll curves in requests per second.
+const BUSY_POLL_RATES: [&str; 6] = ["10000", "25000", "50000", "100000", "200000", "400000"];
+
+// Measures the latency against the CPU cost of BUSY_POLL in the epoll
+// origins. Each runs on the server CPUs of the sweep with a worker per CPU,
+// with BUSY_POLL off and at BUSY_POLL_USECS (50 by default), and is loaded
+// with the open loop at each of BUSY_POLL_RATES for SWEEP_DURATION seconds.
+// Each point is in results/busy-poll/<server>/us<usecs>/r<rate>.json and a
+// row of results/busy-poll/busy-poll.csv.
+fn busy_poll_all() -> Result<(), DynError> {
+    let (server_cpus, client_cpus) = split_cpus()?;
+    let usecs = env::var("BUSY_POLL_USECS").unwrap_or_else(|_| String::from("50"));
+    let duration = env::var("SWEEP_DURATION").unwrap_or_else(|_| String::from("10"));
+    let url = "http://localhost:3000";
+
+    let dir = PathBuf::from("results/busy-poll");
+    create_dir_all(&dir)?;
+    let mut csv = File::create(dir.join("busy-poll.csv"))?;
+    writeln!(
+        csv,
+        "server,busy_poll_us,rate,rps,p50_us,p99_us,p999_us,errors,busy_cores,rps_per_core"
+    )?;
+
+    let servers = [
+        Server::C(String::from("origin-c-epoll")),
+        Server::MultiProcess(String::from("origin-c-epoll-mp")),
+    ];
+    for server in &servers {
+        for busy_poll in ["0", &usecs] {
+            thread::sleep(Duration::from_secs(10));
+            let name = server.name();
+            info!("busy poll: {}, {} us...", name, busy_poll);
+
+            let mut dir = dir.clone();
+            dir.push(&name);
+            dir.push(format!("us{}", busy_poll));
+            create_dir_all(&dir)?;
+
+            let num_cpus = server_cpus.to_string();
+            let mut server_proc = server.spawn_on(
+                &dir,
+                &[("NUM_CPUS", &num_cpus), ("BUSY_POLL", busy_poll)],
+                Some(&format!("0-{}", server_cpus - 1)),
+            )?;
+            thread::sleep(Duration::from_secs(2));
+
+            for rate in BUSY_POLL_RATES {
+                thread::sleep(Duration::from_secs(1));
+                let before = cpu_ticks(server_cpus)?;
+                let result = run_loadgen_on(
+                    url,
+                    &dir,
+                    &format!("r{}.json", rate),
+                    &["-r", rate, "-d", &duration],
+                    Some(&client_cpus),
+                )?;
+                let after = cpu_ticks(server_cpus)?;
+                writeln!(
+                    csv,
+                    "{},{},{},{}",
+                    name,
+                    busy_poll,
+                    rate,
+                    point_fields(&result, busy_cores(before, after, server_cpus))
+                )?;
+            }
+
+            server.kill(&mut server_proc)?;
+            wait_and_write_output(server_proc, &dir, "server.txt")?;
+        }
+    }
+    Ok(())
+}
+
+struct Sweep {
+    workers: Vec<usize>,
+    client_cpus: String,
+    duration: String,
+}
+
+impl Sweep {
+    fn run(
+        &self,
+        csv: &mut File,
+        server: &Server,
+        origin: Option<&Server>,
+    ) -> Result<(), DynError> {
+        let name = server.name();
+        let url = if origin.is_some() {
+            "http://localhost:3001"
+        } else {
+            "http://localhost:3000"
+        };
+
+        for &workers in &self.workers {
+            thread::sleep(Duration::from_secs(10));
+            info!("sweep: {}, workers: {}...", name, workers);
+
+            let mut dir = PathBuf::from("results/sweep");
+            dir.push(&name);
+            dir.push(format!("w{}", workers));
+            create_dir_all(&dir)?;
+
+            let server_cpus = format!("0-{}", workers - 1);
+            let num_cpus = workers.to_string();
+            let mut origin_proc = match origin {
+                Some(origin) => Some(origin.spawn_on(&dir, &[], Some(&self.client_cpus))?),
+                None => None,
+            };
+            let mut server_proc =
+                server.spawn_on(&dir, &[("NUM_CPUS", &num_cpus)], Some(&server_cpus))?;
+            thread::sleep(Duration::from_secs(2));
+
+            for connections in SWEEP_CONNECTIONS {
+                thread::sleep(Duration::from_secs(1));
+                let before = cpu_ticks(workers)?;
+                let result = run_loadgen_on(
+                    url,
+                    &dir,
+                    &format!("c{}.json", connections),
+                    &["-c", connections, "-d", &self.duration],
+                    Some(&self.client_cpus),
+                )?;
+                let after = cpu_ticks(workers)?;
+                writeln!(
+                    csv,
+                    "{},{},{},{}",
+                    name,
+                    workers,
+                    connections,
+                    point_fields(&result, busy_cores(before, after, workers))
+                )?;
+            }
+
+            server.kill(&mut server_proc)?;
+            wait_and_write_output(server_proc, &dir, "server.txt")?;
+            if let (Some(origin), Some(mut origin_proc)) = (origin, origin_proc.take()) {
+                origin.kill(&mut origin_proc)?;
+                wait_and_write_output(origin_proc, &dir, "origin.txt")?;
+            }
+        }
+        Ok(())
+    }
+}
+
+// Returns the busy and total ticks of the CPUs 0 to n - 1 from /proc/stat.
+fn cpu_ticks(n: usize) -> Result<(u64, u64), DynError> {
+    let stat = read_to_string("/proc/stat")?;
+    let (mut busy, mut total) = (0, 0);
+    for line in stat.lines() {
+        let mut fields = line.split_whitespace();
+        let cpu = match fields.next().and_then(|f| f.strip_prefix("cpu")) {
+            Some(cpu) => cpu,
+            None => continue,
+        };
+        if cpu.parse::<usize>().map_or(true, |cpu| cpu >= n) {
+            continue;
+        }
+        // user nice system idle iowait irq softirq steal, where the guest
+        // times are already in user and nice
+        let ticks: Vec<u64> = fields.take(8).map(|f| f.parse().unwrap_or(0)).collect();
+        let sum: u64 = ticks.iter().sum();
+        total += sum;
+        busy += sum - ticks[3] - ticks[4];
+    }
+    Ok((busy, total))
+}
+
+// Returns the command of the program, run by taskset on the CPUs if given.
+fn command<S: AsRef<OsStr>>(program: S, cpus: Option<&str>) -> Command {
+    match cpus {
+        Some(cpus) => {
+            let mut cmd = Command::new("taskset");
+            cmd.args(["-c", cpus]).arg(program);
+            cmd
+        }
+        None => Command::new(program),
+    }
+}
+
 fn run_curl<P: AsRef<Path>>(url: &str, output_dir: P) -> Result<(), DynError> {
     let output = Command::new("curl").args(["-sSD", "-", url]).output()?;
     let mut path = PathBuf::from(output_dir.as_ref());
@@ -189,31 +1019,69 @@ fn run_curl<P: AsRef<Path>>(url: &str, output_dir: P) -> Result<(), DynError> {
     Ok(())
 }
 
-fn run_oha<P: AsRef<Path>>(url: &str, output_dir: P, keepalive: bool) -> Result<(), DynError> {
-    let mut args = vec![
-        "--no-tui",
-        "--output-format",
-        "json",
-        "-c",
-        "100",
-        "-z",
-        "15s",
-        "--latency-correction",
-    ];
-    if !keepalive {
-        args.push("--disable-keepalive");
-    }
-    args.push(url);
-    let output = Command::new("oha").args(args).output()?;
+// Runs loadgen for 15 seconds over 100 connections with the extra args and
+// writes its JSON to the filename in the output dir.
+fn run_loadgen<P: AsRef<Path>>(
+    url: &str,
+    output_dir: P,
+    filename: &str,
+    extra_args: &[&str],
+) -> Result<(), DynError> {
+    let mut args = vec!["-c", "100", "-d", "15"];
+    args.extend_from_slice(extra_args);
+    run_loadgen_on(url, output_dir, filename, &args, None)?;
+    Ok(())
+}
+
+// Runs loadgen with the args on the CPUs if given, writes its JSON to the
+// filename in the output dir and returns it.
+fn run_loadgen_on<P: AsRef<Path>>(
+    url: &str,
+    output_dir: P,
+    filename: &str,
+    args: &[&str],
+    cpus: Option<&str>,
+) -> Result<serde_json::Value, DynError> {
+    let output = command("loadgen/target/release/loadgen", cpus)
+        .args(args)
+        .arg(url)
+        .output()?;
     let mut path = PathBuf::from(output_dir.as_ref());
-    let filename = if keepalive {
-        "oha-keepalive.json"
-    } else {
-        "oha-no-keepalive.json"
-    };
     path.push(filename);
     let mut file = File::create(path)?;
     file.write_all(&output.stdout)?;
+    Ok(serde_json::from_slice(&output.stdout)?)
+}
+
+// Runs the closed loop, and the open loop at LOADGEN_RATE requests per second
+// when it is set, with LOADGEN_DEPTH requests pipelined on each connection.
+fn run_loadgen_keepalive<P: AsRef<Path>>(url: &str, output_dir: P) -> Result<(), DynError> {
+    let depth = env::var("LOADGEN_DEPTH").unwrap_or_else(|_| String::from("1"));
+    run_loadgen(url, &output_dir, "loadgen-keepalive.json", &["-p", &depth])?;
+    if let Ok(rate) = env::var("LOADGEN_RATE") {
+        thread::sleep(Duration::from_secs(1));
+        run_loadgen(
+            url,
+            &output_dir,
+            "loadgen-open-loop.json",
+            &["-p", &depth, "-r", &rate],
+        )?;
+    }
+    Ok(())
+}
+
+// Replays the request heads of LOADGEN_CORPUS (loadgen/corpus.txt by default)
+// with LOADGEN_DEPTH requests pipelined on each connection, so that the
+// parsers see header sets of the size of real traffic.
+fn run_loadgen_corpus<P: AsRef<Path>>(url: &str, output_dir: P) -> Result<(), DynError> {
+    let depth = env::var("LOADGEN_DEPTH").unwrap_or_else(|_| String::from("1"));
+    let corpus = env::var("LOADGEN_CORPUS").unwrap_or_else(|_| String::from("loadgen/corpus.txt"));
+    run_loadgen(
+        url,
+        &output_dir,
+        "loadgen-corpus.json",
+        &["-p", &depth, "-f", &corpus],
+    )?;
     Ok(())
 }
 
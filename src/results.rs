@@ -0,0 +1,335 @@
+//! Reads the loadgen results back. `summary` tabulates a results tree and
+//! `compare` checks the results of a change against a baseline over
+//! repeated runs.
+
+use std::{
+    collections::BTreeMap,
+    fs::{read_dir, read_to_string, File},
+    io::Write,
+    path::{Path, PathBuf},
+};
+
+use crate::DynError;
+
+/// The numbers of one loadgen run.
+#[derive(Clone)]
+struct Sample {
+    rps: f64,
+    p50_ms: f64,
+    p99_ms: f64,
+    p999_ms: f64,
+    requests: u64,
+    errors: u64,
+    /// Responses with a status other than 2xx.
+    non_2xx: u64,
+    /// The requests and errors of each request head, by its size in bytes.
+    heads: Vec<Head>,
+}
+
+#[derive(Clone)]
+struct Head {
+    bytes: u64,
+    requests: u64,
+    errors: u64,
+}
+
+impl Sample {
+    /// The percentage of the requests which failed.
+    fn error_rate(&self) -> f64 {
+        let total = self.requests + self.errors;
+        if total > 0 {
+            self.errors as f64 / total as f64 * 100.0
+        } else {
+            0.0
+        }
+    }
+
+    fn from_json(json: &serde_json::Value) -> Sample {
+        let ms = |key: &str| json["latency_ns"][key].as_f64().unwrap_or(0.0) / 1e6;
+        let non_2xx = json["statuses"].as_object().map_or(0, |statuses| {
+            statuses
+                .iter()
+                .filter(|(status, _)| !status.starts_with('2'))
+                .map(|(_, count)| count.as_u64().unwrap_or(0))
+                .sum()
+        });
+        let heads = json["heads"].as_array().map_or(Vec::new(), |heads| {
+            heads
+                .iter()
+                .map(|head| Head {
+                    bytes: head["bytes"].as_u64().unwrap_or(0),
+                    requests: head["requests"].as_u64().unwrap_or(0),
+                    errors: head["errors"].as_u64().unwrap_or(0),
+                })
+                .collect()
+        });
+        Sample {
+            rps: json["rps"].as_f64().unwrap_or(0.0),
+            p50_ms: ms("p50"),
+            p99_ms: ms("p99"),
+            p999_ms: ms("p999"),
+            requests: json["requests"].as_u64().unwrap_or(0),
+            errors: json["errors"].as_u64().unwrap_or(0),
+            non_2xx,
+            heads,
+        }
+    }
+}
+
+/// Reads every loadgen-<run>.json under root, keyed by its dir relative to
+/// root and the run, like "origin-c-epoll/16K keepalive".
+fn collect(root: &Path) -> Result<BTreeMap<String, Sample>, DynError> {
+    let mut samples = BTreeMap::new();
+    let mut dirs = vec![PathBuf::from(root)];
+    while let Some(dir) = dirs.pop() {
+        for entry in read_dir(&dir)? {
+            let path = entry?.path();
+            if path.is_dir() {
+                dirs.push(path);
+                continue;
+            }
+            let name = path.file_name().unwrap().to_string_lossy();
+            let run = match name
+                .strip_prefix("loadgen-")
+                .and_then(|name| name.strip_suffix(".json"))
+            {
+                Some(run) => run.to_string(),
+                None => continue,
+            };
+            let json: serde_json::Value = match serde_json::from_str(&read_to_string(&path)?) {
+                Ok(json) => json,
+                // an interrupted run leaves an empty file
+                Err(_) => continue,
+            };
+            let rel = dir.strip_prefix(root)?.to_string_lossy().into_owned();
+            samples.insert(format!("{} {}", rel, run), Sample::from_json(&json));
+        }
+    }
+    Ok(samples)
+}
+
+/// Returns the key of the same run of origin-nginx for a proxy result, which
+/// is the baseline of the proxy overhead.
+fn origin_key(key: &str) -> Option<String> {
+    let (dir, run) = key.rsplit_once(' ')?;
+    let (server, rest) = match dir.split_once('/') {
+        Some((server, rest)) => (server, format!("/{}", rest)),
+        None => (dir, String::new()),
+    };
+    if !server.starts_with("proxy-") {
+        return None;
+    }
+    Some(format!("origin-nginx{} {}", rest, run))
+}
+
+/// Prints a table of every result under root and writes it as
+/// summary.csv there. The proxies are compared with origin-nginx, which
+/// they proxy to, as the RPS they keep and the p99 latency they add. The
+/// request heads with errors, such as the corpus heads larger than the
+/// buffer of a server, follow by size, also in summary-heads.csv.
+pub fn summary<P: AsRef<Path>>(root: P) -> Result<(), DynError> {
+    let root = root.as_ref();
+    let samples = collect(root)?;
+    let mut csv = File::create(root.join("summary.csv"))?;
+    writeln!(
+        csv,
+        "result,rps,p50_ms,p99_ms,p999_ms,errors,non_2xx,rps_vs_origin,p99_added_ms"
+    )?;
+    println!(
+        "{:<40} {:>12} {:>9} {:>9} {:>9} {:>8} {:>8} {:>9} {:>9}",
+        "result",
+        "rps",
+        "p50 ms",
+        "p99 ms",
+        "p99.9 ms",
+        "errors",
+        "non-2xx",
+        "vs origin",
+        "p99 +ms"
+    );
+    for (key, s) in &samples {
+        let (ratio, added) = match origin_key(key).and_then(|k| samples.get(&k)) {
+            Some(o) if o.rps > 0.0 => (
+                format!("{:.1}%", s.rps / o.rps * 100.0),
+                format!("{:.3}", s.p99_ms - o.p99_ms),
+            ),
+            _ => (String::new(), String::new()),
+        };
+        println!(
+            "{:<40} {:>12.1} {:>9.3} {:>9.3} {:>9.3} {:>8} {:>8} {:>9} {:>9}",
+            key, s.rps, s.p50_ms, s.p99_ms, s.p999_ms, s.errors, s.non_2xx, ratio, added
+        );
+        writeln!(
+            csv,
+            "{},{:.1},{:.3},{:.3},{:.3},{},{},{},{}",
+            key,
+            s.rps,
+            s.p50_ms,
+            s.p99_ms,
+            s.p999_ms,
+            s.errors,
+            s.non_2xx,
+            ratio.trim_end_matches('%'),
+            added
+        )?;
+    }
+
+    let mut csv = File::create(root.join("summary-heads.csv"))?;
+    writeln!(csv, "result,head_bytes,requests,errors")?;
+    let mut printed = false;
+    for (key, s) in &samples {
+        let mut heads: Vec<&Head> = s.heads.iter().filter(|h| h.errors > 0).collect();
+        heads.sort_by_key(|h| h.bytes);
+        for h in heads {
+            if !printed {
+                println!(
+                    "\n{:<40} {:>10} {:>12} {:>12}",
+                    "errors by request head", "bytes", "requests", "errors"
+                );
+                printed = true;
+            }
+            println!(
+                "{:<40} {:>10} {:>12} {:>12}",
+                key, h.bytes, h.requests, h.errors
+            );
+            writeln!(csv, "{},{},{},{}", key, h.bytes, h.requests, h.errors)?;
+        }
+    }
+    Ok(())
+}
+
+/// The two sided 95% critical values of Student's t by degrees of freedom,
+/// looked up at the largest df not above the actual one.
+const T_CRITICAL: [(f64, f64); 16] = [
+    (1.0, 12.706),
+    (2.0, 4.303),
+    (3.0, 3.182),
+    (4.0, 2.776),
+    (5.0, 2.571),
+    (6.0, 2.447),
+    (7.0, 2.365),
+    (8.0, 2.306),
+    (9.0, 2.262),
+    (10.0, 2.228),
+    (12.0, 2.179),
+    (15.0, 2.131),
+    (20.0, 2.086),
+    (30.0, 2.042),
+    (60.0, 2.000),
+    (f64::INFINITY, 1.960),
+];
+
+fn mean_var(xs: &[f64]) -> (f64, f64) {
+    let n = xs.len() as f64;
+    let mean = xs.iter().sum::<f64>() / n;
+    let var = if xs.len() > 1 {
+        xs.iter().map(|x| (x - mean) * (x - mean)).sum::<f64>() / (n - 1.0)
+    } else {
+        0.0
+    };
+    (mean, var)
+}
+
+/// Returns whether the means of a and b differ at 95% by Welch's t-test, or
+/// None with fewer than 2 runs on either side.
+fn significant(a: &[f64], b: &[f64]) -> Option<bool> {
+    if a.len() < 2 || b.len() < 2 {
+        return None;
+    }
+    let (ma, va) = mean_var(a);
+    let (mb, vb) = mean_var(b);
+    let (sa, sb) = (va / a.len() as f64, vb / b.len() as f64);
+    if sa + sb == 0.0 {
+        return Some(ma != mb);
+    }
+    let t = (mb - ma).abs() / (sa + sb).sqrt();
+    let df = (sa + sb).powi(2) / (sa * sa / (a.len() - 1) as f64 + sb * sb / (b.len() - 1) as f64);
+    let critical = T_CRITICAL
+        .iter()
+        .rev()
+        .find(|(d, _)| *d <= df)
+        .map_or(T_CRITICAL[0].1, |(_, c)| *c);
+    Some(t > critical)
+}
+
+/// Compares the results of the candidate trees against the baseline trees,
+/// each tree one run of the harness, and prints each result with its change
+/// in RPS and p99 latency. A result regresses when its RPS drops or its p99
+/// grows by more than threshold percent, or its error rate grows by more than
+/// error_tolerance percentage points, with the change significant across the
+/// runs. With a single run on either side the threshold or tolerance alone
+/// decides. Returns whether any result regressed.
+pub fn compare(
+    baseline: &[PathBuf],
+    candidate: &[PathBuf],
+    threshold: f64,
+    error_tolerance: f64,
+) -> Result<bool, DynError> {
+    let load = |roots: &[PathBuf]| -> Result<BTreeMap<String, Vec<Sample>>, DynError> {
+        let mut runs: BTreeMap<String, Vec<Sample>> = BTreeMap::new();
+        for root in roots {
+            for (key, sample) in collect(root)? {
+                runs.entry(key).or_default().push(sample);
+            }
+        }
+        Ok(runs)
+    };
+    let base = load(baseline)?;
+    let cand = load(candidate)?;
+
+    println!(
+        "{:<40} {:>12} {:>12} {:>8} {:>9} {:>9} {:>8}  verdict",
+        "result", "base rps", "rps", "rps %", "base p99", "p99 ms", "p99 %"
+    );
+    let mut regressed = false;
+    for (key, b) in &base {
+        let c = match cand.get(key) {
+            Some(c) => c,
+            None => {
+                println!("{:<40} missing in the candidate", key);
+                continue;
+            }
+        };
+        let rps = |s: &Vec<Sample>| s.iter().map(|s| s.rps).collect::<Vec<_>>();
+        let p99 = |s: &Vec<Sample>| s.iter().map(|s| s.p99_ms).collect::<Vec<_>>();
+        let error_rate = |s: &Vec<Sample>| s.iter().map(Sample::error_rate).collect::<Vec<_>>();
+        let (b_rps, c_rps) = (rps(b), rps(c));
+        let (b_err, c_err) = (error_rate(b), error_rate(c));
+        let (b_p99, c_p99) = (p99(b), p99(c));
+        let (mb_rps, mc_rps) = (mean_var(&b_rps).0, mean_var(&c_rps).0);
+        let (mb_p99, mc_p99) = (mean_var(&b_p99).0, mean_var(&c_p99).0);
+        let change = |from: f64, to: f64| {
+            if from > 0.0 {
+                (to - from) / from * 100.0
+            } else {
+                0.0
+            }
+        };
+        let rps_change = change(mb_rps, mc_rps);
+        let p99_change = change(mb_p99, mc_p99);
+
+        let mut verdicts = Vec::new();
+        if mean_var(&c_err).0 - mean_var(&b_err).0 > error_tolerance
+            && significant(&b_err, &c_err) != Some(false)
+        {
+            verdicts.push("errors");
+        }
+        if rps_change < -threshold && significant(&b_rps, &c_rps) != Some(false) {
+            verdicts.push("rps");
+        }
+        if p99_change > threshold && significant(&b_p99, &c_p99) != Some(false) {
+            verdicts.push("p99");
+        }
+        let verdict = if verdicts.is_empty() {
+            String::from("ok")
+        } else {
+            regressed = true;
+            format!("REGRESSION: {}", verdicts.join(", "))
+        };
+        println!(
+            "{:<40} {:>12.1} {:>12.1} {:>+7.1}% {:>9.3} {:>9.3} {:>+7.1}%  {}",
+            key, mb_rps, mc_rps, rps_change, mb_p99, mc_p99, p99_change, verdict
+        );
+    }
+    Ok(regressed)
+}